@@ -3,6 +3,7 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "rb3priv.h"
 #include "fm-index.h"
 #include "io.h"
@@ -25,7 +26,10 @@ typedef struct {
 	int32_t block_len;
 	int32_t max_nodes;
 	int32_t sort_order;
+	int32_t n_batches;
 	int64_t batch_size;
+	int64_t sais_blk;
+	int64_t mem_limit;
 } rb3_bopt_t;
 
 void rb3_bopt_init(rb3_bopt_t *opt)
@@ -38,50 +42,373 @@ void rb3_bopt_init(rb3_bopt_t *opt)
 	opt->max_nodes = ROPE_DEF_MAX_NODES;
 	opt->batch_size = 7000000000LL;
 	opt->sort_order = MR_SO_IO;
+	opt->n_batches = 1;
 }
 
+/*****************
+ * Batch planner *
+ *****************/
+
 typedef struct {
-	int64_t len;
-	uint8_t *bwt;
+	int64_t r_mem, r_tot; // memory and length of the current index
+	int64_t pending; // length of the batch being merged at the same time
+	double t_sais, t_merge; // time spent on the last batch
+	int32_t n_sais, n_merge; // number of threads used for the last batch
+} bd_stat_t;
+
+static void bd_stat_update(bd_stat_t *s, const mrope_t *r)
+{
+	s->r_mem = mr_mem(r), s->r_tot = mr_get_tot(r);
+}
+
+static int64_t bd_sais_mem(const rb3_bopt_t *opt, int64_t l)
+{ // text and SA
+	int64_t b = opt->sais_blk > 0 && l > opt->sais_blk? opt->sais_blk : l;
+	return l + (l>>1) + (b + 10000 >= INT32_MAX? 8 : 4) * (b + 10000);
+}
+
+static int64_t bd_merge_mem(const bd_stat_t *s, int64_t l)
+{ // text, the rank array in rb3_fmi_merge_plain() and the growth of the index
+	int64_t max = l > s->r_tot? l : s->r_tot;
+	int w = 4;
+	while (w < 64 && max >> (w - 3) > 0) ++w;
+	return l + (l>>1) + (l * w >> 3) + (int64_t)(l * (s->r_tot > 0? (double)s->r_mem / s->r_tot : 1.0));
+}
+
+static int64_t bd_peak(const rb3_bopt_t *opt, const bd_stat_t *s, int64_t l, int n_stage)
+{ // the reader holds one more batch with 2 or 3 pipeline stages; with 3 stages, SAIS runs together with the merge of the previous batch
+	int64_t x = bd_sais_mem(opt, l), y = bd_merge_mem(s, l), z = n_stage > 1? l + (l>>1) : 0;
+	if (n_stage > 2) return s->r_mem + bd_merge_mem(s, s->pending) + x + z;
+	return s->r_mem + (x > y? x : y) + z;
+}
+
+static int64_t bd_plan(const rb3_bopt_t *opt, const bd_stat_t *s, int n_stage, int32_t *sais_threads)
+{ // choose the largest batch fitting opt->mem_limit, and split threads by the work (time*threads) on the last batch
+	int64_t lo = 1<<20, hi = opt->batch_size;
+	if (hi < lo) lo = hi;
+	while (lo < hi) { // binary search; bd_peak() increases with the batch size
+		int64_t mid = lo + (hi - lo + 1) / 2;
+		if (bd_peak(opt, s, mid, n_stage) <= opt->mem_limit) lo = mid;
+		else hi = mid - 1;
+	}
+	if (sais_threads && s->t_sais > 0.0 && s->t_merge > 0.0 && s->n_sais > 0 && s->n_merge > 0) {
+		double w_sais = s->t_sais * s->n_sais, w_merge = s->t_merge * s->n_merge;
+		int32_t t = (int32_t)(opt->n_threads * w_sais / (w_sais + w_merge) + .499);
+		*sais_threads = t < 1? 1 : t > opt->n_threads - 1? opt->n_threads - 1 : t;
+	}
+	if (bd_peak(opt, s, lo, n_stage) > opt->mem_limit && rb3_verbose >= 2)
+		fprintf(stderr, "[W::%s] the memory limit is too small; estimated peak: %.2f GB\n", __func__, bd_peak(opt, s, lo, n_stage) / 1073741824.0);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] batch size: %ld; sais threads: %d; index: %.2f GB; estimated peak: %.2f GB\n", __func__, rb3_realtime(), rb3_percent_cpu(),
+				(long)lo, sais_threads? *sais_threads : opt->n_threads, s->r_mem / 1073741824.0, bd_peak(opt, s, lo, n_stage) / 1073741824.0);
+	return lo;
+}
+
+/******************
+ * Build pipeline *
+ ******************/
+
+typedef struct {
+	int64_t id, n_seq, len;
+	int32_t fid; // index of the input file
+	int32_t n_err; // number of input files failed to read before this batch
+	int32_t n_sais, n_merge; // number of threads for SAIS and merging, fixed when the batch is read
+	char *seq; // BWT after SAIS
+	double t_sais;
 } step_t;
 
 typedef struct {
 	const rb3_bopt_t *opt;
-	int64_t id;
+	int32_t n_stage; // 2: read | SAIS+merge; 3: read | SAIS | merge
+	int32_t n_fn, i_fn, last_fid;
+	char **fn;
+	const char *fn_tmp;
 	rb3_seqio_t *fp;
+	int64_t n_read;
+	int32_t sais_threads, n_err; // sais_threads is only accessed by the reader
 	mrope_t *r;
+	pthread_mutex_t lock; // protects st
+	bd_stat_t st;
 } pipeline_t;
 
-static void *worker_pipeline(void *shared, int step, void *in)
+static step_t *bd_read(pipeline_t *p)
+{ // read the next batch across all input files
+	const rb3_bopt_t *opt = p->opt;
+	step_t *t;
+	kstring_t seq = {0,0,0};
+	int64_t n_seq = 0, batch_size = opt->batch_size;
+	if (opt->mem_limit > 0) {
+		bd_stat_t st;
+		pthread_mutex_lock(&p->lock);
+		st = p->st;
+		pthread_mutex_unlock(&p->lock);
+		batch_size = bd_plan(opt, &st, p->n_read > 0? p->n_stage : 2, p->n_stage > 2? &p->sais_threads : 0);
+	}
+	seq.m = 0x100000;
+	seq.s = RB3_MALLOC(char, seq.m + 1);
+	for (;;) {
+		if (p->fp == 0) {
+			if (p->i_fn == p->n_fn) break;
+			p->fp = rb3_seq_open2(p->fn[p->i_fn++], !!(opt->flag&RB3_BF_LINE), opt->n_threads);
+			if (p->fp == 0 && rb3_verbose >= 1)
+				fprintf(stderr, "ERROR: failed to open file '%s'\n", p->fn[p->i_fn - 1]);
+			continue;
+		}
+		n_seq = rb3_seq_read(p->fp, &seq, batch_size, !(opt->flag&RB3_BF_NO_FOR), !(opt->flag&RB3_BF_NO_REV));
+		if (n_seq > 0) break;
+		if (rb3_seq_error(p->fp)) ++p->n_err;
+		rb3_seq_close(p->fp);
+		p->fp = 0;
+	}
+	if (n_seq == 0) {
+		free(seq.s);
+		return 0;
+	}
+	if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] read %ld symbols from file '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)seq.l, p->fn[p->i_fn - 1]);
+	t = RB3_CALLOC(step_t, 1);
+	t->id = p->n_read++, t->fid = p->i_fn - 1, t->n_err = p->n_err;
+	t->n_seq = n_seq, t->len = seq.l, t->seq = seq.s;
+	t->n_sais = p->n_stage < 3 || t->id == 0? opt->n_threads : p->sais_threads;
+	t->n_merge = p->n_stage < 3? opt->n_threads : opt->n_threads - p->sais_threads;
+	pthread_mutex_lock(&p->lock);
+	p->st.pending = seq.l;
+	pthread_mutex_unlock(&p->lock);
+	return t;
+}
+
+static void bd_sais(pipeline_t *p, step_t *t)
 {
+	double t0 = rb3_realtime();
+	rb3_build_sais_blk(t->n_seq, t->len, t->seq, p->opt->sais_blk, t->n_sais);
+	t->t_sais = rb3_realtime() - t0;
+	if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] constructed partial BWT for %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)t->len);
+}
+
+static void bd_save(const mrope_t *r, const char *fn)
+{
+	FILE *fp;
+	fp = fopen(fn, "w");
+	if (fp != 0) {
+		mr_dump((mrope_t*)r, fp);
+		fclose(fp);
+	}
+	if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] saved the current index to '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), fn);
+}
+
+static void bd_merge(pipeline_t *p, step_t *t)
+{
+	double t0 = rb3_realtime();
+	if (p->fn_tmp && p->r && t->fid != p->last_fid && t->n_err == 0) // the previous input file is done; don't save a partially read one
+		bd_save(p->r, p->fn_tmp);
+	p->last_fid = t->fid;
+	if (p->r == 0) p->r = rb3_enc_plain2fmr(t->len, (uint8_t*)t->seq, p->opt->max_nodes, p->opt->block_len, t->n_merge);
+	else rb3_fmi_merge_plain(p->r, t->len, (uint8_t*)t->seq, t->n_merge);
+	if (p->opt->mem_limit > 0) {
+		bd_stat_t st;
+		bd_stat_update(&st, p->r);
+		pthread_mutex_lock(&p->lock);
+		p->st.r_mem = st.r_mem, p->st.r_tot = st.r_tot;
+		p->st.t_sais = t->t_sais, p->st.t_merge = rb3_realtime() - t0;
+		p->st.n_sais = t->n_sais, p->st.n_merge = t->n_merge;
+		pthread_mutex_unlock(&p->lock);
+	}
+	if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] encoded/merged the partial BWT for %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)t->len);
+	free(t->seq); free(t);
+}
+
+static void *worker_pipeline(void *shared, int step, void *in)
+{ // the reader works on batch i+1 while SAIS and merging work on earlier batches
 	pipeline_t *p = (pipeline_t*)shared;
 	step_t *t = (step_t*)in;
 	if (step == 0) {
-		kstring_t seq = {0,0,0};
-		int64_t n_seq;
-		seq.m = 0x100000;
-		seq.s = RB3_MALLOC(char, seq.m + 1);
-		n_seq = rb3_seq_read(p->fp, &seq, p->opt->batch_size, !(p->opt->flag&RB3_BF_NO_FOR), !(p->opt->flag&RB3_BF_NO_REV));
-		if (n_seq > 0) {
-			int32_t n_threads = p->id == 0? p->opt->n_threads : p->opt->sais_threads;
-			if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] read %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)seq.l);
-			t = RB3_CALLOC(step_t, 1);
-			rb3_build_sais(n_seq, seq.l, seq.s, n_threads);
-			if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] constructed partial BWT for %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)seq.l);
-			t->len = seq.l, t->bwt = (uint8_t*)seq.s;
-			p->id++;
-			return t;
-		} else free(seq.s);
+		return bd_read(p);
 	} else if (step == 1) {
-		int32_t n_threads = p->opt->n_threads - p->opt->sais_threads;
-		if (p->r == 0) p->r = rb3_enc_plain2fmr(t->len, t->bwt, p->opt->max_nodes, p->opt->block_len, n_threads);
-		else rb3_fmi_merge_plain(p->r, t->len, t->bwt, n_threads);
-		if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] encoded/merged the partial BWT for %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)t->len);
-		free(t->bwt); free(t);
+		bd_sais(p, t);
+		if (p->n_stage == 3) return t;
+		bd_merge(p, t);
+	} else if (step == 2) {
+		bd_merge(p, t);
+	}
+	return 0;
+}
+
+/*****************************************
+ * Batch build with a balanced merge tree *
+ *****************************************/
+
+typedef struct {
+	int64_t n_seq;
+	kstring_t seq;
+	char *fn; // temporary FMD
+} hbatch_t;
+
+typedef struct {
+	const rb3_bopt_t *opt;
+	int32_t n_threads; // threads per batch
+	hbatch_t *b;
+} hbuild_t;
+
+static char *hb_tmp_name(const char *prefix, int64_t id)
+{
+	char *fn;
+	fn = RB3_MALLOC(char, strlen(prefix) + 32);
+	sprintf(fn, "%s.%.4ld.fmd", prefix, (long)id);
+	return fn;
+}
+
+static void worker_hbatch(void *data, long i, int tid)
+{ // construct the BWT of one batch and save it to a temporary FMD
+	hbuild_t *h = (hbuild_t*)data;
+	hbatch_t *b = &h->b[i];
+	rld_t *e;
+	rb3_build_sais_blk(b->n_seq, b->seq.l, b->seq.s, h->opt->sais_blk, h->n_threads);
+	e = rb3_enc_plain2rld(b->seq.l, (uint8_t*)b->seq.s, 3);
+	free(b->seq.s);
+	if (rld_dump(e, b->fn) < 0 && rb3_verbose >= 1)
+		fprintf(stderr, "ERROR: failed to write file '%s'\n", b->fn);
+	if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] saved the partial BWT for %ld symbols to '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)b->seq.l, b->fn);
+	rld_destroy(e);
+}
+
+static int hb_load(rb3_fmi_t *f, char *fn, int is_tmp, int use_mvt, int n_threads)
+{ // load an FMD or FMR as FMD; a temporary file is removed after loading
+	rb3_fmi_restore(f, fn, 0);
+	if (f->e == 0 && f->r == 0) {
+		if (rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: failed to load %s file '%s'\n", is_tmp? "temporary" : "FMR/FMD", fn);
+		return -1;
+	}
+	if (!f->is_fmd) rb3_fmi_init(f, rb3_enc_fmr2fmd(f->r, 0, n_threads, 1), 0);
+	if (use_mvt) rb3_fmi_to_mvt(f);
+	if (is_tmp) {
+		unlink(fn);
+		free(fn);
 	}
 	return 0;
 }
 
+static void hb_discard(char **fn, const uint8_t *is_tmp, int64_t st, int64_t en)
+{ // remove temporary files that have not been loaded
+	int64_t i;
+	for (i = st; i < en; ++i) {
+		if (!is_tmp[i]) continue;
+		unlink(fn[i]);
+		free(fn[i]);
+	}
+}
+
+rld_t *rb3_fmi_merge_tree(const char *prefix, int64_t n_fn, char **fn, int64_t n_in, int64_t id, int use_mvt, int n_threads)
+{ // merge adjacent indices level by level; the order of sequences is kept. On failure, all temporary files are removed
+	rb3_fmi_t fa, fb;
+	int64_t i, m;
+	uint8_t *is_tmp;
+	rld_t *e = 0;
+	if (n_fn == 0) return 0;
+	is_tmp = RB3_CALLOC(uint8_t, n_fn);
+	for (i = n_in; i < n_fn; ++i) is_tmp[i] = 1;
+	while (n_fn > 1) {
+		for (i = m = 0; i < n_fn; i += 2) {
+			if (i + 1 == n_fn) { // odd number of files; move the last one to the next level
+				fn[m] = fn[i], is_tmp[m++] = is_tmp[i];
+				continue;
+			}
+			if (hb_load(&fa, fn[i], is_tmp[i], 0, n_threads) < 0) {
+				hb_discard(fn, is_tmp, 0, m), hb_discard(fn, is_tmp, i, n_fn);
+				goto end_tree;
+			}
+			if (hb_load(&fb, fn[i+1], is_tmp[i+1], use_mvt, n_threads) < 0) {
+				rb3_fmi_free(&fa);
+				hb_discard(fn, is_tmp, 0, m), hb_discard(fn, is_tmp, i + 1, n_fn);
+				goto end_tree;
+			}
+			e = rb3_fmi_merge_fmd(&fa, &fb, n_threads, 1);
+			rb3_fmi_free(&fa);
+			if (n_fn == 2) goto end_tree;
+			fn[m] = hb_tmp_name(prefix, id++), is_tmp[m] = 1;
+			if (rld_dump(e, fn[m++]) < 0) {
+				if (rb3_verbose >= 1)
+					fprintf(stderr, "ERROR: failed to write temporary file '%s'\n", fn[m-1]);
+				rld_destroy(e);
+				e = 0;
+				hb_discard(fn, is_tmp, 0, m), hb_discard(fn, is_tmp, i + 2, n_fn);
+				goto end_tree;
+			}
+			rld_destroy(e);
+			e = 0;
+		}
+		if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] merged %ld BWTs into %ld\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)n_fn, (long)m);
+		n_fn = m;
+	}
+	if (hb_load(&fa, fn[0], is_tmp[0], 0, n_threads) == 0) e = fa.e;
+	else hb_discard(fn, is_tmp, 0, 1);
+end_tree:
+	free(is_tmp);
+	return e;
+}
+
+typedef struct {
+	int64_t n, m;
+	char **a;
+} hb_fnv_t;
+
+static void hb_flush(hbuild_t *h, int64_t n_b, hb_fnv_t *v)
+{ // build the pending batches concurrently
+	int64_t j;
+	kt_for(n_b, worker_hbatch, h, n_b);
+	for (j = 0; j < n_b; ++j) {
+		RB3_GROW(char*, v->a, v->n, v->m);
+		v->a[v->n++] = h->b[j].fn;
+	}
+}
+
+static int hb_build(const rb3_bopt_t *opt, const char *prefix, int n_fn, char **fn, rld_t **e)
+{ // build up to $opt->n_batches batches at a time, and then merge them in a balanced tree; return -1 on failure or the number of read errors
+	hbuild_t h;
+	hb_fnv_t v = {0,0,0};
+	int64_t n_b = 0, id = 0, batch_size = opt->batch_size;
+	int i, n_err = 0;
+
+	if (opt->mem_limit > 0) { // batches are built at the same time and there is no index in memory
+		rb3_bopt_t o = *opt;
+		bd_stat_t s;
+		memset(&s, 0, sizeof(s));
+		o.mem_limit /= opt->n_batches;
+		batch_size = bd_plan(&o, &s, 1, 0);
+	}
+	h.opt = opt;
+	h.b = RB3_CALLOC(hbatch_t, opt->n_batches);
+	h.n_threads = opt->n_threads / opt->n_batches > 1? opt->n_threads / opt->n_batches : 1;
+	for (i = 0; i < n_fn; ++i) {
+		rb3_seqio_t *fp;
+		fp = rb3_seq_open2(fn[i], !!(opt->flag&RB3_BF_LINE), opt->n_threads);
+		if (fp == 0) {
+			if (rb3_verbose >= 1)
+				fprintf(stderr, "ERROR: failed to open file '%s'\n", fn[i]);
+			continue;
+		}
+		for (;;) {
+			hbatch_t *b = &h.b[n_b];
+			memset(&b->seq, 0, sizeof(kstring_t));
+			b->n_seq = rb3_seq_read(fp, &b->seq, batch_size, !(opt->flag&RB3_BF_NO_FOR), !(opt->flag&RB3_BF_NO_REV));
+			if (b->n_seq <= 0) {
+				free(b->seq.s);
+				break;
+			}
+			if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] read %ld symbols from file '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)b->seq.l, fn[i]);
+			b->fn = hb_tmp_name(prefix, id++);
+			if (++n_b == opt->n_batches)
+				hb_flush(&h, n_b, &v), n_b = 0;
+		}
+		if (rb3_seq_error(fp)) ++n_err;
+		rb3_seq_close(fp);
+	}
+	if (n_b > 0) hb_flush(&h, n_b, &v);
+	free(h.b);
+	*e = rb3_fmi_merge_tree(prefix, v.n, v.a, 0, id, 0, opt->n_threads);
+	free(v.a);
+	return v.n > 0 && *e == 0? -1 : n_err;
+}
+
 static void mr_print_bre(mrope_t *r, const char *fn)
 {
 	mritr_t ri;
@@ -111,10 +438,14 @@ static int usage_build(FILE *fp, const rb3_bopt_t *opt)
 	fprintf(fp, "Options:\n");
 	fprintf(fp, "  Algorithm:\n");
 	fprintf(fp, "    -m NUM      batch size [7G]\n");
+	fprintf(fp, "    --mem-limit=NUM  choose the batch size and the -p thread split to fit NUM bytes []\n");
+	fprintf(fp, "    -B NUM      run sais on blocks of NUM symbols and merge them to reduce memory (0 for off) [0]\n");
 	fprintf(fp, "    -t INT      total number of threads [%d]\n", opt->n_threads);
 	fprintf(fp, "    -p INT      #threads for sais and run sais and merge together (more RAM) [%d]\n", opt->sais_threads);
 	fprintf(fp, "    -l INT      leaf block size in B+-tree [%d]\n", opt->block_len);
 	fprintf(fp, "    -n INT      max number children per internal node [%d]\n", opt->max_nodes);
+	fprintf(fp, "    -M STR      save batches to STR.*.fmd and merge them in a balanced tree []\n");
+	fprintf(fp, "    -P INT      number of batches built concurrently with -M [%d]\n", opt->n_batches);
 	fprintf(fp, "    -2          use the ropebwt2 algorithm (libsais by default)\n");
 	fprintf(fp, "    -s          build BWT in the reverse lexicographical order (RLO; force -2)\n");
 	fprintf(fp, "    -r          build BWT in RCLO (force -2)\n");
@@ -133,23 +464,32 @@ static int usage_build(FILE *fp, const rb3_bopt_t *opt)
 	return fp == stdout? 0 : 1;
 }
 
+static ko_longopt_t long_options[] = {
+	{ "mem-limit",       ko_required_argument, 301 },
+	{ 0, 0, 0 }
+};
+
 int main_build(int argc, char *argv[])
 {
 	rb3_bopt_t opt;
 	kstring_t seq = {0,0,0};
-	int32_t c, i;
+	int32_t c, i, n_err = 0;
 	ketopt_t o = KETOPT_INIT;
 	mrope_t *r = 0;
-	char *fn_in = 0, *fn_tmp = 0;
+	char *fn_in = 0, *fn_tmp = 0, *fn_hb = 0, *fn_out = 0;
 
 	rb3_bopt_init(&opt);
-	while ((c = ketopt(&o, argc, argv, 1, "l:n:m:t:2sri:LFRo:dbTS:p:e", 0)) >= 0) {
+	while ((c = ketopt(&o, argc, argv, 1, "l:n:m:t:2sri:LFRo:dbTS:p:eM:P:B:", long_options)) >= 0) {
 		// algorithm
 		if (c == 'm') opt.batch_size = rb3_parse_num(o.arg);
+		else if (c == 'B') opt.sais_blk = rb3_parse_num(o.arg);
+		else if (c == 301) opt.mem_limit = rb3_parse_num(o.arg);
 		else if (c == 't') opt.n_threads = atoi(o.arg);
 		else if (c == 'p') opt.sais_threads = atoi(o.arg);
 		else if (c == 'l') opt.block_len = atoi(o.arg);
 		else if (c == 'n') opt.max_nodes = atoi(o.arg);
+		else if (c == 'M') fn_hb = o.arg;
+		else if (c == 'P') opt.n_batches = atoi(o.arg);
 		else if (c == '2') opt.flag |= RB3_BF_USE_RB2;
 		else if (c == 's') opt.flag |= RB3_BF_USE_RB2, opt.sort_order = MR_SO_RLO;
 		else if (c == 'r') opt.flag |= RB3_BF_USE_RB2, opt.sort_order = MR_SO_RCLO;
@@ -159,7 +499,7 @@ int main_build(int argc, char *argv[])
 		else if (c == 'F') opt.flag |= RB3_BF_NO_FOR;
 		else if (c == 'R') opt.flag |= RB3_BF_NO_REV;
 		// output
-		else if (c == 'o') freopen(o.arg, "wb", stdout);
+		else if (c == 'o') freopen(o.arg, "wb", stdout), fn_out = o.arg;
 		else if (c == 'd') opt.fmt = RB3_FMD;
 		else if (c == 'b') opt.fmt = RB3_FMR;
 		else if (c == 'T') opt.fmt = RB3_TREE;
@@ -168,6 +508,13 @@ int main_build(int argc, char *argv[])
 	}
 	if (argc == o.ind && fn_in == 0)
 		return usage_build(stderr, &opt);
+	if (fn_hb && (opt.flag & RB3_BF_USE_RB2)) {
+		if (rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: option -M can't be used with -2, -s or -r\n");
+		return 1;
+	}
+	if (fn_hb == 0 && opt.n_batches != 1 && rb3_verbose >= 2)
+		fprintf(stderr, "[W::%s] option -P has no effect without -M\n", __func__);
 
 	if (fn_in) {
 		rb3_fmi_t fmi;
@@ -177,76 +524,95 @@ int main_build(int argc, char *argv[])
 				fprintf(stderr, "ERROR: failed to open index file '%s'\n", fn_in);
 			return 1;
 		} else if (fmi.is_fmd) {
-			r = rb3_enc_fmd2fmr(fmi.e, opt.max_nodes, opt.block_len, 1);
+			r = rb3_enc_fmd2fmr(fmi.e, opt.max_nodes, opt.block_len, opt.n_threads, 1);
 		} else r = fmi.r;
 		if (rb3_verbose >= 3)
 			fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the index from file '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), fn_in);
 	}
 
-	if (argc - o.ind == 1 && opt.sais_threads > 0 && opt.n_threads - opt.sais_threads > 0) {
-		rb3_seqio_t *fp;
-		pipeline_t p;
-		fp = rb3_seq_open(argv[o.ind], !!(opt.flag&RB3_BF_LINE));
-		if (fp == 0) {
-			if (rb3_verbose >= 1)
-				fprintf(stderr, "ERROR: failed to open file '%s'\n", argv[o.ind]);
+	if (fn_hb) {
+		rld_t *e;
+		if (opt.n_batches < 1) opt.n_batches = 1;
+		if ((n_err = hb_build(&opt, fn_hb, argc - o.ind, &argv[o.ind], &e)) < 0) {
+			if (r) mr_destroy(r);
+			return 1;
+		}
+		if (n_err > 0) {
+			if (e) rld_destroy(e);
 			goto end_build;
 		}
-		memset(&p, 0, sizeof(p));
-		p.opt = &opt, p.fp = fp, p.r = r;
-		kt_pipeline(2, worker_pipeline, &p, 2);
-		r = p.r;
-		rb3_seq_close(fp);
+		if (r) { // merge into the existing index
+			rb3_fmi_t fa, fb;
+			rb3_fmi_init(&fa, rb3_enc_fmr2fmd(r, 0, opt.n_threads, 1), 0);
+			r = 0;
+			if (e) {
+				rb3_fmi_init(&fb, e, 0);
+				e = rb3_fmi_merge_fmd(&fa, &fb, opt.n_threads, 1);
+				rb3_fmi_free(&fa);
+			} else e = fa.e;
+		}
+		if (e == 0) return 1;
+		if (opt.fmt == RB3_FMD) {
+			rld_dump(e, "-");
+			rld_destroy(e);
+			return 0;
+		}
+		r = rb3_enc_fmd2fmr(e, opt.max_nodes, opt.block_len, opt.n_threads, 1);
 		goto end_build;
 	}
 
-	for (i = o.ind; i < argc; ++i) {
-		rb3_seqio_t *fp;
-		int64_t n_seq = 0;
-		fp = rb3_seq_open(argv[i], !!(opt.flag&RB3_BF_LINE));
-		if (fp == 0) {
-			if (rb3_verbose >= 1)
-				fprintf(stderr, "ERROR: failed to open file '%s'\n", argv[i]);
-			continue;
-		}
-		while ((n_seq = rb3_seq_read(fp, &seq, opt.batch_size, !(opt.flag&RB3_BF_NO_FOR), !(opt.flag&RB3_BF_NO_REV))) > 0) {
-			if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] read %ld symbols from file '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)seq.l, argv[i]);
-			if (opt.flag & RB3_BF_USE_RB2) { // use the ropebwt2 algorithm
+	if (opt.flag & RB3_BF_USE_RB2) { // use the ropebwt2 algorithm
+		for (i = o.ind; i < argc; ++i) {
+			rb3_seqio_t *fp;
+			fp = rb3_seq_open2(argv[i], !!(opt.flag&RB3_BF_LINE), opt.n_threads);
+			if (fp == 0) {
+				if (rb3_verbose >= 1)
+					fprintf(stderr, "ERROR: failed to open file '%s'\n", argv[i]);
+				continue;
+			}
+			while (rb3_seq_read(fp, &seq, opt.batch_size, !(opt.flag&RB3_BF_NO_FOR), !(opt.flag&RB3_BF_NO_REV)) > 0) {
+				if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] read %ld symbols from file '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)seq.l, argv[i]);
 				if (r == 0) r = mr_init(opt.max_nodes, opt.block_len, opt.sort_order);
+				mr_split(r, mr_ctx4threads(opt.n_threads), opt.n_threads); // no effect with <=6 threads
 				rb3_reverse_all(seq.l, (uint8_t*)seq.s);
-				mr_insert_multi(r, seq.l, (uint8_t*)seq.s, (opt.n_threads > 1));
+				mr_insert_multi(r, seq.l, (uint8_t*)seq.s, opt.n_threads);
 				if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] inserted %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)seq.l);
-			} else { // use libsais
-				rb3_build_sais(n_seq, seq.l, seq.s, opt.n_threads);
-				if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] constructed partial BWT for %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)seq.l);
-				if (r == 0) {
-					r = rb3_enc_plain2fmr(seq.l, (uint8_t*)seq.s, opt.max_nodes, opt.block_len, opt.n_threads);
-					if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] encoded the partial BWT for %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)seq.l);
-				} else {
-					rb3_fmi_merge_plain(r, seq.l, (uint8_t*)seq.s, opt.n_threads);
-					if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] merged the partial BWT for %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)seq.l);
-				}
 			}
+			if (rb3_seq_error(fp)) ++n_err;
+			rb3_seq_close(fp);
+			if (fn_tmp && r && n_err == 0) bd_save(r, fn_tmp);
 		}
-		rb3_seq_close(fp);
-		if (fn_tmp) {
-			FILE *fp;
-			fp = fopen(fn_tmp, "w");
-			if (fp != 0) mr_dump(r, fp);
-			fclose(fp);
-			if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] saved the current index to '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), fn_tmp);
-		}
+		free(seq.s);
+	} else { // use libsais
+		pipeline_t p;
+		memset(&p, 0, sizeof(p));
+		p.opt = &opt, p.r = r, p.fn_tmp = fn_tmp, p.last_fid = -1;
+		p.n_fn = argc - o.ind, p.fn = &argv[o.ind];
+		p.n_stage = opt.sais_threads > 0 && opt.n_threads - opt.sais_threads > 0? 3 : 2;
+		p.sais_threads = opt.sais_threads;
+		if (r) bd_stat_update(&p.st, r);
+		pthread_mutex_init(&p.lock, 0);
+		kt_pipeline(p.n_stage, worker_pipeline, &p, p.n_stage);
+		pthread_mutex_destroy(&p.lock);
+		r = p.r, n_err = p.n_err;
+		if (fn_tmp && r && n_err == 0) bd_save(r, fn_tmp);
 	}
-	free(seq.s);
 
 end_build:
+	if (n_err > 0) { // don't write an index missing part of the input
+		if (rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: failed to read %d input file(s); the index is not written\n", n_err);
+		if (r) mr_destroy(r);
+		if (fn_out) remove(fn_out);
+		return 1;
+	}
 	if (r == 0) return 1;
 
 	if (opt.fmt == RB3_FMR) {
 		mr_dump(r, stdout);
 	} else if (opt.fmt == RB3_FMD) {
 		rld_t *e;
-		e = rb3_enc_fmr2fmd(r, 0, 1); // most of r is deallocated here
+		e = rb3_enc_fmr2fmd(r, 0, opt.n_threads, 1); // most of r is deallocated here
 		rld_dump(e, "-");
 		rld_destroy(e);
 		r = 0;
@@ -180,10 +180,6 @@ static void sw_backtrack1(void *km, const rb3_swopt_t *opt, const rb3_fmi_t *f,
 	sw_cs_core(hit, qseq, 1); // this requires ::cigar and ::rseq
 	hit->cs = RB3_CALLOC(char, hit->cs_len + 1);
 	sw_cs_core(hit, qseq, 0);
-	if (!(opt->flag & RB3_SWF_KEEP_RS)) {
-		kfree(km, hit->rseq);
-		hit->rseq = 0;
-	}
 
 	// calculate block length and matching length
 	hit->mlen = hit->blen = 0;
@@ -544,17 +540,24 @@ void rb3_sw(void *km, const rb3_swopt_t *opt, const rb3_fmi_t *f, int len, const
 		g = rb3_dawg_gen(km, q);
 	}
 	sw_core(km, opt, f, g, seq, rst, 0);
-	if (f->ssa) {
+	if (f->ssa || f->phi) {
 		int64_t rest = opt->max_pos;
 		int32_t k;
 		for (k = 0; k < rst->n; ++k) {
 			rb3_swhit_t *hit = &rst->a[k];
 			int32_t n = rest > 0? rest : 1;
 			hit->pos = RB3_CALLOC(rb3_pos_t, n);
-			hit->n_pos = rb3_ssa_multi(km, f, f->ssa, hit->lo, hit->hi, n, hit->pos);
+			hit->n_pos = rb3_locate(km, f, hit->lo, hit->hi, hit->rlen, hit->rseq, n, hit->pos);
 			rest -= hit->n_pos;
 		}
 	}
+	if (!(opt->flag & RB3_SWF_KEEP_RS)) {
+		int32_t k;
+		for (k = 0; k < rst->n; ++k) {
+			kfree(km, rst->a[k].rseq);
+			rst->a[k].rseq = 0;
+		}
+	}
 	rb3_dawg_destroy(km, g); // this doesn't deallocate q
 	if (q) rb3_bwtl_destroy(q);
 }
@@ -28,7 +28,33 @@ rld_t *rb3_enc_plain2rld(int64_t len, const uint8_t *bwt, int cbits)
 	return e;
 }
 
-rld_t *rb3_enc_fmr2fmd(mrope_t *r, int cbits, int is_free)
+typedef struct {
+	int cbits;
+	const uint8_t **leaf;
+	int64_t n_leaf, n_seg;
+	rld_t **e;
+	rlditr_t *itr;
+} fmr2fmd_aux_t;
+
+static void worker_fmr2fmd(void *data, long s, int tid)
+{ // encode a range of rope leaves; the output is not finished
+	fmr2fmd_aux_t *a = (fmr2fmd_aux_t*)data;
+	int64_t i;
+	a->e[s] = rld_init(RB3_ASIZE, a->cbits);
+	rld_itr_init(a->e[s], &a->itr[s], 0);
+	for (i = a->n_leaf * s / a->n_seg; i < a->n_leaf * (s + 1) / a->n_seg; ++i) {
+		const uint8_t *block = a->leaf[i];
+		const uint8_t *q = block + 2, *end = block + 2 + *rle_nptr(block);
+		while (q < end) {
+			int c = 0;
+			int64_t l;
+			rle_dec1(q, c, l);
+			rld_enc(a->e[s], &a->itr[s], l, c);
+		}
+	}
+}
+
+rld_t *rb3_enc_fmr2fmd(mrope_t *r, int cbits, int n_threads, int is_free)
 {
 	rld_t *e;
 	rlditr_t ei;
@@ -36,8 +62,36 @@ rld_t *rb3_enc_fmr2fmd(mrope_t *r, int cbits, int is_free)
 	const uint8_t *block;
 
 	if (cbits <= 0) cbits = 3;
+	if (n_threads > 1) { // encode segments in parallel and then concatenate
+		fmr2fmd_aux_t a;
+		int64_t s, m_leaf = 0;
+		memset(&a, 0, sizeof(a));
+		a.cbits = cbits;
+		mr_itr_first(r, &ri, 0);
+		while ((block = mr_itr_next_block(&ri)) != 0) {
+			RB3_GROW(const uint8_t*, a.leaf, a.n_leaf, m_leaf);
+			a.leaf[a.n_leaf++] = block;
+		}
+		a.n_seg = a.n_leaf < n_threads? a.n_leaf : n_threads;
+		if (a.n_seg > 1) {
+			a.e = RB3_CALLOC(rld_t*, a.n_seg);
+			a.itr = RB3_CALLOC(rlditr_t, a.n_seg);
+			kt_for(n_threads, worker_fmr2fmd, &a, a.n_seg);
+			free(a.leaf);
+			if (is_free) mr_destroy(r);
+			if (rb3_verbose >= 3)
+				fprintf(stderr, "[M::%s::%.3f*%.2f] encoded %ld segments\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)a.n_seg);
+			e = a.e[0], ei = a.itr[0];
+			for (s = 1; s < a.n_seg; ++s)
+				rld_enc_cat(e, &ei, a.e[s], &a.itr[s]);
+			free(a.e); free(a.itr);
+			rld_enc_finish_mt(e, &ei, n_threads);
+			return e;
+		}
+		free(a.leaf);
+	}
 	e = rld_init(RB3_ASIZE, cbits);
-	mr_itr_first(r, &ri, 1);
+	mr_itr_first(r, &ri, is_free);
 	rld_itr_init(e, &ei, 0);
 	while ((block = mr_itr_next_block(&ri)) != 0) {
 		const uint8_t *q = block + 2, *end = block + 2 + *rle_nptr(block);
@@ -53,34 +107,71 @@ rld_t *rb3_enc_fmr2fmd(mrope_t *r, int cbits, int is_free)
 	return e;
 }
 
-mrope_t *rb3_enc_fmd2fmr(rld_t *e, int max_nodes, int block_len, int is_free)
+typedef struct {
+	const rld_t *e;
+	rlditr_t itr;
+	int is_free, c;
+	int64_t l, off, end; // $l symbols remain in the current run; the next symbol is at $off; stop at $end
+} fmd_runs_t;
+
+static int64_t fmd_next_run(void *data, int *c)
 {
+	fmd_runs_t *s = (fmd_runs_t*)data;
+	int64_t l;
+	if (s->off >= s->end) return 0;
+	if (s->l <= 0 && (s->l = rld_dec(s->e, &s->itr, &s->c, s->is_free)) <= 0) return 0;
+	l = s->off + s->l <= s->end? s->l : s->end - s->off;
+	*c = s->c, s->l -= l, s->off += l;
+	return l;
+}
+
+typedef struct {
+	const rld_t *e;
 	mrope_t *r;
-	rlditr_t itr;
-	int64_t l, off;
-	int c, a;
-	rpcache_t cache;
+} fmd2fmr_aux_t;
+
+static void worker_fmd2fmr(void *data, long a, int tid)
+{ // decode bucket $a of the FMD to rope $a
+	fmd2fmr_aux_t *aux = (fmd2fmr_aux_t*)data;
+	const rld_t *e = aux->e;
+	rope_t *r = aux->r->r[a];
+	fmd_runs_t s;
+	if (e->cnt[a] == e->cnt[a+1]) return;
+	memset(&s, 0, sizeof(s));
+	s.e = e, s.off = e->cnt[a], s.end = e->cnt[a+1];
+	s.l = rld_itr_seek(e, &s.itr, s.off, &s.c);
+	aux->r->r[a] = rope_build_from_runs(r->max_nodes, r->block_len, ROPE_DEF_FILL, fmd_next_run, &s);
+	rope_destroy(r);
+}
+
+mrope_t *rb3_enc_fmd2fmr(rld_t *e, int max_nodes, int block_len, int n_threads, int is_free)
+{
+	mrope_t *r;
+	fmd_runs_t s;
+	int a;
 
 	if (max_nodes <= 0) max_nodes = ROPE_DEF_MAX_NODES;
 	if (block_len <= 0) block_len = ROPE_DEF_BLOCK_LEN;
 	r = mr_init(max_nodes, block_len, MR_SO_IO);
-	memset(&cache, 0, sizeof(rpcache_t));
-
-	rld_itr_init(e, &itr, 0);
-	a = 0, off = 0, c = -1;
-	while ((l = rld_dec(e, &itr, &c, is_free)) > 0) {
-		while (l > 0 && off + l > e->cnt[a+1] && off <= e->cnt[a+1]) {
-			int64_t t = e->cnt[a+1] - off;
-			if (t > 0) rope_insert_run(r->r[a], off - e->cnt[a], c, t, &cache);
-			off += t, l -= t, ++a;
-		}
-		if (off + l <= e->cnt[a+1]) { // <= is important
-			rope_insert_run(r->r[a], off - e->cnt[a], c, l, &cache);
-			off += l;
-			while (a < RB3_ASIZE && off == e->cnt[a+1]) ++a;
-		}
+	if (n_threads > 1) { // the six buckets are independent
+		fmd2fmr_aux_t aux;
+		aux.e = e, aux.r = r;
+		kt_for(n_threads < RB3_ASIZE? n_threads : RB3_ASIZE, worker_fmd2fmr, &aux, RB3_ASIZE);
+		if (is_free) rld_destroy(e);
+		mr_update_cnt(r);
+		return r;
+	}
+	memset(&s, 0, sizeof(s));
+	s.e = e, s.is_free = is_free;
+	rld_itr_init(e, &s.itr, 0);
+	for (a = 0; a < RB3_ASIZE; ++a) {
+		rope_t *q = r->r[a];
+		s.off = e->cnt[a], s.end = e->cnt[a+1];
+		r->r[a] = rope_build_from_runs(q->max_nodes, q->block_len, ROPE_DEF_FILL, fmd_next_run, &s);
+		rope_destroy(q);
 	}
 	if (is_free) rld_destroy(e);
+	mr_update_cnt(r);
 	return r;
 }
 
@@ -94,21 +185,32 @@ typedef struct {
 	mrope_t *r;
 } p2fmr_aux_t;
 
+typedef struct {
+	const uint8_t *bwt;
+	int64_t i, end;
+} plain_runs_t;
+
+static int64_t plain_next_run(void *data, int *c)
+{
+	plain_runs_t *s = (plain_runs_t*)data;
+	int64_t i0 = s->i;
+	if (s->i >= s->end) return 0;
+	*c = s->bwt[i0];
+	for (++s->i; s->i < s->end && s->bwt[s->i] == *c; ++s->i) {}
+	return s->i - i0;
+}
+
 static void worker_p2fmr(void *data, long c, int tid)
 {
 	p2fmr_aux_t *a = (p2fmr_aux_t*)data;
-	int64_t i, i0, off;
+	int64_t i, off;
 	rope_t *r = a->r->r[c];
-	rpcache_t cache;
-	memset(&cache, 0, sizeof(rpcache_t));
+	plain_runs_t s;
 	for (i = 0, off = 0; i < c; ++i)
 		off += a->cnt[i];
-	for (i0 = 0, i = 1; i <= a->cnt[c]; ++i) {
-		if (i == a->cnt[c] || a->bwt[off+i0] != a->bwt[off+i]) {
-			rope_insert_run(r, i0, a->bwt[off+i0], i - i0, &cache);
-			i0 = i;
-		}
-	}
+	s.bwt = a->bwt, s.i = off, s.end = off + a->cnt[c];
+	a->r->r[c] = rope_build_from_runs(r->max_nodes, r->block_len, ROPE_DEF_FILL, plain_next_run, &s);
+	rope_destroy(r);
 }
 
 mrope_t *rb3_enc_plain2fmr(int64_t len, const uint8_t *bwt, int max_nodes, int block_len, int32_t n_threads)
@@ -133,6 +235,7 @@ mrope_t *rb3_enc_plain2fmr(int64_t len, const uint8_t *bwt, int max_nodes, int b
 		for (c = 0; c < 6; ++c)
 			worker_p2fmr(&aux, c, c);
 	}
+	mr_update_cnt(aux.r);
 	return aux.r;
 }
 
@@ -140,68 +243,198 @@ mrope_t *rb3_enc_plain2fmr(int64_t len, const uint8_t *bwt, int max_nodes, int b
  * Calculate rank for merging *
  ******************************/
 
-void rb3_mg_rank1(const rb3_fmi_t *fa, const rb3_fmi_t *fb, int64_t *rb, int64_t p)
+void rb3_mg_rank_init(rb3_mgrank_t *rb, int64_t n, int64_t max)
+{ // $max is the largest value to store before shifting in the symbol
+	rb->w = 4;
+	while (rb->w < 64 && max >> (rb->w - 3) > 0) ++rb->w;
+	assert(rb->w < 64);
+	rb->mask = (1ULL << rb->w) - 1;
+	rb->a = RB3_CALLOC(uint64_t, ((uint64_t)n * rb->w >> 6) + 2);
+}
+
+static inline uint64_t rb3_mg_get(const rb3_mgrank_t *rb, int64_t i)
 {
-	int64_t ka, kb;
-	int c, last_c = 0;
-	ka = fa->acc[1], kb = p;
-	while (1) {
-		int64_t oa[RB3_ASIZE], ob[RB3_ASIZE];
-		c = rb3_fmi_rank1a(fb, kb, ob);
-		rb[kb] = (ka + kb) << 6 | c << 3 | last_c;
-		last_c = c;
-		if (c == 0) break;
-		kb = fb->acc[c] + ob[c];
-		rb3_fmi_rank1a(fa, ka, oa);
-		ka = fa->acc[c] + oa[c];
-	}
+	uint64_t b = (uint64_t)i * rb->w, s = b & 63, x;
+	x = rb->a[b>>6] >> s;
+	if (s + rb->w > 64) x |= rb->a[(b>>6) + 1] << (64 - s);
+	return x & rb->mask;
+}
+
+static inline void rb3_mg_put(rb3_mgrank_t *rb, int64_t i, uint64_t v) // entry $i must be zero; not thread-safe
+{
+	uint64_t b = (uint64_t)i * rb->w, s = b & 63;
+	rb->a[b>>6] |= v << s;
+	if (s + rb->w > 64) rb->a[(b>>6) + 1] |= v >> (64 - s);
+}
+
+#define RB3_MG_LANES 32
+#define RB3_MG_BUF   (1<<18) // word updates buffered per thread before they are applied
+#define RB3_MG_PART  (1<<17) // words per partition when applying updates
+
+typedef struct {
+	int64_t ka, kb, jb;
+} mgrank_lane_t;
+
+typedef struct {
+	int64_t next, end; // sequences [next,end) are not started yet
+	int32_t n_act;
+	mgrank_lane_t a[RB3_MG_LANES];
+} mgrank_grp_t;
+
+typedef struct { uint64_t i, x; } mgrank_upd_t; // rb3_mgrank_t::a[i] ^= x
+
+typedef struct {
+	int64_t n, *off; // off[p]: start of partition $p in u[] after bucketing
+	mgrank_upd_t *u, *tmp; // if u==0, apply updates immediately; only safe with one thread
+} mgrank_buf_t; // per-thread buffer such that the rank array is only written with plain stores by the owner of each word
+
+static inline void rb3_mg_upd(rb3_mgrank_t *rb, mgrank_buf_t *b, uint64_t i, uint64_t x)
+{
+	if (b->u == 0) rb->a[i] ^= x;
+	else b->u[b->n].i = i, b->u[b->n++].x = x;
 }
 
-void rb3_mg_rank1_plain(const rb3_fmi_t *fa, int64_t *rb, int64_t p)
+static inline void rb3_mg_xor(rb3_mgrank_t *rb, mgrank_buf_t *b, int64_t i, uint64_t d)
 {
-	int64_t ka, kb;
-	int c, last_c = 0;
-	ka = fa->acc[1], kb = p;
-	while (1) {
-		int64_t oa[RB3_ASIZE], r = rb[kb] >> 3;
-		c = rb[kb] & 7;
-		rb[kb] = (ka + kb) << 6 | c << 3 | last_c;
-		last_c = c;
-		if (c == 0) break;
-		kb = r;
-		rb3_fmi_rank1a(fa, ka, oa);
-		ka = fa->acc[c] + oa[c];
+	uint64_t x = (uint64_t)i * rb->w, s = x & 63;
+	rb3_mg_upd(rb, b, x >> 6, d << s);
+	if (s + rb->w > 64) rb3_mg_upd(rb, b, (x >> 6) + 1, d >> (64 - s));
+}
+
+static void rb3_mg_rank_lanes(const rb3_fmi_t *fa, const rb3_fmi_t *fb, rb3_mgrank_t *rb, mgrank_grp_t *g, mgrank_buf_t *buf)
+{ // walk sequences of the incoming BWT, or of the plain BWT if fb==0, until the buffer is full; sequences are interleaved to hide the latency of rank
+	mgrank_lane_t *a = g->a;
+	int32_t j;
+	while (buf->n + 2 * RB3_MG_LANES <= RB3_MG_BUF) {
+		while (g->n_act < RB3_MG_LANES && g->next < g->end) { // fill empty lanes
+			mgrank_lane_t *p = &a[g->n_act++];
+			p->ka = fa->acc[1], p->kb = g->next++, p->jb = -1;
+		}
+		if (g->n_act == 0) break;
+		for (j = 0; j < g->n_act; ++j) { // prefetch frames and rank entries
+			if (fb) rb3_fmi_prefetch(fb, a[j].kb, 0);
+			else RLD_PREFETCH(&rb->a[(uint64_t)a[j].kb * rb->w >> 6]);
+		}
+		for (j = 0; j < g->n_act; ++j) { // prefetch blocks; no-op for FMR as finding the leaf costs as much as rank
+			if (fb) rb3_fmi_prefetch(fb, a[j].kb, 1);
+			rb3_fmi_prefetch(fa, a[j].ka, 1);
+		}
+		for (j = 0; j < g->n_act; ++j) { // one LF step on both BWTs
+			mgrank_lane_t *p = &a[j];
+			int64_t oa[RB3_ASIZE], k = p->kb;
+			uint64_t x = 0;
+			int c;
+			if (fb) {
+				c = rb3_fmi_lf(fb, &p->kb, &p->jb);
+			} else { // the entry keeps LF<<3|symbol of the plain BWT before it is visited; it is visited only once
+				x = rb3_mg_get(rb, k);
+				c = x & 7, p->kb = x >> 3;
+			}
+			if (rb->w == 1) rb3_mg_upd(rb, buf, (uint64_t)(p->ka + k) >> 6, 1ULL << ((p->ka + k) & 63)); // interleave bitvector
+			else rb3_mg_xor(rb, buf, k, x ^ ((uint64_t)p->ka << 3 | c));
+			if (c == 0) {
+				a[j--] = a[--g->n_act];
+				continue;
+			}
+			rb3_fmi_rank1a(fa, p->ka, oa);
+			p->ka = fa->acc[c] + oa[c];
+		}
 	}
 }
 
 typedef struct {
 	const rb3_fmi_t *fa, *fb;
-	int64_t *rb;
+	rb3_mgrank_t *rb;
+	int32_t n_buf;
+	int64_t n_grp, n_part;
+	mgrank_grp_t *grp;
+	mgrank_buf_t *buf;
 } mgrank_aux_t;
 
-static void worker_cal_rank(void *data, long k, int tid)
+static void worker_cal_rank(void *data, long i, int tid)
 {
 	mgrank_aux_t *a = (mgrank_aux_t*)data;
-	if (a->fb) rb3_mg_rank1(a->fa, a->fb, a->rb, k);
-	else rb3_mg_rank1_plain(a->fa, a->rb, k);
+	rb3_mg_rank_lanes(a->fa, a->fb, a->rb, &a->grp[i], &a->buf[tid]);
 }
 
-void rb3_mg_rank(const rb3_fmi_t *fa, const rb3_fmi_t *fb, int64_t *rb, int n_threads)
-{
-	int64_t k;
-	if (n_threads > 1) {
-		mgrank_aux_t a;
-		a.fa = fa, a.fb = fb, a.rb = rb;
-		kt_for(n_threads, worker_cal_rank, &a, fb->acc[1]);
-	} else {
-		for (k = 0; k < fb->acc[1]; ++k)
-			rb3_mg_rank1(fa, fb, rb, k);
+static void worker_mg_bucket(void *data, long i, int tid)
+{ // counting sort of buffered updates by partition
+	mgrank_aux_t *a = (mgrank_aux_t*)data;
+	mgrank_buf_t *b = &a->buf[i];
+	mgrank_upd_t *swap;
+	int64_t k, p;
+	memset(b->off, 0, (a->n_part + 1) * sizeof(int64_t));
+	for (k = 0; k < b->n; ++k) ++b->off[b->u[k].i / RB3_MG_PART + 1];
+	for (p = 1; p <= a->n_part; ++p) b->off[p] += b->off[p-1];
+	for (k = 0; k < b->n; ++k)
+		b->tmp[b->off[b->u[k].i / RB3_MG_PART]++] = b->u[k];
+	for (p = a->n_part; p > 0; --p) b->off[p] = b->off[p-1];
+	b->off[0] = 0;
+	swap = b->u, b->u = b->tmp, b->tmp = swap;
+}
+
+static void worker_mg_apply(void *data, long p, int tid)
+{ // words in partition $p are only written here
+	mgrank_aux_t *a = (mgrank_aux_t*)data;
+	uint64_t *w = a->rb->a;
+	int t;
+	for (t = 0; t < a->n_buf; ++t) {
+		const mgrank_buf_t *b = &a->buf[t];
+		int64_t k;
+		for (k = b->off[p]; k < b->off[p+1]; ++k)
+			w[b->u[k].i] ^= b->u[k].x;
+	}
+}
+static void rb3_mg_rank_core(const rb3_fmi_t *fa, const rb3_fmi_t *fb, rb3_mgrank_t *rb, int64_t n, int64_t n_tot, int n_threads)
+{ // $n sequences and $n_tot symbols in the incoming BWT; walk in rounds and apply buffered updates in between
+	mgrank_aux_t a;
+	int64_t i, n_words, n_fin;
+	int t;
+	a.fa = fa, a.fb = fb, a.rb = rb;
+	a.n_grp = n / RB3_MG_LANES; // each group fills all lanes
+	if (a.n_grp > n_threads * 64) a.n_grp = n_threads * 64;
+	if (a.n_grp < n_threads) a.n_grp = n < n_threads? n : n_threads; // but use all threads
+	if (a.n_grp < 1) a.n_grp = 1;
+	a.grp = RB3_CALLOC(mgrank_grp_t, a.n_grp);
+	for (i = 0; i < a.n_grp; ++i)
+		a.grp[i].next = n * i / a.n_grp, a.grp[i].end = n * (i + 1) / a.n_grp;
+	n_words = rb->w == 1? ((fa->acc[RB3_ASIZE] + n_tot) >> 6) + 2 : ((uint64_t)n_tot * rb->w >> 6) + 2;
+	a.n_part = (n_words + RB3_MG_PART - 1) / RB3_MG_PART;
+	a.n_buf = n_threads;
+	a.buf = RB3_CALLOC(mgrank_buf_t, a.n_buf);
+	if (n_threads == 1) { // no other writers; walk all sequences in one go
+		for (i = 0; i < a.n_grp; ++i)
+			rb3_mg_rank_lanes(fa, fb, rb, &a.grp[i], &a.buf[0]);
+		free(a.buf); free(a.grp);
+		return;
 	}
+	for (t = 0; t < a.n_buf; ++t) {
+		a.buf[t].off = RB3_CALLOC(int64_t, a.n_part + 1);
+		a.buf[t].u = RB3_MALLOC(mgrank_upd_t, RB3_MG_BUF);
+		a.buf[t].tmp = RB3_MALLOC(mgrank_upd_t, RB3_MG_BUF);
+	}
+	do {
+		kt_for(n_threads, worker_cal_rank, &a, a.n_grp);
+		kt_for(n_threads, worker_mg_bucket, &a, a.n_buf);
+		kt_for(n_threads, worker_mg_apply, &a, a.n_part);
+		for (t = 0; t < a.n_buf; ++t) a.buf[t].n = 0;
+		for (i = 0, n_fin = 0; i < a.n_grp; ++i)
+			if (a.grp[i].n_act == 0 && a.grp[i].next == a.grp[i].end) ++n_fin;
+	} while (n_fin < a.n_grp);
+	for (t = 0; t < a.n_buf; ++t) {
+		free(a.buf[t].off); free(a.buf[t].u); free(a.buf[t].tmp);
+	}
+	free(a.buf); free(a.grp);
 }
 
-void rb3_mg_rank_plain(const rb3_fmi_t *fa, int64_t len, const uint8_t *seq, int64_t *rb, int64_t acc[RB3_ASIZE+1], int n_threads)
+void rb3_mg_rank(const rb3_fmi_t *fa, const rb3_fmi_t *fb, rb3_mgrank_t *rb, int n_threads)
 {
-	int64_t i, k, c[RB3_ASIZE];
+	rb3_mg_rank_core(fa, fb, rb, fb->acc[1], fb->acc[RB3_ASIZE], n_threads);
+}
+
+void rb3_mg_rank_plain(const rb3_fmi_t *fa, int64_t len, const uint8_t *seq, rb3_mgrank_t *rb, int64_t acc[RB3_ASIZE+1], int n_threads)
+{
+	int64_t i, c[RB3_ASIZE];
 	int a;
 	memset(c, 0, 8 * RB3_ASIZE);
 	for (i = 0; i < len; ++i)
@@ -211,17 +444,10 @@ void rb3_mg_rank_plain(const rb3_fmi_t *fa, int64_t len, const uint8_t *seq, int
 	memset(c, 0, 8 * RB3_ASIZE);
 	for (i = 0; i < len; ++i) {
 		int a = seq[i];
-		rb[i] = (acc[a] + c[a]) << 3 | a;
+		rb3_mg_put(rb, i, (uint64_t)(acc[a] + c[a]) << 3 | a);
 		++c[a];
 	}
-	if (n_threads > 1) {
-		mgrank_aux_t a;
-		a.fa = fa, a.fb = 0, a.rb = rb;
-		kt_for(n_threads, worker_cal_rank, &a, acc[1]);
-	} else {
-		for (k = 0; k < acc[1]; ++k)
-			rb3_mg_rank1_plain(fa, rb, k);
-	}
+	rb3_mg_rank_core(fa, 0, rb, acc[1], len, n_threads);
 }
 
 /*********
@@ -229,77 +455,252 @@ void rb3_mg_rank_plain(const rb3_fmi_t *fa, int64_t len, const uint8_t *seq, int
  *********/
 
 typedef struct {
-	const int64_t *rank;
-	const int64_t *aca, *acb;
+	const rb3_mgrank_t *rank;
+	const int64_t *off; // offset of each context in the incoming BWT
+	int64_t *cnt; // BWT symbol counts in each context
+} mgctx_aux_t;
+
+static void worker_mgctx(void *data, long j, int tid)
+{
+	mgctx_aux_t *a = (mgctx_aux_t*)data;
+	int64_t i;
+	for (i = a->off[j]; i < a->off[j+1]; ++i)
+		++a->cnt[j * RB3_ASIZE + (rb3_mg_get(a->rank, i)&7)];
+}
+
+static void rb3_mg_ctx_off(int ctx, const rb3_mgrank_t *rank, const int64_t acb[RB3_ASIZE+1], int64_t *off, int n_threads)
+{ // compute the offset of each context of length $ctx in the incoming BWT
+	int64_t *cnt;
+	int k, n, j, c;
+	memcpy(off, acb, (RB3_ASIZE + 1) * sizeof(int64_t));
+	cnt = RB3_CALLOC(int64_t, MR_MAX_ROPES / 6 * RB3_ASIZE);
+	for (k = 1, n = 6; k < ctx; ++k, n *= 6) { // $n is the number of contexts of length $k
+		mgctx_aux_t a;
+		memset(cnt, 0, n * RB3_ASIZE * sizeof(int64_t));
+		a.rank = rank, a.off = off, a.cnt = cnt;
+		kt_for(n_threads, worker_mgctx, &a, n);
+		off[0] = 0, off[1] = acb[1]; // suffixes starting with a sentinel are padded with 0
+		for (j = 2; j <= n; ++j) off[j] = acb[1];
+		for (c = 1; c < RB3_ASIZE; ++c) // #suffixes starting with c followed by context j equals #c in context j
+			for (j = 0; j < n; ++j)
+				off[c * n + j + 1] = off[c * n + j] + cnt[j * RB3_ASIZE + c];
+	}
+	free(cnt);
+}
+
+typedef struct {
+	const rb3_mgrank_t *rank;
+	const int64_t *oa, *ob; // offsets of ropes in the current and the incoming BWT
 	mrope_t *r;
 } mgins_aux_t;
 
-static void worker_mgins(void *data, long c, int tid)
+static void worker_mgins(void *data, long j, int tid)
 {
 	mgins_aux_t *a = (mgins_aux_t*)data;
 	int64_t i;
-	rope_t *r = a->r->r[c];
-	rpcache_t cache;
-	memset(&cache, 0, sizeof(rpcache_t));
-	for (i = a->acb[c]; i < a->acb[c+1]; ++i) {
-		int64_t x = a->rank[i];
-		assert((x&7) == c);
-		rope_insert_run(r, (x>>6) - (a->aca[c] + a->acb[c]), x>>3&7, 1, &cache);
+	rope_t *r = a->r->r[j];
+	rpcur_t *cur;
+	cur = RB3_CALLOC(rpcur_t, 1);
+	for (i = a->ob[j]; i < a->ob[j+1]; ++i) { // positions are increasing in a rope
+		uint64_t x = rb3_mg_get(a->rank, i);
+		rope_insert_run_cur(r, (int64_t)(x>>3) + i - (a->oa[j] + a->ob[j]), x&7, 1, cur);
+	}
+	free(cur);
+}
+
+static void rb3_mg_insert(mrope_t *r, const rb3_mgrank_t *rank, const int64_t acb[RB3_ASIZE+1], int n_threads)
+{
+	int64_t ob[MR_MAX_ROPES+1];
+	mgins_aux_t aux;
+
+	if (mr_ctx4threads(n_threads) > r->ctx) { // partition ropes by a longer context to use more threads
+		mr_split(r, mr_ctx4threads(n_threads), n_threads);
+		if (rb3_verbose >= 3)
+			fprintf(stderr, "[M::%s::%.3f*%.2f] partitioned the index into %d ropes\n", __func__, rb3_realtime(), rb3_percent_cpu(), r->n_r);
 	}
+	rb3_mg_ctx_off(r->ctx, rank, acb, ob, n_threads);
+	aux.rank = rank, aux.oa = r->off, aux.ob = ob, aux.r = r;
+	kt_for(n_threads < r->n_r? n_threads : r->n_r, worker_mgins, &aux, r->n_r);
+	mr_update_cnt(r);
 }
 
 void rb3_fmi_merge(mrope_t *r, rb3_fmi_t *fb, int n_threads, int free_fb)
 {
 	rb3_fmi_t fa;
-	int64_t *rb, aca[RB3_ASIZE+1], acb[RB3_ASIZE+1];
-	int c;
-	mgins_aux_t aux;
+	int64_t acb[RB3_ASIZE+1];
+	rb3_mgrank_t rb;
 
 	rb3_fmi_init(&fa, 0, r);
-	rb3_fmi_get_acc(&fa, aca);
 	rb3_fmi_get_acc(fb, acb);
-	rb = RB3_MALLOC(int64_t, acb[RB3_ASIZE]);
-	rb3_mg_rank(&fa, fb, rb, n_threads);
+	rb3_mg_rank_init(&rb, acb[RB3_ASIZE], fa.acc[RB3_ASIZE]);
+	rb3_mg_rank(&fa, fb, &rb, n_threads);
 	if (free_fb) rb3_fmi_free(fb);
 	if (rb3_verbose >= 3)
 		fprintf(stderr, "[M::%s::%.3f*%.2f] caculated ranks for %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)acb[RB3_ASIZE]);
 
-	aux.rank = rb, aux.aca = aca, aux.acb = acb, aux.r = r;
-	if (n_threads > 1) {
-		kt_for(n_threads < 6? n_threads : 6, worker_mgins, &aux, 6);
-	} else {
-		for (c = 0; c < 6; ++c)
-			worker_mgins(&aux, c, c);
-	}
+	rb3_mg_insert(r, &rb, acb, n_threads);
 	if (rb3_verbose >= 3)
 		fprintf(stderr, "[M::%s::%.3f*%.2f] inserted %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)acb[RB3_ASIZE]);
-	free(rb);
+	free(rb.a);
 }
 
 void rb3_fmi_merge_plain(mrope_t *r, int64_t len, const uint8_t *seq, int n_threads)
 {
 	rb3_fmi_t fa;
-	int64_t *rb, aca[RB3_ASIZE+1], acb[RB3_ASIZE+1];
-	int c;
-	mgins_aux_t aux;
+	int64_t acb[RB3_ASIZE+1];
+	rb3_mgrank_t rb;
 
 	rb3_fmi_init(&fa, 0, r);
-	rb3_fmi_get_acc(&fa, aca);
-	rb = RB3_MALLOC(int64_t, len);
-	rb3_mg_rank_plain(&fa, len, seq, rb, acb, n_threads);
+	rb3_mg_rank_init(&rb, len, len > fa.acc[RB3_ASIZE]? len : fa.acc[RB3_ASIZE]); // an entry keeps LF before it is visited
+	rb3_mg_rank_plain(&fa, len, seq, &rb, acb, n_threads);
 	if (rb3_verbose >= 3)
 		fprintf(stderr, "[M::%s::%.3f*%.2f] caculated ranks for %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)acb[RB3_ASIZE]);
 
-	aux.rank = rb, aux.aca = aca, aux.acb = acb, aux.r = r;
-	if (n_threads > 1) {
-		kt_for(n_threads < 6? n_threads : 6, worker_mgins, &aux, 6);
-	} else {
-		for (c = 0; c < 6; ++c)
-			worker_mgins(&aux, c, c);
-	}
+	rb3_mg_insert(r, &rb, acb, n_threads);
 	if (rb3_verbose >= 3)
 		fprintf(stderr, "[M::%s::%.3f*%.2f] inserted %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)acb[RB3_ASIZE]);
-	free(rb);
+	free(rb.a);
+}
+
+/*************************
+ * Streaming merge to FMD *
+ *************************/
+
+typedef struct {
+	const rb3_fmi_t *f;
+	rlditr_t itr;
+	int64_t j; // the next run in the move table
+	int64_t l; // number of symbols remaining in the current run
+	int c;
+} mgfmd_stream_t;
+
+static void mgfmd_seek(mgfmd_stream_t *s, const rb3_fmi_t *f, int64_t k)
+{ // put the stream at symbol $k of an FMD or a move table
+	s->f = f, s->l = 0, s->c = -1;
+	if (k >= f->acc[RB3_ASIZE]) return;
+	if (f->mv) {
+		const mvt_t *m = f->mv;
+		s->j = mv_locate(m, k);
+		s->c = m->dc[s->j] >> MV_CSHIFT, s->l = m->p[s->j + 1] - k, ++s->j;
+	} else s->l = rld_itr_seek(f->e, &s->itr, k, &s->c);
+}
+
+static void mgfmd_copy(rld_t *e, rlditr_t *itr, mgfmd_stream_t *s, int64_t m)
+{ // take $m symbols from the stream and write them to $e
+	while (m > 0) {
+		int64_t l;
+		if (s->l == 0) {
+			if (s->f->mv) {
+				const mvt_t *mv = s->f->mv;
+				assert(s->j < mv->n_run);
+				s->c = mv->dc[s->j] >> MV_CSHIFT, s->l = mv->p[s->j + 1] - mv->p[s->j], ++s->j;
+			} else {
+				s->l = rld_dec(s->f->e, &s->itr, &s->c, 0);
+				assert(s->l > 0);
+			}
+		}
+		l = s->l < m? s->l : m;
+		rld_enc(e, itr, l, s->c);
+		s->l -= l, m -= l;
+	}
+}
+
+static int64_t mgfmd_run(const uint64_t *bv, int64_t p, int64_t end, int *b)
+{ // length of the run of identical bits starting at $p, capped at $end
+	int64_t q = p;
+	*b = bv[p>>6] >> (p&63) & 1;
+	while (q < end) {
+		uint64_t x = (bv[q>>6] ^ (*b? ~0ULL : 0)) >> (q&63); // nonzero if a different bit follows in this word
+		if (x) {
+			q += __builtin_ctzll(x);
+			break;
+		}
+		q = (q>>6<<6) + 64;
+	}
+	return (q < end? q : end) - p;
+}
+
+static int64_t mgfmd_count(const uint64_t *bv, int64_t beg, int64_t end)
+{ // number of 1 bits in [beg,end)
+	int64_t i, n = 0;
+	if (beg >= end) return 0;
+	for (i = beg>>6; i <= (end-1)>>6; ++i) {
+		uint64_t x = bv[i];
+		if (i == beg>>6) x &= ~0ULL << (beg&63);
+		if (i == (end-1)>>6 && (end&63)) x &= (1ULL<<(end&63)) - 1;
+		n += __builtin_popcountll(x);
+	}
+	return n;
+}
+
+typedef struct {
+	const rb3_fmi_t *fa, *fb;
+	const uint64_t *bv;
+	int64_t n, n_seg;
+	int64_t *ob; // ob[s]: number of incoming symbols before segment $s
+	rld_t **e;
+	rlditr_t *itr;
+} mgfmd_aux_t;
+
+static void worker_mgfmd_cnt(void *data, long s, int tid)
+{
+	mgfmd_aux_t *a = (mgfmd_aux_t*)data;
+	a->ob[s+1] = mgfmd_count(a->bv, a->n * s / a->n_seg, a->n * (s + 1) / a->n_seg);
+}
+
+static void worker_mgfmd_enc(void *data, long s, int tid)
+{ // encode a segment of the merged BWT; the output is not finished
+	mgfmd_aux_t *a = (mgfmd_aux_t*)data;
+	int64_t p = a->n * s / a->n_seg, end = a->n * (s + 1) / a->n_seg;
+	mgfmd_stream_t sa, sb;
+	mgfmd_seek(&sa, a->fa, p - a->ob[s]);
+	mgfmd_seek(&sb, a->fb, a->ob[s]);
+	a->e[s] = rld_init(RB3_ASIZE, 3);
+	rld_itr_init(a->e[s], &a->itr[s], 0);
+	while (p < end) {
+		int b;
+		int64_t m = mgfmd_run(a->bv, p, end, &b);
+		mgfmd_copy(a->e[s], &a->itr[s], b? &sb : &sa, m);
+		p += m;
+	}
+}
+
+rld_t *rb3_fmi_merge_fmd(const rb3_fmi_t *fa, rb3_fmi_t *fb, int n_threads, int free_fb)
+{
+	mgfmd_aux_t a;
+	rb3_mgrank_t rb;
+	rld_t *e;
+	rlditr_t ei;
+	int64_t s;
+
+	assert(fa->is_fmd && (fb->is_fmd || fb->mv));
+	rb.w = 1, rb.mask = 1;
+	rb.a = RB3_CALLOC(uint64_t, ((fa->acc[RB3_ASIZE] + fb->acc[RB3_ASIZE]) >> 6) + 2);
+	rb3_mg_rank(fa, fb, &rb, n_threads);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] computed the interleave vector for %ld symbols\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)fb->acc[RB3_ASIZE]);
+
+	memset(&a, 0, sizeof(a));
+	a.fa = fa, a.fb = fb, a.bv = rb.a;
+	a.n = fa->acc[RB3_ASIZE] + fb->acc[RB3_ASIZE];
+	a.n_seg = a.n < n_threads? 1 : n_threads;
+	a.ob = RB3_CALLOC(int64_t, a.n_seg + 1);
+	a.e = RB3_CALLOC(rld_t*, a.n_seg);
+	a.itr = RB3_CALLOC(rlditr_t, a.n_seg);
+	kt_for(n_threads, worker_mgfmd_cnt, &a, a.n_seg);
+	for (s = 0; s < a.n_seg; ++s) a.ob[s+1] += a.ob[s];
+	kt_for(n_threads, worker_mgfmd_enc, &a, a.n_seg);
+	free(rb.a); free(a.ob);
+	if (free_fb) rb3_fmi_free(fb);
+	e = a.e[0], ei = a.itr[0];
+	for (s = 1; s < a.n_seg; ++s)
+		rld_enc_cat(e, &ei, a.e[s], &a.itr[s]);
+	free(a.e); free(a.itr);
+	if (a.n_seg > 1) rld_enc_finish_mt(e, &ei, n_threads);
+	else rld_enc_finish(e, &ei);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] encoded the merged BWT in %ld segments\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)a.n_seg);
+	return e;
 }
 
 /***************
@@ -480,6 +881,14 @@ int64_t rb3_fmd_smem(void *km, const rb3_fmi_t *f, int64_t len, const uint8_t *q
 	return mem->n;
 }
 
+static inline int64_t fmd_back_init(const rb3_fmi_t *f, const uint8_t *q, int64_t lo, int64_t end, int64_t min_occ, rb3_sai_t *ik)
+{ // set $ik to the bi-interval of q[i+1..end] and return i; jump over k bases if q[end-k+1..end] is in the k-mer table
+	if (f->kmt && end - f->kmt->k + 1 >= lo && rb3_kmt_get(f->kmt, &q[end - f->kmt->k + 1], ik) == 0 && ik->size > 0 && ik->size >= min_occ)
+		return end - f->kmt->k;
+	rb3_fmd_set_intv(f, q[end], ik);
+	return end - 1;
+}
+
 int64_t rb3_fmd_smem1_TG(void *km, const rb3_fmi_t *f, int64_t min_occ, int64_t min_len, int64_t len, const uint8_t *q, int64_t x, rb3_sai_v *mem, int32_t check_long)
 {
 	int64_t i, j;
@@ -487,8 +896,7 @@ int64_t rb3_fmd_smem1_TG(void *km, const rb3_fmi_t *f, int64_t min_occ, int64_t
 
 	assert(len <= INT32_MAX); // this can be relaxed if we define a new struct for mem
 	if (len - x < min_len) return len;
-	rb3_fmd_set_intv(f, q[x + min_len - 1], &ik);
-	for (i = x + min_len - 2; i >= x; --i) { // backward extension
+	for (i = fmd_back_init(f, q, x, x + min_len - 1, min_occ, &ik); i >= x; --i) { // backward extension
 		int c = q[i];
 		rb3_fmd_extend(f, &ik, ok, 1);
 		if (ok[c].size < min_occ) break;
@@ -507,8 +915,7 @@ int64_t rb3_fmd_smem1_TG(void *km, const rb3_fmi_t *f, int64_t min_occ, int64_t
 	*p = ik;
 	p->info = (uint64_t)x<<32 | j;
 	if (j == len) return len;
-	rb3_fmd_set_intv(f, q[j], &ik);
-	for (i = j - 1; i > x; --i) { // backward extension again
+	for (i = fmd_back_init(f, q, x + 1, j, min_occ, &ik); i > x; --i) { // backward extension again
 		int c = q[i];
 		rb3_fmd_extend(f, &ik, ok, 1);
 		if (ok[c].size < min_occ) break;
@@ -537,6 +944,105 @@ int32_t rb3_fmd_smem_present(const rb3_fmi_t *f, int64_t len, const uint8_t *q,
 	return 0;
 }
 
+/*************************************
+ * Interleaved SMEMs for many queries *
+ *************************************/
+
+#define RB3_SMEM_LANES 16
+
+#define SMEM_INIT    0
+#define SMEM_BACK1   1 // backward extension from x+min_len-1 to x
+#define SMEM_FWD     2 // forward extension
+#define SMEM_FWD_END 3
+#define SMEM_BACK2   4 // backward extension from the end of the last MEM
+
+typedef struct {
+	int32_t state;
+	int64_t len, x, i;
+	const uint8_t *q;
+	rb3_sai_v *mem;
+	rb3_sai_t ik;
+} smem_lane_t;
+
+static int smem_lane_next(void *km, const rb3_fmi_t *f, int64_t min_occ, int64_t min_len, smem_lane_t *a, const rb3_sai_t *ok)
+{ // apply extension ok[] if present and move to the next state that needs rank; this follows rb3_fmd_smem1_TG(). Return 0 if finished
+	int64_t x = -1; // if x >= 0, start a new round at x
+	if (ok) {
+		int c = a->state == SMEM_FWD? rb3_comp(a->q[a->i]) : a->q[a->i];
+		if (ok[c].size >= min_occ) {
+			a->ik = ok[c];
+			a->i += a->state == SMEM_FWD? 1 : -1;
+		} else if (a->state == SMEM_FWD) a->state = SMEM_FWD_END;
+		else x = a->i + 1;
+	}
+	for (;;) {
+		if (a->state == SMEM_INIT) x = 0;
+		if (x >= 0) {
+			a->x = x, x = -1;
+			if (a->len - a->x < min_len) return 0;
+			a->i = fmd_back_init(f, a->q, a->x, a->x + min_len - 1, min_occ, &a->ik);
+			a->state = SMEM_BACK1;
+		}
+		if (a->state == SMEM_BACK1) {
+			if (a->i >= a->x) return 1;
+			a->i = a->x + min_len, a->state = SMEM_FWD;
+		}
+		if (a->state == SMEM_FWD) {
+			if (a->i < a->len) return 1;
+			a->state = SMEM_FWD_END;
+		}
+		if (a->state == SMEM_FWD_END) {
+			rb3_sai_t *p;
+			Kgrow(km, rb3_sai_t, a->mem->a, a->mem->n, a->mem->m);
+			p = &a->mem->a[a->mem->n++];
+			*p = a->ik;
+			p->info = (uint64_t)a->x<<32 | a->i;
+			if (a->i == a->len) return 0;
+			a->i = fmd_back_init(f, a->q, a->x + 1, a->i, min_occ, &a->ik);
+			a->state = SMEM_BACK2;
+		}
+		if (a->i > a->x) return 1; // SMEM_BACK2
+		x = a->i + 1;
+	}
+}
+
+void rb3_fmd_smem_TG_multi(void *km, const rb3_fmi_t *f, int32_t n, const int64_t *len, const uint8_t **q, rb3_sai_v *mem, int64_t min_occ, int64_t min_len, int32_t n_lane)
+{ // same output as calling rb3_fmd_smem_TG() on each query, but queries are interleaved to hide the latency of rank
+	int32_t j, n_act = 0, next = 0;
+	smem_lane_t *a;
+	if (n_lane <= 0) n_lane = RB3_SMEM_LANES;
+	a = Kcalloc(km, smem_lane_t, n_lane);
+	for (;;) {
+		while (n_act < n_lane && next < n) { // fill empty lanes
+			smem_lane_t *p = &a[n_act];
+			assert(len[next] <= INT32_MAX);
+			p->state = SMEM_INIT, p->len = len[next], p->q = q[next];
+			p->mem = &mem[next++], p->mem->n = 0;
+			if (smem_lane_next(km, f, min_occ, min_len, p, 0)) ++n_act;
+		}
+		if (n_act == 0) break;
+		for (j = 0; j < n_act; ++j) { // prefetch frames
+			const rb3_sai_t *ik = &a[j].ik;
+			int64_t k = ik->x[a[j].state == SMEM_FWD];
+			rb3_fmi_prefetch(f, k > 0? k - 1 : 0, 0);
+			rb3_fmi_prefetch(f, k + ik->size, 0);
+		}
+		for (j = 0; j < n_act; ++j) { // prefetch blocks
+			const rb3_sai_t *ik = &a[j].ik;
+			int64_t k = ik->x[a[j].state == SMEM_FWD];
+			rb3_fmi_prefetch(f, k > 0? k - 1 : 0, 1);
+			rb3_fmi_prefetch(f, k + ik->size, 1);
+		}
+		for (j = 0; j < n_act; ++j) { // extend by one base
+			rb3_sai_t ok[RB3_ASIZE];
+			rb3_fmd_extend(f, &a[j].ik, ok, a[j].state != SMEM_FWD);
+			if (!smem_lane_next(km, f, min_occ, min_len, &a[j], ok))
+				a[j--] = a[--n_act];
+		}
+	}
+	kfree(km, a);
+}
+
 /*******************
  * Other utilities *
  *******************/
@@ -546,20 +1052,23 @@ int64_t rb3_fmi_get_acc(const rb3_fmi_t *fmi, int64_t acc[RB3_ASIZE+1])
 	if (fmi->is_fmd) {
 		memcpy(acc, fmi->e->cnt, (RB3_ASIZE+1) * sizeof(int64_t));
 		return fmi->e->cnt[RB3_ASIZE];
+	} else if (fmi->mv) {
+		memcpy(acc, fmi->mv->acc, (RB3_ASIZE+1) * sizeof(int64_t));
+		return fmi->mv->acc[RB3_ASIZE];
 	} else return mr_get_ac(fmi->r, acc);
 }
 
 int64_t rb3_fmi_retrieve(const rb3_fmi_t *f, int64_t k, kstring_t *s)
 {
-	int64_t i, ok[RB3_ASIZE];
+	int64_t i, k0, j = -1;
 	int c;
 	s->l = 0;
 	if (k < 0 || k >= f->acc[RB3_ASIZE]) return -1;
-	while ((c = rb3_fmi_rank1a(f, k, ok)) > 0) {
+	for (k0 = k; (c = rb3_fmi_lf(f, &k, &j)) > 0; k0 = k) {
 		RB3_GROW(char, s->s, s->l + 1, s->m);
 		s->s[s->l++] = "$ACGTN"[c];
-		k = f->acc[c] + ok[c];
 	}
+	k = k0;
 	s->s[s->l] = 0;
 	for (i = 0; i < s->l>>1; ++i) // reverse
 		c = s->s[i], s->s[i] = s->s[s->l - 1 - i], s->s[s->l - 1 - i] = c;
@@ -570,7 +1079,9 @@ int64_t rb3_fmi_get_r(const rb3_fmi_t *f)
 {
 	int64_t l, r = 0;
 	int c, last_c = -1;
-	if (f->e) {
+	if (f->mv) {
+		r = f->mv->n_run - f->mv->n_split;
+	} else if (f->e) {
 		rlditr_t itr;
 		rld_itr_init(f->e, &itr, 0);
 		while ((l = rld_dec(f->e, &itr, &c, 0)) > 0)
@@ -591,11 +1102,82 @@ int64_t rb3_fmi_get_r(const rb3_fmi_t *f)
 	return r;
 }
 
-int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag)
+int rb3_fmi_to_mvt(rb3_fmi_t *f)
+{
+	mvt_t *m;
+	int64_t l;
+	int c;
+	if (f->mv) return 0;
+	if (f->e == 0 && f->r == 0) return -1;
+	m = mv_init();
+	if (f->e) {
+		rlditr_t itr;
+		rld_itr_init(f->e, &itr, 0);
+		while ((l = rld_dec(f->e, &itr, &c, 0)) > 0)
+			mv_push(m, c, l);
+		rld_destroy(f->e);
+	} else {
+		mritr_t ri;
+		const uint8_t *block;
+		mr_itr_first(f->r, &ri, 0);
+		while ((block = mr_itr_next_block(&ri)) != 0) {
+			const uint8_t *q = block + 2, *end = block + 2 + *rle_nptr(block);
+			while (q < end) {
+				rle_dec1(q, c, l);
+				mv_push(m, c, l);
+			}
+		}
+		mr_destroy(f->r);
+	}
+	mv_finish(m);
+	f->is_fmd = 0, f->e = 0, f->r = 0, f->mv = m;
+	rb3_fmi_get_acc(f, f->acc);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] built the move table for %ld runs (%ld added by balancing)\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)m->n_run, (long)m->n_split);
+	return 0;
+}
+
+#define RB3_PREFAULT_BLK 256
+
+typedef struct {
+	const volatile uint8_t *mem;
+	uint64_t size;
+} prefault_aux_t;
+
+static void worker_prefault(void *data, long i, int tid)
+{
+	prefault_aux_t *a = (prefault_aux_t*)data;
+	uint64_t st = a->size * i / RB3_PREFAULT_BLK, en = a->size * (i + 1) / RB3_PREFAULT_BLK, k;
+	for (k = st; k < en; k += 4096) (void)a->mem[k]; // one read per page
+}
+
+void rb3_fmi_prefault(const rb3_fmi_t *f, int n_threads)
+{
+	prefault_aux_t a;
+	if (!f->is_fmd || f->e->mem == 0) return; // not memory mapped
+	a.mem = (const volatile uint8_t*)f->e->mem, a.size = f->e->mem_size;
+	kt_for(n_threads, worker_prefault, &a, RB3_PREFAULT_BLK);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] prefaulted %.1f MB\n", __func__, rb3_realtime(), rb3_percent_cpu(), f->e->mem_size / 1048576.0);
+}
+
+int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag, int n_threads)
 {
 	FILE *fp;
 	char *buf;
-	rb3_fmi_restore(f, fn, load_flag&RB3_LOAD_MMAP);
+	int mmap_flag = 0;
+	if (load_flag & RB3_LOAD_POPULATE) mmap_flag |= RLD_MMAP_POPULATE;
+	if (load_flag & RB3_LOAD_HUGE) mmap_flag |= RLD_MMAP_HUGE;
+	if (load_flag & RB3_LOAD_HUGETLB) mmap_flag |= RLD_MMAP_HUGETLB;
+	if ((load_flag & RB3_LOAD_SHM) && rb3_fmi_shm_attach(f, fn, load_flag) == 0) {
+		if (rb3_verbose >= 3)
+			fprintf(stderr, "[M::%s::%.3f*%.2f] attached to the index in shared memory\n", __func__, rb3_realtime(), rb3_percent_cpu());
+		load_flag &= ~RB3_LOAD_PREFAULT;
+	} else {
+		if ((load_flag & RB3_LOAD_SHM) && rb3_verbose >= 2)
+			fprintf(stderr, "[W::%s] index \"%s\" is not in shared memory; loading from files\n", __func__, fn);
+		rb3_fmi_restore2(f, fn, load_flag&RB3_LOAD_MMAP, mmap_flag);
+	}
 	if (f->e == 0 && f->r == 0) {
 		if (rb3_verbose >= 1)
 			fprintf(stderr, "ERROR: failed to load BWT from file \"%s\"\n", fn);
@@ -603,8 +1185,29 @@ int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag)
 	}
 	if (rb3_verbose >= 3)
 		fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the BWT\n", __func__, rb3_realtime(), rb3_percent_cpu());
+	if ((load_flag & RB3_LOAD_PREFAULT) && !(load_flag & RB3_LOAD_MVT))
+		rb3_fmi_prefault(f, n_threads);
+	if (load_flag & RB3_LOAD_MVT) rb3_fmi_to_mvt(f);
 	buf = RB3_CALLOC(char, strlen(fn) + 8);
-	if (load_flag & RB3_LOAD_SSA) {
+	if ((load_flag & RB3_LOAD_SSA) && f->ssa == 0 && f->phi == 0) { // prefer the r-index phi samples
+		strcat(strcpy(buf, fn), ".phi");
+		if ((fp = fopen(buf, "r")) != 0) {
+			fclose(fp);
+			f->phi = rb3_phi_restore(buf);
+			if (f->phi == 0) {
+				if (rb3_verbose >= 1)
+					fprintf(stderr, "ERROR: failed to load phi samples from file \"%s\"\n", buf);
+			} else if (f->phi->m != f->acc[1]) {
+				if (rb3_verbose >= 1)
+					fprintf(stderr, "ERROR: number of sequences do not match between BWT and phi samples\n");
+				rb3_phi_destroy(f->phi);
+				f->phi = 0;
+			}
+			if (f->phi && rb3_verbose >= 3)
+				fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the phi samples\n", __func__, rb3_realtime(), rb3_percent_cpu());
+		}
+	}
+	if ((load_flag & RB3_LOAD_SSA) && f->phi == 0 && f->ssa == 0) {
 		strcat(strcpy(buf, fn), ".ssa");
 		if ((fp = fopen(buf, "r")) != 0) {
 			fclose(fp);
@@ -622,7 +1225,7 @@ int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag)
 				fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the sampled suffix array\n", __func__, rb3_realtime(), rb3_percent_cpu());
 		}
 	}
-	if ((load_flag & RB3_LOAD_SSA) && (load_flag & RB3_LOAD_SID)) {
+	if ((load_flag & RB3_LOAD_SSA) && (load_flag & RB3_LOAD_SID) && f->sid == 0) {
 		strcat(strcpy(buf, fn), ".len.gz");
 		if ((fp = fopen(buf, "r")) != 0) {
 			fclose(fp);
@@ -640,6 +1243,24 @@ int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag)
 				fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the sequence names and lengths\n", __func__, rb3_realtime(), rb3_percent_cpu());
 		}
 	}
+	if ((load_flag & RB3_LOAD_KMT) && f->kmt == 0) {
+		strcat(strcpy(buf, fn), ".kmt");
+		if ((fp = fopen(buf, "r")) != 0) {
+			fclose(fp);
+			f->kmt = rb3_kmt_restore(buf);
+			if (f->kmt == 0) {
+				if (rb3_verbose >= 1)
+					fprintf(stderr, "ERROR: failed to load the k-mer table from file \"%s\"\n", buf);
+			} else if (f->kmt->tot != f->acc[RB3_ASIZE]) {
+				if (rb3_verbose >= 1)
+					fprintf(stderr, "ERROR: BWT length does not match between BWT and the k-mer table\n");
+				rb3_kmt_destroy(f->kmt);
+				f->kmt = 0;
+			}
+			if (f->kmt && rb3_verbose >= 3)
+				fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the %d-mer table\n", __func__, rb3_realtime(), rb3_percent_cpu(), f->kmt->k);
+		}
+	}
 	free(buf);
 	return 0;
 }
@@ -6,6 +6,7 @@
 #include "rb3priv.h"
 #include "rld0.h"
 #include "mrope.h"
+#include "mvt.h"
 #include "io.h"
 
 #ifdef __cplusplus
@@ -19,8 +20,17 @@ typedef enum { RB3_PLAIN, RB3_FMD, RB3_FMR, RB3_TREE, RB3_BRE } rb3_fmt_t;
 #define RB3_LOAD_MMAP  0x1
 #define RB3_LOAD_SSA   0x2
 #define RB3_LOAD_SID   0x4
+#define RB3_LOAD_KMT   0x8
+#define RB3_LOAD_MVT   0x10 // replace FMD/FMR with the move table after loading
+#define RB3_LOAD_POPULATE 0x20 // with RB3_LOAD_MMAP: MAP_POPULATE
+#define RB3_LOAD_HUGE     0x40 // with RB3_LOAD_MMAP: anonymous memory with transparent huge pages
+#define RB3_LOAD_HUGETLB  0x80 // with RB3_LOAD_MMAP: anonymous memory from hugetlbfs
+#define RB3_LOAD_PREFAULT 0x100 // with RB3_LOAD_MMAP: touch all pages with multiple threads
+#define RB3_LOAD_SHM      0x200 // attach to the index put by "ropebwt3 shm" if available
 #define RB3_LOAD_ALL   (RB3_LOAD_SSA|RB3_LOAD_SID)
 
+#define RB3_KMT_MAX_K  15
+
 typedef struct {
 	int64_t x[2]; // 0: start of the interval, backward; 1: forward
 	int64_t size;
@@ -39,31 +49,63 @@ typedef struct {
 	int64_t sid, pos;
 } rb3_pos_t;
 
+typedef struct {
+	int32_t k; // k-mer length
+	int64_t n_kmer; // 1<<2*k
+	int64_t tot; // total length of the BWT; for consistency check
+	uint64_t *a; // a[2*i]: start of the SA interval of the i-th k-mer; a[2*i+1]: size of the interval
+} rb3_kmt_t;
+
+typedef struct { uint64_t x, y; } rb3_phi_pair_t;
+
+typedef struct {
+	int64_t m; // number of sequences
+	int64_t n_phi, n_th; // number of phi samples and toeholds
+	uint64_t *off; // off[i]: start of the i-th sequence on the concatenated text
+	uint64_t *o2s; // o2s[i]: ID of the i-th sequence on the text
+	rb3_phi_pair_t *phi; // x: text position, sorted; y: phi(x)
+	rb3_phi_pair_t *th; // x: BWT row, sorted; y: SA[x] on the text
+} rb3_phi_t;
+
 typedef struct {
 	int32_t is_fmd;
 	rld_t *e;
 	mrope_t *r;
+	mvt_t *mv; // if not NULL, e and r are both NULL
 	rb3_ssa_t *ssa;
 	rb3_sid_t *sid;
+	rb3_kmt_t *kmt;
+	rb3_phi_t *phi;
+	void *shm; // if not NULL, e, ssa, sid and kmt point into this shared memory segment
+	int64_t shm_size;
 	int64_t acc[RB3_ASIZE+1];
 } rb3_fmi_t;
 
 typedef struct { size_t n, m; rb3_sai_t *a; } rb3_sai_v;
 
+typedef struct {
+	int32_t w; // bits per entry; if 1, a[] is the interleave bitvector: bit i is set if row i of the merged BWT comes from the incoming BWT
+	uint64_t mask;
+	uint64_t *a; // entry i: rank in the current BWT <<3 | symbol at i in the incoming BWT
+} rb3_mgrank_t; // bit-packed rank array for merging
+
 rld_t *rb3_enc_plain2rld(int64_t len, const uint8_t *bwt, int cbits);
-rld_t *rb3_enc_fmr2fmd(mrope_t *r, int cbits, int is_free);
+rld_t *rb3_enc_fmr2fmd(mrope_t *r, int cbits, int n_threads, int is_free);
 mrope_t *rb3_enc_plain2fmr(int64_t len, const uint8_t *bwt, int max_nodes, int block_len, int32_t n_threads);
-mrope_t *rb3_enc_fmd2fmr(rld_t *e, int max_nodes, int block_len, int is_free);
+mrope_t *rb3_enc_fmd2fmr(rld_t *e, int max_nodes, int block_len, int n_threads, int is_free);
 
 void *rb3_r2cache_init(void *km, int32_t max);
 void rb3_r2cache_destroy(void *rc_);
 void rb3_fmi_rank2a_cached(const rb3_fmi_t *fmi, void *rc_, int64_t k, int64_t l, int64_t ok[6], int64_t ol[6]);
 void rb3_fmd_extend_cached(const rb3_fmi_t *f, void *rc, const rb3_sai_t *ik, rb3_sai_t ok[RB3_ASIZE], int is_back);
 
-void rb3_mg_rank(const rb3_fmi_t *fa, const rb3_fmi_t *fb, int64_t *rb, int n_threads);
-void rb3_mg_rank_plain(const rb3_fmi_t *fa, int64_t len, const uint8_t *seq, int64_t *rb, int64_t acc[RB3_ASIZE+1], int n_threads);
+void rb3_mg_rank_init(rb3_mgrank_t *rb, int64_t n, int64_t max);
+void rb3_mg_rank(const rb3_fmi_t *fa, const rb3_fmi_t *fb, rb3_mgrank_t *rb, int n_threads);
+void rb3_mg_rank_plain(const rb3_fmi_t *fa, int64_t len, const uint8_t *seq, rb3_mgrank_t *rb, int64_t acc[RB3_ASIZE+1], int n_threads);
 void rb3_fmi_merge(mrope_t *r, rb3_fmi_t *fb, int n_threads, int free_fb);
 void rb3_fmi_merge_plain(mrope_t *r, int64_t len, const uint8_t *seq, int n_threads);
+rld_t *rb3_fmi_merge_fmd(const rb3_fmi_t *fa, rb3_fmi_t *fb, int n_threads, int free_fb);
+rld_t *rb3_fmi_merge_tree(const char *prefix, int64_t n_fn, char **fn, int64_t n_in, int64_t id, int use_mvt, int n_threads); // in build.c; fn[n_in..] are temporary and removed
 
 int64_t rb3_fmi_get_r(const rb3_fmi_t *f);
 int64_t rb3_fmi_get_acc(const rb3_fmi_t *fmi, int64_t acc[RB3_ASIZE+1]);
@@ -71,6 +113,7 @@ int64_t rb3_fmi_retrieve(const rb3_fmi_t *f, int64_t k, kstring_t *s);
 void rb3_fmd_extend(const rb3_fmi_t *f, const rb3_sai_t *ik, rb3_sai_t ok[RB3_ASIZE], int is_back);
 int64_t rb3_fmd_smem(void *km, const rb3_fmi_t *f, int64_t len, const uint8_t *q, rb3_sai_v *mem, int64_t min_occ, int64_t min_len);
 int64_t rb3_fmd_smem_TG(void *km, const rb3_fmi_t *f, int64_t len, const uint8_t *q, rb3_sai_v *mem, int64_t min_occ, int64_t min_len);
+void rb3_fmd_smem_TG_multi(void *km, const rb3_fmi_t *f, int32_t n, const int64_t *len, const uint8_t **q, rb3_sai_v *mem, int64_t min_occ, int64_t min_len, int32_t n_lane);
 int32_t rb3_fmd_smem_present(const rb3_fmi_t *f, int64_t len, const uint8_t *q, int64_t min_len);
 
 int64_t rb3_ssa(const rb3_fmi_t *f, const rb3_ssa_t *sa, int64_t k, int64_t *si);
@@ -80,7 +123,27 @@ int rb3_ssa_dump(const rb3_ssa_t *sa, const char *fn);
 rb3_ssa_t *rb3_ssa_restore(const char *fn);
 rb3_ssa_t *rb3_ssa_gen(const rb3_fmi_t *f, int ssa_shift, int n_threads);
 
-int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag);
+rb3_kmt_t *rb3_kmt_gen(const rb3_fmi_t *f, int k, int n_threads);
+int rb3_kmt_get(const rb3_kmt_t *t, const uint8_t *q, rb3_sai_t *ik);
+void rb3_kmt_destroy(rb3_kmt_t *t);
+int rb3_kmt_dump(const rb3_kmt_t *t, const char *fn);
+rb3_kmt_t *rb3_kmt_restore(const char *fn);
+
+rb3_phi_t *rb3_phi_gen(const rb3_fmi_t *f, int n_threads);
+void rb3_phi_destroy(rb3_phi_t *ph);
+int rb3_phi_dump(const rb3_phi_t *ph, const char *fn);
+rb3_phi_t *rb3_phi_restore(const char *fn);
+int64_t rb3_phi_toehold(const rb3_fmi_t *f, const rb3_phi_t *ph, int64_t len, const uint8_t *q, int64_t *lo, int64_t *hi);
+int64_t rb3_phi_locate(const rb3_fmi_t *f, const rb3_phi_t *ph, int64_t len, const uint8_t *q, int64_t max_sa, rb3_pos_t *sa);
+int64_t rb3_locate(void *km, const rb3_fmi_t *f, int64_t lo, int64_t hi, int64_t len, const uint8_t *q, int64_t max_sa, rb3_pos_t *sa);
+
+int rb3_fmi_to_mvt(rb3_fmi_t *f);
+void rb3_fmi_prefault(const rb3_fmi_t *f, int n_threads);
+int rb3_fmi_shm_attach(rb3_fmi_t *f, const char *fn, int32_t load_flag);
+void rb3_fmi_shm_detach(rb3_fmi_t *f);
+int rb3_shm_put(const char *fn);
+int rb3_shm_drop(const char *fn);
+int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag, int n_threads); // n_threads is only used by RB3_LOAD_PREFAULT
 
 static inline int rb3_comp(int c)
 {
@@ -96,34 +159,60 @@ static inline void rb3_fmi_init(rb3_fmi_t *f, rld_t *e, mrope_t *r)
 {
 	if (e) f->is_fmd = 1, f->e = e, f->r = 0;
 	else f->is_fmd = 0, f->e = 0, f->r = r;
-	f->ssa = 0;
+	f->mv = 0;
+	f->ssa = 0, f->sid = 0, f->kmt = 0, f->phi = 0, f->shm = 0, f->shm_size = 0;
 	rb3_fmi_get_acc(f, f->acc);
 }
 
 static inline void rb3_fmi_rank2a(const rb3_fmi_t *fmi, int64_t k, int64_t l, int64_t *ok, int64_t *ol)
 {
 	if (fmi->is_fmd) rld_rank2a(fmi->e, k, l, (uint64_t*)ok, (uint64_t*)ol);
+	else if (fmi->mv) mv_rank2a(fmi->mv, k, l, (uint64_t*)ok, (uint64_t*)ol);
 	else mr_rank2a(fmi->r, k, l, ok, ol);
 }
 
 static inline int rb3_fmi_rank1a(const rb3_fmi_t *fmi, int64_t k, int64_t *ok)
 {
-	return fmi->is_fmd? rld_rank1a(fmi->e, k, (uint64_t*)ok) : mr_rank1a(fmi->r, k, ok);
+	if (fmi->is_fmd) return rld_rank1a(fmi->e, k, (uint64_t*)ok);
+	else if (fmi->mv) return mv_rank1a(fmi->mv, k, (uint64_t*)ok);
+	else return mr_rank1a(fmi->r, k, ok);
+}
+
+// LF-mapping: *k=LF(*k) and return BWT[*k]. $j caches the run containing *k for the move table; initialize it to -1
+static inline int rb3_fmi_lf(const rb3_fmi_t *fmi, int64_t *k, int64_t *j)
+{
+	int64_t ok[RB3_ASIZE];
+	int c;
+	if (fmi->mv) return mv_lf(fmi->mv, (uint64_t*)k, j);
+	c = rb3_fmi_rank1a(fmi, *k, ok);
+	*k = fmi->acc[c] + ok[c];
+	return c;
+}
+
+static inline void rb3_fmi_prefetch(const rb3_fmi_t *fmi, int64_t k, int is_blk) // no-op for FMR
+{
+	if (!fmi->is_fmd) return;
+	if (is_blk) rld_prefetch_blk(fmi->e, k);
+	else rld_prefetch_frame(fmi->e, k);
 }
 
 static inline void rb3_fmi_free(rb3_fmi_t *fmi)
 {
+	if (fmi->shm) rb3_fmi_shm_detach(fmi);
 	if (fmi->is_fmd) rld_destroy(fmi->e);
-	else mr_destroy(fmi->r);
+	else if (fmi->r) mr_destroy(fmi->r);
+	if (fmi->mv) mv_destroy(fmi->mv);
 	if (fmi->ssa) rb3_ssa_destroy(fmi->ssa);
 	if (fmi->sid) rb3_sid_destroy(fmi->sid);
-	fmi->e = 0, fmi->r = 0, fmi->ssa = 0;
+	if (fmi->kmt) rb3_kmt_destroy(fmi->kmt);
+	if (fmi->phi) rb3_phi_destroy(fmi->phi);
+	fmi->e = 0, fmi->r = 0, fmi->mv = 0, fmi->ssa = 0, fmi->sid = 0, fmi->kmt = 0, fmi->phi = 0;
 }
 
-static inline void rb3_fmi_restore(rb3_fmi_t *fmi, const char *fn, int use_mmap)
+static inline void rb3_fmi_restore2(rb3_fmi_t *fmi, const char *fn, int use_mmap, int mmap_flag)
 {
-	fmi->r = 0, fmi->e = 0, fmi->ssa = 0, fmi->sid = 0;
-	fmi->e = use_mmap? rld_restore_mmap(fn) : rld_restore(fn);
+	fmi->r = 0, fmi->e = 0, fmi->mv = 0, fmi->ssa = 0, fmi->sid = 0, fmi->kmt = 0, fmi->phi = 0, fmi->shm = 0, fmi->shm_size = 0;
+	fmi->e = use_mmap? rld_restore_mmap2(fn, mmap_flag) : rld_restore(fn);
 	if (fmi->e == 0) {
 		fmi->r = mr_restore_file(fn);
 		fmi->is_fmd = 0;
@@ -132,6 +221,11 @@ static inline void rb3_fmi_restore(rb3_fmi_t *fmi, const char *fn, int use_mmap)
 	rb3_fmi_get_acc(fmi, fmi->acc);
 }
 
+static inline void rb3_fmi_restore(rb3_fmi_t *fmi, const char *fn, int use_mmap)
+{
+	rb3_fmi_restore2(fmi, fn, use_mmap, 0);
+}
+
 static inline int rb3_fmi_is_symmetric(const rb3_fmi_t *f)
 {
 	return ((f->acc[1]&1) == 0 && f->acc[2] - f->acc[1] == f->acc[5] - f->acc[4] && f->acc[3] - f->acc[2] == f->acc[4] - f->acc[3]);
@@ -4,10 +4,23 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rb3priv.h"
 #include "io.h"
+#include "kthread.h"
 #include "kseq.h"
-KSEQ_INIT(gzFile, gzread)
+
+#if defined(__SSE2__)
+#define RB3_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#define RB3_AVX2
+#include <immintrin.h>
+#endif
+#endif
 
 const uint8_t rb3_nt6_table[128] = {
     0, 1, 2, 3,  4, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5,
@@ -20,48 +33,432 @@ const uint8_t rb3_nt6_table[128] = {
     5, 5, 5, 5,  4, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5
 };
 
-void rb3_char2nt6(int64_t l, uint8_t *s)
+static inline uint8_t rb3_comp6(uint8_t c)
 {
-	int64_t i;
-	for (i = 0; i < l; ++i)
-		s[i] = s[i] < 128? rb3_nt6_table[s[i]] : 5;
+	return c >= 1 && c <= 4? 5 - c : c;
 }
 
-void rb3_revcomp6(int64_t l, uint8_t *s)
+#ifdef RB3_SSE2
+static inline __m128i rb3_enc16(__m128i x) // same as rb3_nt6_table[]
 {
+	__m128i lo = _mm_or_si128(x, _mm_set1_epi8(0x20)), a, c, g, t, s, r;
+	a = _mm_cmpeq_epi8(lo, _mm_set1_epi8('a'));
+	c = _mm_cmpeq_epi8(lo, _mm_set1_epi8('c'));
+	g = _mm_cmpeq_epi8(lo, _mm_set1_epi8('g'));
+	t = _mm_cmpeq_epi8(lo, _mm_set1_epi8('t'));
+	s = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(4)), x); // 0-4 are kept
+	r = _mm_or_si128(_mm_and_si128(a, _mm_set1_epi8(1)), _mm_and_si128(c, _mm_set1_epi8(2)));
+	r = _mm_or_si128(r, _mm_or_si128(_mm_and_si128(g, _mm_set1_epi8(3)), _mm_and_si128(t, _mm_set1_epi8(4))));
+	r = _mm_or_si128(r, _mm_and_si128(s, x));
+	s = _mm_or_si128(_mm_or_si128(a, c), _mm_or_si128(_mm_or_si128(g, t), s));
+	return _mm_or_si128(r, _mm_andnot_si128(s, _mm_set1_epi8(5)));
+}
+
+static inline __m128i rb3_comp16(__m128i x)
+{
+	__m128i y = _mm_sub_epi8(x, _mm_set1_epi8(1)), m;
+	m = _mm_cmpeq_epi8(_mm_min_epu8(y, _mm_set1_epi8(3)), y); // 1-4
+	return _mm_xor_si128(x, _mm_and_si128(m, _mm_xor_si128(x, _mm_sub_epi8(_mm_set1_epi8(5), x))));
+}
+
+static inline __m128i rb3_rev16(__m128i x)
+{
+	x = _mm_shuffle_epi32(x, 0x1b);
+	x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1);
+	return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+#endif
+
+#ifdef RB3_AVX2
+__attribute__((target("avx2")))
+static int64_t rb3_nt6_copy_avx2(int64_t l, const uint8_t *src, uint8_t *dst, int is_rc)
+{ // process 32 symbols at a time; return the number of symbols processed
 	int64_t i;
-	for (i = 0; i < l>>1; ++i) {
-		int tmp = s[l-1-i];
-		tmp = (tmp >= 1 && tmp <= 4)? 5 - tmp : tmp;
-		s[l-1-i] = (s[i] >= 1 && s[i] <= 4)? 5 - s[i] : s[i];
-		s[i] = tmp;
+	const __m256i rv = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	for (i = 0; i + 32 <= l; i += 32) {
+		__m256i x, y, m;
+		if (!is_rc) {
+			__m256i lo, a, c, g, t, s, r;
+			x = _mm256_loadu_si256((const __m256i*)(src + i));
+			lo = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+			a = _mm256_cmpeq_epi8(lo, _mm256_set1_epi8('a'));
+			c = _mm256_cmpeq_epi8(lo, _mm256_set1_epi8('c'));
+			g = _mm256_cmpeq_epi8(lo, _mm256_set1_epi8('g'));
+			t = _mm256_cmpeq_epi8(lo, _mm256_set1_epi8('t'));
+			s = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(4)), x);
+			r = _mm256_or_si256(_mm256_and_si256(a, _mm256_set1_epi8(1)), _mm256_and_si256(c, _mm256_set1_epi8(2)));
+			r = _mm256_or_si256(r, _mm256_or_si256(_mm256_and_si256(g, _mm256_set1_epi8(3)), _mm256_and_si256(t, _mm256_set1_epi8(4))));
+			r = _mm256_or_si256(r, _mm256_and_si256(s, x));
+			s = _mm256_or_si256(_mm256_or_si256(a, c), _mm256_or_si256(_mm256_or_si256(g, t), s));
+			_mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(r, _mm256_andnot_si256(s, _mm256_set1_epi8(5))));
+		} else { // reverse complement of nt6
+			x = _mm256_loadu_si256((const __m256i*)(src + l - i - 32));
+			x = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(x, rv), 0x4e);
+			y = _mm256_sub_epi8(x, _mm256_set1_epi8(1));
+			m = _mm256_cmpeq_epi8(_mm256_min_epu8(y, _mm256_set1_epi8(3)), y);
+			x = _mm256_xor_si256(x, _mm256_and_si256(m, _mm256_xor_si256(x, _mm256_sub_epi8(_mm256_set1_epi8(5), x))));
+			_mm256_storeu_si256((__m256i*)(dst + i), x);
+		}
+	}
+	return i;
+}
+
+static int rb3_has_avx2(void)
+{
+	static int avx2 = -1;
+	if (avx2 < 0) avx2 = __builtin_cpu_supports("avx2")? 1 : 0;
+	return avx2;
+}
+#endif
+
+static void rb3_nt6_copy(int64_t l, const uint8_t *src, uint8_t *dst)
+{ // encode to nt6; $src may equal $dst
+	int64_t i = 0;
+#ifdef RB3_AVX2
+	if (rb3_has_avx2()) i = rb3_nt6_copy_avx2(l, src, dst, 0);
+#endif
+#ifdef RB3_SSE2
+	for (; i + 16 <= l; i += 16)
+		_mm_storeu_si128((__m128i*)(dst + i), rb3_enc16(_mm_loadu_si128((const __m128i*)(src + i))));
+#endif
+	for (; i < l; ++i)
+		dst[i] = src[i] < 128? rb3_nt6_table[src[i]] : 5;
+}
+
+static void rb3_revcomp6_copy(int64_t l, const uint8_t *src, uint8_t *dst)
+{ // reverse complement of nt6 $src; $src and $dst must not overlap
+	int64_t i = 0;
+#ifdef RB3_AVX2
+	if (rb3_has_avx2()) i = rb3_nt6_copy_avx2(l, src, dst, 1);
+#endif
+#ifdef RB3_SSE2
+	for (; i + 16 <= l; i += 16)
+		_mm_storeu_si128((__m128i*)(dst + i), rb3_comp16(rb3_rev16(_mm_loadu_si128((const __m128i*)(src + l - i - 16)))));
+#endif
+	for (; i < l; ++i)
+		dst[i] = rb3_comp6(src[l - 1 - i]);
+}
+
+static void rb3_reverse1(int64_t l, uint8_t *s, int is_comp)
+{ // reverse, or reverse complement, in place
+	int64_t i = 0, j, k;
+#ifdef RB3_SSE2
+	for (; (i + 16) * 2 <= l; i += 16) { // swap a block from each end
+		__m128i f = rb3_rev16(_mm_loadu_si128((__m128i*)(s + i))), b = rb3_rev16(_mm_loadu_si128((__m128i*)(s + l - i - 16)));
+		if (is_comp) f = rb3_comp16(f), b = rb3_comp16(b);
+		_mm_storeu_si128((__m128i*)(s + i), b);
+		_mm_storeu_si128((__m128i*)(s + l - i - 16), f);
 	}
-	if (l&1) s[i] = (s[i] >= 1 && s[i] <= 4)? 5 - s[i] : s[i];
+#endif
+	for (j = i, k = l - 1 - i; j < k; ++j, --k) {
+		uint8_t tmp = s[k];
+		s[k] = is_comp? rb3_comp6(s[j]) : s[j];
+		s[j] = is_comp? rb3_comp6(tmp) : tmp;
+	}
+	if (j == k && is_comp) s[j] = rb3_comp6(s[j]);
+}
+
+void rb3_char2nt6(int64_t l, uint8_t *s)
+{
+	rb3_nt6_copy(l, s, s);
+}
+
+void rb3_revcomp6(int64_t l, uint8_t *s)
+{
+	rb3_reverse1(l, s, 1);
 }
 
 static inline void rb3_reverse(int64_t l, uint8_t *s)
 {
+	rb3_reverse1(l, s, 0);
+}
+
+/*************************
+ * Parallel BGZF reading *
+ *************************/
+
+#define RB3_BGZF_HDR    18
+#define RB3_BGZF_N_BLK  256 // number of blocks inflated together
+
+typedef struct {
+	int64_t off, len; // compressed data in zfile_t::raw
+	int64_t o_off, o_len; // decompressed data in zfile_t::out
+	int ret;
+} zblock_t;
+
+typedef struct {
+	gzFile gz; // if not NULL, read with zlib
+	FILE *fp; // BGZF
+	int n_threads;
+	int err; // 1 if a read error follows the current group; -1 after the error has been reported
+	int64_t off, n_blk; // next unread byte in out
+	zblock_t blk[RB3_BGZF_N_BLK];
+	kstring_t raw, out;
+} zfile_t;
+
+static int zf_is_bgzf(const uint8_t *h)
+{
+	return h[0] == 31 && h[1] == 139 && h[2] == 8 && (h[3]&4) && h[10] == 6 && h[11] == 0 && h[12] == 'B' && h[13] == 'C' && h[14] == 2 && h[15] == 0;
+}
+
+static zfile_t *zf_open(const char *fn, int n_threads)
+{ // BGZF blocks are inflated with $n_threads, even if 1, such that a truncated file is read the same way; other files are read with zlib
+	zfile_t *zf;
+	zf = RB3_CALLOC(zfile_t, 1);
+	zf->n_threads = n_threads > 0? n_threads : 1;
+	if (fn && strcmp(fn, "-")) { // BGZF detection needs to reopen the file
+		uint8_t h[RB3_BGZF_HDR];
+		zf->fp = fopen(fn, "rb");
+		if (zf->fp && fread(h, 1, RB3_BGZF_HDR, zf->fp) == RB3_BGZF_HDR && zf_is_bgzf(h)) {
+			rewind(zf->fp);
+			return zf;
+		}
+		if (zf->fp) fclose(zf->fp);
+		zf->fp = 0;
+	}
+	zf->gz = fn && strcmp(fn, "-")? gzopen(fn, "r") : gzdopen(0, "r");
+	if (zf->gz == 0) {
+		free(zf);
+		return 0;
+	}
+	return zf;
+}
+
+static void zf_close(zfile_t *zf)
+{
+	if (zf == 0) return;
+	if (zf->gz) gzclose(zf->gz);
+	if (zf->fp) fclose(zf->fp);
+	free(zf->raw.s); free(zf->out.s);
+	free(zf);
+}
+
+static inline uint32_t zf_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+static void worker_inflate(void *data, long i, int tid)
+{
+	zfile_t *zf = (zfile_t*)data;
+	zblock_t *b = &zf->blk[i];
+	const uint8_t *p = (uint8_t*)zf->raw.s + b->off;
+	uint8_t *q = (uint8_t*)zf->out.s + b->o_off;
+	z_stream zs;
+	memset(&zs, 0, sizeof(z_stream));
+	b->ret = -1;
+	if (inflateInit2(&zs, -15) != Z_OK) return;
+	zs.next_in = (Bytef*)p + RB3_BGZF_HDR, zs.avail_in = b->len - RB3_BGZF_HDR - 8;
+	zs.next_out = q, zs.avail_out = b->o_len;
+	if (inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == b->o_len && crc32(crc32(0L, 0, 0), q, b->o_len) == zf_le32(p + b->len - 8))
+		b->ret = 0;
+	inflateEnd(&zs);
+}
+
+static int64_t zf_fill(zfile_t *zf)
+{ // read and inflate the next group of blocks; return the number of decompressed bytes. Blocks before a bad one are kept
 	int64_t i;
-	for (i = 0; i < l>>1; ++i) {
-		int tmp = s[l-1-i];
-		s[l-1-i] = s[i];
-		s[i] = tmp;
+	zf->raw.l = zf->out.l = zf->off = 0;
+	for (zf->n_blk = 0; zf->n_blk < RB3_BGZF_N_BLK; ++zf->n_blk) {
+		zblock_t *b = &zf->blk[zf->n_blk];
+		uint8_t *h;
+		size_t n;
+		RB3_GROW(char, zf->raw.s, zf->raw.l + RB3_BGZF_HDR, zf->raw.m);
+		h = (uint8_t*)zf->raw.s + zf->raw.l;
+		n = fread(h, 1, RB3_BGZF_HDR, zf->fp);
+		if (n == 0) break;
+		if (n != RB3_BGZF_HDR || !zf_is_bgzf(h)) {
+			zf->err = 1;
+			break;
+		}
+		b->off = zf->raw.l, b->len = (h[16] | h[17]<<8) + 1;
+		if (b->len < RB3_BGZF_HDR + 8) {
+			zf->err = 1;
+			break;
+		}
+		RB3_GROW(char, zf->raw.s, zf->raw.l + b->len, zf->raw.m);
+		if (fread(zf->raw.s + zf->raw.l + RB3_BGZF_HDR, 1, b->len - RB3_BGZF_HDR, zf->fp) != (size_t)(b->len - RB3_BGZF_HDR)) {
+			zf->err = 1;
+			break;
+		}
+		zf->raw.l += b->len;
+		b->o_off = zf->out.l, b->o_len = zf_le32((uint8_t*)zf->raw.s + zf->raw.l - 4);
+		zf->out.l += b->o_len;
 	}
+	RB3_GROW(char, zf->out.s, zf->out.l, zf->out.m);
+	kt_for(zf->n_threads, worker_inflate, zf, zf->n_blk);
+	for (i = 0; i < zf->n_blk; ++i) {
+		if (zf->blk[i].ret < 0) { // drop this block and the rest of the group
+			zf->n_blk = i, zf->out.l = zf->blk[i].o_off, zf->err = 1;
+			break;
+		}
+	}
+	return zf->out.l;
+}
+
+static int zf_read(zfile_t *zf, void *buf, int len)
+{ // kseq takes a short read as the end of file, so fill $buf unless there is no more data
+	int64_t n, l = 0;
+	if (zf->gz) {
+		int zerr = Z_OK;
+		n = gzread(zf->gz, buf, len);
+		if (n < len) gzerror(zf->gz, &zerr);
+		if (n < 0 || (zerr != Z_OK && zerr != Z_STREAM_END)) { // a truncated gzip file ends with Z_BUF_ERROR
+			if (zf->err == 0 && rb3_verbose >= 1) fprintf(stderr, "ERROR: failed to read or decompress the input\n");
+			zf->err = -1;
+		}
+		return n;
+	}
+	while (l < len) {
+		if (zf->off == (int64_t)zf->out.l) { // an empty block may be followed by more blocks
+			if (zf->err > 0) { // report the error after all good data has been consumed
+				if (rb3_verbose >= 1) fprintf(stderr, "ERROR: malformed or truncated BGZF block\n");
+				zf->err = -1;
+			}
+			if (zf->err < 0) return l > 0? l : -1;
+			zf_fill(zf);
+			if (zf->n_blk == 0 && zf->err == 0) break;
+			continue;
+		}
+		n = zf->out.l - zf->off < len - l? zf->out.l - zf->off : len - l;
+		memcpy((char*)buf + l, zf->out.s + zf->off, n);
+		zf->off += n, l += n;
+	}
+	return l;
+}
+
+KSEQ_INIT(zfile_t*, zf_read)
+
+/*************************
+ * Memory-mapped reading *
+ *************************/
+
+typedef struct {
+	uint8_t *base; // private writable mapping, followed by at least one zero byte
+	int64_t len, off, rel, map_len; // file length, next unread byte, released bytes and mapping size
+	int64_t pg; // page size
+} mfile_t;
+
+static mfile_t *mf_open(const char *fn)
+{ // map an uncompressed regular file; return NULL if the file should be read with zlib
+	struct stat st;
+	mfile_t *mf;
+	uint8_t h[2];
+	void *p;
+	int64_t pg;
+	int fd;
+	if (fn == 0 || strcmp(fn, "-") == 0) return 0;
+	if ((fd = open(fn, O_RDONLY)) < 0) return 0;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (st.st_size >= 2 && (pread(fd, h, 2, 0) != 2 || (h[0] == 0x1f && h[1] == 0x8b)))) {
+		close(fd);
+		return 0;
+	}
+	pg = sysconf(_SC_PAGESIZE);
+	p = mmap(0, st.st_size + pg, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0); // reserve a zero page after the file
+	if (p != MAP_FAILED && mmap(p, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(p, st.st_size + pg);
+		p = MAP_FAILED;
+	}
+	close(fd);
+	if (p == MAP_FAILED) return 0;
+#ifdef MADV_SEQUENTIAL
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+#endif
+	mf = RB3_CALLOC(mfile_t, 1);
+	mf->base = (uint8_t*)p, mf->len = st.st_size, mf->map_len = st.st_size + pg, mf->pg = pg;
+	return mf;
+}
+
+static void mf_close(mfile_t *mf)
+{
+	if (mf == 0) return;
+	munmap(mf->base, mf->map_len);
+	free(mf);
+}
+
+static void mf_release(mfile_t *mf, const uint8_t *end)
+{ // drop pages entirely before $end; they may be dirty after in-place parsing
+	int64_t e = (end - mf->base) / mf->pg * mf->pg;
+	if (e <= mf->rel) return;
+	madvise(mf->base + mf->rel, e - mf->rel, MADV_DONTNEED);
+	mf->rel = e;
+}
+
+static inline int mf_isspace(int c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+static inline int64_t mf_eol(const mfile_t *mf, int64_t i)
+{ // position of the next '\n' or the end of file
+	const uint8_t *q = i < mf->len? (const uint8_t*)memchr(mf->base + i, '\n', mf->len - i) : 0;
+	return q? q - mf->base : mf->len;
+}
+
+static int64_t mf_read_line(mfile_t *mf, char **seq)
+{
+	int64_t i = mf->off, e, l;
+	if (i >= mf->len) return -1;
+	e = mf_eol(mf, i);
+	l = e - i;
+	if (l > 1 && mf->base[e - 1] == '\r') --l;
+	mf->base[i + l] = 0;
+	*seq = (char*)mf->base + i;
+	mf->off = e < mf->len? e + 1 : mf->len;
+	return l;
+}
+
+static int64_t mf_read_fx(mfile_t *mf, char **seq, char **name)
+{ // parse one FASTA/FASTQ record in place with the kseq semantics; return -1 at EOF or -2 for truncated quality
+	uint8_t *b = mf->base;
+	int64_t i = mf->off, n = mf->len, st, e, l = 0, q = 0;
+	while (i < n && b[i] != '>' && b[i] != '@') ++i;
+	if (i + 1 >= n) {
+		mf->off = n;
+		return -1;
+	}
+	st = ++i;
+	while (i < n && !mf_isspace(b[i])) ++i;
+	e = i < n && b[i] == '\n'? i : mf_eol(mf, i); // skip the comment
+	b[i] = 0, *name = (char*)b + st;
+	*seq = *name + (i - st); // an empty sequence points to the end of the name
+	for (i = st = e + 1; i < n && b[i] != '>' && b[i] != '+' && b[i] != '@'; i = e + 1) { // compact sequence lines
+		if (b[i] == '\n') {
+			e = i;
+			continue;
+		}
+		e = mf_eol(mf, i);
+		if (st + l != i) memmove(b + st + l, b + i, e - i);
+		l += e - i;
+		if (l > 1 && b[st + l - 1] == '\r') --l;
+	}
+	if (i > n) i = n;
+	if (l > 0) b[st + l] = 0, *seq = (char*)b + st;
+	mf->off = i;
+	if (i == n || b[i] != '+') return l; // FASTA
+	if ((e = mf_eol(mf, i)) == n) return -2; // no quality line
+	for (i = e + 1; i < n; ) { // like kseq, read at least one quality line
+		e = mf_eol(mf, i);
+		q += e - i;
+		if (q > 1 && b[e - 1] == '\r') --q;
+		i = e + 1;
+		if (q >= l) break;
+	}
+	mf->off = i < n? i : n;
+	return q == l? l : -2;
 }
 
 struct rb3_seqio_s {
 	int32_t is_line;
 	kseq_t *fx;
 	kstream_t *fl;
-	gzFile fp;
+	zfile_t *fp;
+	mfile_t *mf; // if not NULL, parse in place
 	kstring_t line_buf;
 };
 
-rb3_seqio_t *rb3_seq_open(const char *fn, int is_line)
+rb3_seqio_t *rb3_seq_open2(const char *fn, int is_line, int n_threads)
 {
 	rb3_seqio_t *fp;
-	gzFile f;
-	f = fn && strcmp(fn, "-")? gzopen(fn, "r") : gzdopen(0, "r");
+	zfile_t *f;
+	f = zf_open(fn, n_threads);
 	if (f == 0) return 0;
 	fp = RB3_CALLOC(rb3_seqio_t, 1);
 	fp->fp = f;
@@ -71,34 +468,62 @@ rb3_seqio_t *rb3_seq_open(const char *fn, int is_line)
 	return fp;
 }
 
+rb3_seqio_t *rb3_seq_open(const char *fn, int is_line)
+{
+	return rb3_seq_open2(fn, is_line, 1);
+}
+
+rb3_seqio_t *rb3_seq_open_mmap(const char *fn, int is_line, int n_threads)
+{
+	rb3_seqio_t *fp;
+	mfile_t *mf;
+	mf = mf_open(fn);
+	if (mf == 0) return rb3_seq_open2(fn, is_line, n_threads);
+	fp = RB3_CALLOC(rb3_seqio_t, 1);
+	fp->mf = mf;
+	fp->is_line = !!is_line;
+	return fp;
+}
+
+int rb3_seq_is_mmap(const rb3_seqio_t *fp)
+{
+	return fp->mf != 0;
+}
+
+void rb3_seq_release(rb3_seqio_t *fp, const char *end)
+{
+	if (fp->mf) mf_release(fp->mf, (const uint8_t*)end);
+}
+
 void rb3_seq_close(rb3_seqio_t *fp)
 {
 	if (fp == 0) return;
 	free(fp->line_buf.s);
-	if (fp->is_line) ks_destroy(fp->fl);
+	if (fp->mf) mf_close(fp->mf);
+	else if (fp->is_line) ks_destroy(fp->fl);
 	else kseq_destroy(fp->fx);
-	gzclose(fp->fp);
+	zf_close(fp->fp);
 	free(fp);
 }
 
-static int64_t rb3_seq_add(kstring_t *seq, int is_for, int is_rev, int64_t l, char *s)
-{
-	int64_t n_added = 0;
-	rb3_char2nt6(l, (uint8_t*)s);
-	if (is_for) {
-		RB3_GROW(char, seq->s, seq->l + l + 1, seq->m);
-		memcpy(&seq->s[seq->l], s, l + 1); // this includes the trailing NULL
-		seq->l += l + 1;
-		++n_added;
-	}
+static int64_t rb3_seq_add(kstring_t *seq, int is_for, int is_rev, int64_t l, const char *s)
+{ // encode and append the forward strand and/or the reverse complement
+	uint8_t *p;
+	RB3_GROW(char, seq->s, seq->l + (l + 1) * (!!is_for + !!is_rev), seq->m);
+	p = (uint8_t*)seq->s + seq->l;
+	rb3_nt6_copy(l, (const uint8_t*)s, p);
+	p[l] = 0;
 	if (is_rev) {
-		rb3_revcomp6(l, (uint8_t*)s);
-		RB3_GROW(char, seq->s, seq->l + l + 1, seq->m);
-		memcpy(&seq->s[seq->l], s, l + 1);
-		seq->l += l + 1;
-		++n_added;
+		if (is_for) rb3_revcomp6_copy(l, p, p + l + 1), p[2 * l + 1] = 0;
+		else rb3_reverse1(l, p, 1);
 	}
-	return n_added;
+	seq->l += (l + 1) * (!!is_for + !!is_rev);
+	return !!is_for + !!is_rev;
+}
+
+int rb3_seq_error(const rb3_seqio_t *fp)
+{
+	return fp->fp && fp->fp->err != 0;
 }
 
 int64_t rb3_seq_read(rb3_seqio_t *fp, kstring_t *seq, int64_t max_len, int is_for, int is_rev)
@@ -107,7 +532,16 @@ int64_t rb3_seq_read(rb3_seqio_t *fp, kstring_t *seq, int64_t max_len, int is_fo
 	int32_t ret;
 	assert(is_for || is_rev);
 	seq->l = 0;
-	if (fp->is_line) {
+	if (fp->mf) {
+		int64_t l;
+		char *s, *name;
+		while ((l = fp->is_line? mf_read_line(fp->mf, &s) : mf_read_fx(fp->mf, &s, &name)) >= 0) {
+			n_seq += rb3_seq_add(seq, is_for, is_rev, l, s);
+			if (max_len > 0 && seq->l > max_len) break;
+		}
+		if (l < -1 && rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: FASTX parsing error (code %ld)\n", (long)l);
+	} else if (fp->is_line) {
 		int dret;
 		while ((ret = ks_getuntil(fp->fl, KS_SEP_LINE, &fp->line_buf, &dret)) >= 0) {
 			n_seq += rb3_seq_add(seq, is_for, is_rev, fp->line_buf.l, fp->line_buf.s);
@@ -129,7 +563,15 @@ char *rb3_seq_read1(rb3_seqio_t *fp, int64_t *len, const char **name)
 	int ret, dret;
 	char *s = 0;
 	*len = 0;
-	if (fp->is_line) {
+	if (fp->mf) {
+		int64_t l;
+		char *nm = 0;
+		l = fp->is_line? mf_read_line(fp->mf, &s) : mf_read_fx(fp->mf, &s, &nm);
+		if (name) *name = nm;
+		if (l < 0) return 0;
+		*len = l;
+		return s;
+	} else if (fp->is_line) {
 		ret = ks_getuntil(fp->fl, KS_SEP_LINE, &fp->line_buf, &dret);
 		*len = fp->line_buf.l;
 		s = fp->line_buf.s;
@@ -145,12 +587,12 @@ char *rb3_seq_read1(rb3_seqio_t *fp, int64_t *len, const char **name)
 
 void rb3_reverse_all(int64_t len, uint8_t *seq)
 {
-	int64_t i, j;
-	for (i = j = 0; j < len; ++j) {
-		if (seq[j] == 0) {
-			if (j > i) rb3_reverse(j - i, &seq[i]);
-			i = j + 1;
-		}
+	int64_t i = 0;
+	while (i < len) {
+		uint8_t *q = (uint8_t*)memchr(seq + i, 0, len - i);
+		int64_t j = q? q - seq : len;
+		if (j > i) rb3_reverse(j - i, &seq[i]);
+		i = j + 1;
 	}
 }
 
@@ -161,13 +603,13 @@ void rb3_reverse_all(int64_t len, uint8_t *seq)
 rb3_sid_t *rb3_sid_read(const char *fn)
 {
 	rb3_sid_t *sl;
-	gzFile fp;
+	zfile_t *fp;
 	kstream_t *ks;
 	int32_t l, dret;
 	int64_t m_seq = 0;
 	kstring_t str = {0,0,0};
 
-	fp = fn && strcmp(fn, "-")? gzopen(fn, "r") : gzdopen(0, "r");
+	fp = zf_open(fn, 1);
 	if (fp == 0) return 0;
 	ks = ks_init(fp);
 	sl = RB3_CALLOC(rb3_sid_t, 1);
@@ -199,7 +641,7 @@ rb3_sid_t *rb3_sid_read(const char *fn)
 	}
 	free(str.s);
 	ks_destroy(ks);
-	gzclose(fp);
+	zf_close(fp);
 	return sl;
 }
 
@@ -21,7 +21,12 @@ typedef struct rb3_seqio_s rb3_seqio_t;
 extern const uint8_t rb3_nt6_table[128];
 
 rb3_seqio_t *rb3_seq_open(const char *fn, int is_line);
+rb3_seqio_t *rb3_seq_open2(const char *fn, int is_line, int n_threads); // inflate BGZF blocks with $n_threads
+rb3_seqio_t *rb3_seq_open_mmap(const char *fn, int is_line, int n_threads); // parse uncompressed files in place; fall back to rb3_seq_open2()
+int rb3_seq_is_mmap(const rb3_seqio_t *fp); // if true, rb3_seq_read1() returns writable spans valid until rb3_seq_close()
+void rb3_seq_release(rb3_seqio_t *fp, const char *end); // discard mapped pages before $end
 void rb3_seq_close(rb3_seqio_t *fp);
+int rb3_seq_error(const rb3_seqio_t *fp); // if true, reading stopped early at a read or decompression error
 int64_t rb3_seq_read(rb3_seqio_t *fp, kstring_t *seq, int64_t max_len, int is_for, int is_rev);
 char *rb3_seq_read1(rb3_seqio_t *fp, int64_t *len, const char **name);
 
@@ -125,6 +125,27 @@ void kfree(void *_km, void *ap) /* kfree() also adds a new core to the circular
 	} else km->loop_head = p, q->ptr = p; /* in two cores, cannot be merged; create a new block in the list */
 }
 
+void km_reset(void *_km, size_t max_cap) /* free all blocks but keep cores up to $max_cap bytes (0 for all) */
+{
+	kmem_t *km = (kmem_t*)_km;
+	header_t *p, **q;
+	size_t cap = 0;
+	if (km == NULL) return;
+	for (q = &km->core_head; *q != NULL;) {
+		size_t size = (*q)->size * sizeof(header_t);
+		if (max_cap > 0 && cap + size > max_cap) {
+			p = *q, *q = p->ptr;
+			kfree(km->par, p);
+		} else cap += size, q = &(*q)->ptr;
+	}
+	km->base.size = 0, km->loop_head = km->base.ptr = &km->base; /* rebuild the free list from the remaining cores */
+	for (p = km->core_head; p != NULL; p = p->ptr) {
+		size_t *r = (size_t*)(p + 1);
+		*r = p->size - 1;
+		kfree(km, r + 1);
+	}
+}
+
 void *kmalloc(void *_km, size_t n_bytes)
 {
 	kmem_t *km = (kmem_t*)_km;
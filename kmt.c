@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "rb3priv.h"
+#include "fm-index.h"
+#include "kthread.h"
+#include "ketopt.h"
+
+#define KMT_SEED_LEN 4 // kt_for() over all 4**KMT_SEED_LEN suffixes
+
+/********************
+ * kmt construction *
+ ********************/
+
+static void kmt_gen_dfs(const rb3_fmi_t *f, rb3_kmt_t *t, const rb3_sai_t *ik, int32_t d, uint64_t x)
+{ // $x encodes the current d-long string with the first base at the highest bits; prepend bases until reaching k
+	rb3_sai_t ok[RB3_ASIZE];
+	int c;
+	if (d == t->k) {
+		t->a[x<<1] = ik->x[0], t->a[x<<1|1] = ik->size;
+		return;
+	}
+	if (ik->size == 0) return; // all longer k-mers are absent; t->a[] is zero-initialized
+	rb3_fmd_extend(f, ik, ok, 1);
+	for (c = 1; c <= 4; ++c)
+		kmt_gen_dfs(f, t, &ok[c], d + 1, (uint64_t)(c - 1) << 2*d | x);
+}
+
+typedef struct {
+	const rb3_fmi_t *f;
+	rb3_kmt_t *t;
+	int32_t s;
+} kmt_aux_t;
+
+static void worker_kmt(void *data, long i, int tid)
+{
+	kmt_aux_t *a = (kmt_aux_t*)data;
+	rb3_sai_t ik, ok[RB3_ASIZE];
+	int32_t j;
+	rb3_fmd_set_intv(a->f, (i & 3) + 1, &ik);
+	for (j = 1; j < a->s && ik.size > 0; ++j) {
+		rb3_fmd_extend(a->f, &ik, ok, 1);
+		ik = ok[(i >> 2*j & 3) + 1];
+	}
+	if (ik.size > 0) kmt_gen_dfs(a->f, a->t, &ik, a->s, i);
+}
+
+rb3_kmt_t *rb3_kmt_gen(const rb3_fmi_t *f, int k, int n_threads)
+{
+	rb3_kmt_t *t;
+	kmt_aux_t a;
+	if (k < 1 || k > RB3_KMT_MAX_K) return 0;
+	t = RB3_CALLOC(rb3_kmt_t, 1);
+	t->k = k, t->n_kmer = 1LL << 2*k, t->tot = f->acc[RB3_ASIZE];
+	t->a = RB3_CALLOC(uint64_t, t->n_kmer * 2);
+	a.f = f, a.t = t, a.s = k < KMT_SEED_LEN? k : KMT_SEED_LEN;
+	kt_for(n_threads, worker_kmt, &a, 1L << 2*a.s);
+	return t;
+}
+
+void rb3_kmt_destroy(rb3_kmt_t *t)
+{
+	if (t == 0) return;
+	free(t->a); free(t);
+}
+
+/**********
+ * Lookup *
+ **********/
+
+int rb3_kmt_get(const rb3_kmt_t *t, const uint8_t *q, rb3_sai_t *ik)
+{ // bi-interval of q[0..k-1] in nt6; return -1 if q contains a non-ACGT base
+	int32_t i, shift = 2 * (t->k - 1);
+	uint64_t x = 0, y = 0; // y encodes the reverse complement
+	for (i = 0; i < t->k; ++i) {
+		int c = (int)q[i] - 1;
+		if (c < 0 || c > 3) return -1;
+		x = x<<2 | c;
+		y = y>>2 | (uint64_t)(3 - c) << shift;
+	}
+	ik->x[0] = t->a[x<<1], ik->size = t->a[x<<1|1];
+	ik->x[1] = t->a[y<<1], ik->info = 0;
+	return 0;
+}
+
+/***********
+ * kmt I/O *
+ ***********/
+
+int rb3_kmt_dump(const rb3_kmt_t *t, const char *fn)
+{
+	uint32_t y = t->k;
+	int ret = 0;
+	FILE *fp;
+	fp = fn && strcmp(fn, "-")? fopen(fn, "wb") : fdopen(1, "wb");
+	if (fp == 0) return -1;
+	if (fwrite("KMT\1", 1, 4, fp) != 4 || fwrite(&y, 4, 1, fp) != 1 || fwrite(&t->tot, 8, 1, fp) != 1
+		|| fwrite(t->a, 8, t->n_kmer * 2, fp) != (size_t)t->n_kmer * 2) // disk full or I/O error
+		ret = -1;
+	if (fclose(fp) != 0) ret = -1; // buffered data may fail to be written here
+	return ret;
+}
+
+rb3_kmt_t *rb3_kmt_restore(const char *fn)
+{
+	FILE *fp;
+	uint32_t y;
+	char magic[4];
+	rb3_kmt_t *t;
+
+	fp = fn && strcmp(fn, "-")? fopen(fn, "rb") : fdopen(0, "rb");
+	if (fp == 0) return 0;
+	if (fread(magic, 1, 4, fp) != 4 || strncmp(magic, "KMT\1", 4) != 0 || fread(&y, 4, 1, fp) != 1 || y < 1 || y > RB3_KMT_MAX_K) { // wrong magic or k
+		fclose(fp);
+		return 0;
+	}
+	t = RB3_CALLOC(rb3_kmt_t, 1);
+	t->k = y, t->n_kmer = 1LL << 2*t->k;
+	t->a = RB3_MALLOC(uint64_t, t->n_kmer * 2);
+	if (t->a == 0 || fread(&t->tot, 8, 1, fp) != 1 || fread(t->a, 8, t->n_kmer * 2, fp) != (size_t)t->n_kmer * 2) { // truncated file
+		rb3_kmt_destroy(t);
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	return t;
+}
+
+/*******************
+ * main() function *
+ *******************/
+
+int main_kmt(int argc, char *argv[])
+{
+	int c, n_threads = 4, k = 12, ret = 0;
+	rb3_kmt_t *t;
+	rb3_fmi_t f;
+	char *fn = 0;
+	ketopt_t o = KETOPT_INIT;
+
+	while ((c = ketopt(&o, argc, argv, 1, "t:k:o:", 0)) >= 0) {
+		if (c == 't') n_threads = atoi(o.arg);
+		else if (c == 'k') k = atoi(o.arg);
+		else if (c == 'o') fn = o.arg;
+	}
+	if (argc == o.ind) {
+		fprintf(stderr, "Usage: ropebwt3 kmt [options] <in.fmd>\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  -k INT     k-mer length, up to %d [%d]\n", RB3_KMT_MAX_K, k);
+		fprintf(stderr, "  -t INT     number of threads [%d]\n", n_threads);
+		fprintf(stderr, "  -o FILE    output to file [stdout]\n");
+		return 1;
+	}
+	if (k < 1 || k > RB3_KMT_MAX_K) {
+		fprintf(stderr, "[E::%s] k-mer length must be between 1 and %d\n", __func__, RB3_KMT_MAX_K);
+		return 1;
+	}
+	rb3_fmi_restore(&f, argv[o.ind], 0);
+	if (f.e == 0 && f.r == 0) {
+		fprintf(stderr, "[E::%s] failed to load the FM-index\n", __func__);
+		return 1;
+	}
+	if (!rb3_fmi_is_symmetric(&f)) {
+		fprintf(stderr, "[E::%s] BWT doesn't contain both strands\n", __func__);
+		rb3_fmi_free(&f);
+		return 1;
+	}
+	t = rb3_kmt_gen(&f, k, n_threads);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] generated the table for %ld %d-mers\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)t->n_kmer, k);
+
+	if (rb3_kmt_dump(t, fn) < 0) {
+		fprintf(stderr, "[E::%s] failed to write the k-mer table\n", __func__);
+		ret = 1;
+	}
+	rb3_fmi_free(&f);
+	rb3_kmt_destroy(t);
+	return ret;
+}
@@ -3,6 +3,7 @@
 #include "rb3priv.h"
 #include "fm-index.h"
 #include "io.h"
+#include "kthread.h"
 #include "ketopt.h"
 
 #define RB3_VERSION "3.10-r281"
@@ -12,6 +13,9 @@ int main_merge(int argc, char *argv[]);
 int main_get(int argc, char *argv[]);
 int main_ssa(int argc, char *argv[]);
 int main_suffix(int argc, char *argv[]);
+int main_kmt(int argc, char *argv[]);
+int main_phi(int argc, char *argv[]);
+int main_shm(int argc, char *argv[]);
 int main_search(int argc, char *argv[]);
 int main_kount(int argc, char *argv[]);
 int main_fa2line(int argc, char *argv[]);
@@ -33,7 +37,10 @@ static int usage(FILE *fp)
 	fprintf(fp, "    merge      merge BWTs\n");
 	fprintf(fp, "    plain2fmd  convert BWT in plain text to FMD\n");
 	fprintf(fp, "    ssa        generate sampled suffix array\n");
+	fprintf(fp, "    kmt        generate k-mer interval table\n");
+	fprintf(fp, "    phi        generate r-index phi samples (replacing ssa)\n");
 	fprintf(fp, "  Miscellaneous:\n");
+	fprintf(fp, "    shm        put the index to shared memory\n");
 	fprintf(fp, "    get        retrieve the i-th sequence from BWT\n");
 	fprintf(fp, "    stat       basic statistics of BWT\n");
 	fprintf(fp, "    kount      count (high-occurrence) k-mers\n");
@@ -55,6 +62,9 @@ int main(int argc, char *argv[])
 	else if (strcmp(argv[1], "build") == 0) ret = main_build(argc-1, argv+1);
 	else if (strcmp(argv[1], "merge") == 0) ret = main_merge(argc-1, argv+1);
 	else if (strcmp(argv[1], "ssa") == 0) ret = main_ssa(argc-1, argv+1);
+	else if (strcmp(argv[1], "kmt") == 0) ret = main_kmt(argc-1, argv+1);
+	else if (strcmp(argv[1], "phi") == 0) ret = main_phi(argc-1, argv+1);
+	else if (strcmp(argv[1], "shm") == 0) ret = main_shm(argc-1, argv+1);
 	else if (strcmp(argv[1], "stat") == 0) ret = main_stat(argc-1, argv+1);
 	else if (strcmp(argv[1], "suffix") == 0) ret = main_suffix(argc-1, argv+1);
 	else if (strcmp(argv[1], "get") == 0) ret = main_get(argc-1, argv+1);
@@ -78,70 +88,149 @@ int main(int argc, char *argv[])
 			fprintf(stderr, " %s", argv[i]);
 		fprintf(stderr, "\n[M::%s] Real time: %.3f sec; CPU: %.3f sec; Peak RSS: %.3f GB\n", __func__, rb3_realtime(), rb3_cputime(), rb3_peakrss() / 1024.0 / 1024.0 / 1024.0);
 	}
+	return ret;
+}
+
+typedef struct {
+	int32_t n_threads, use_mvt, to_fmd;
+	int32_t n_fn, i;
+	char **fn;
+	const char *fn_tmp;
+	mrope_t *r;
+	rb3_fmi_t fa; // the current index if $to_fmd is set
+} mg_pipeline_t;
+
+static void mg_fmr2fmd(rb3_fmi_t *f, int n_threads)
+{
+	if (f->is_fmd) return;
+	rb3_fmi_init(f, rb3_enc_fmr2fmd(f->r, 0, n_threads, 1), 0);
+}
+
+static void *worker_merge(void *shared, int step, void *in)
+{ // step 0 loads the next index while step 1 merges the previous one
+	mg_pipeline_t *p = (mg_pipeline_t*)shared;
+	rb3_fmi_t *fb = (rb3_fmi_t*)in;
+	if (step == 0) {
+		if (p->i == p->n_fn) return 0;
+		fb = RB3_CALLOC(rb3_fmi_t, 1);
+		rb3_fmi_restore(fb, p->fn[p->i], 0);
+		if (fb->e == 0 && fb->r == 0) {
+			if (rb3_verbose >= 1)
+				fprintf(stderr, "ERROR: failed to load FMR/FMD file '%s'\n", p->fn[p->i]);
+			free(fb);
+			p->i = p->n_fn;
+			return 0;
+		}
+		if (p->to_fmd) mg_fmr2fmd(fb, p->n_threads);
+		if (p->use_mvt) rb3_fmi_to_mvt(fb);
+		if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] loaded index '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), p->fn[p->i]);
+		p->i++;
+		return fb;
+	} else if (step == 1) {
+		if (p->to_fmd) {
+			rld_t *e;
+			e = rb3_fmi_merge_fmd(&p->fa, fb, p->n_threads, 1);
+			rb3_fmi_free(&p->fa);
+			rb3_fmi_init(&p->fa, e, 0);
+		} else rb3_fmi_merge(p->r, fb, p->n_threads, 1);
+		free(fb);
+		if (p->fn_tmp) {
+			if (p->to_fmd) {
+				rld_dump(p->fa.e, p->fn_tmp);
+			} else {
+				FILE *fp;
+				fp = fopen(p->fn_tmp, "w");
+				if (fp != 0) mr_dump(p->r, fp);
+				fclose(fp);
+			}
+			if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] saved the current index to '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), p->fn_tmp);
+		}
+	}
 	return 0;
 }
 
 int main_merge(int argc, char *argv[])
 {
-	int32_t c, i, n_threads = 1;
+	int32_t c, n_threads = 1, use_mvt = 0, to_fmd = 0;
 	ketopt_t o = KETOPT_INIT;
 	rb3_fmi_t fmi;
-	mrope_t *r;
-	char *fn_tmp = 0;
+	mrope_t *r = 0;
+	char *fn_tmp = 0, *prefix = 0;
+	mg_pipeline_t p;
 
-	while ((c = ketopt(&o, argc, argv, 1, "t:o:S:", 0)) >= 0) {
+	while ((c = ketopt(&o, argc, argv, 1, "t:o:S:M:vd", 0)) >= 0) {
 		if (c == 't') n_threads = atoi(o.arg);
+		else if (c == 'd') to_fmd = 1;
+		else if (c == 'v') use_mvt = 1;
 		else if (c == 'o') freopen(o.arg, "wb", stdout);
 		else if (c == 'S') fn_tmp = o.arg;
+		else if (c == 'M') prefix = o.arg;
 	}
 	if (argc - o.ind < 2) {
 		fprintf(stdout, "Usage: ropebwt3 merge [options] <base.fmr> <other1.fmr> [...]\n");
 		fprintf(stdout, "Options:\n");
 		fprintf(stdout, "  -t INT     number of threads [%d]\n", n_threads);
 		fprintf(stdout, "  -o FILE    output FMR to FILE [stdout]\n");
+		fprintf(stdout, "  -d         output FMD by streaming merge without building FMR\n");
+		fprintf(stdout, "  -M STR     with -d and >2 inputs, merge in a balanced tree via STR.*.fmd [first input]\n");
 		fprintf(stderr, "  -S FILE    save the current index to FILE after each input file []\n");
+		fprintf(stderr, "  -v         use the move table for LF-mapping on the other BWTs\n");
 		return 1;
 	}
 
+	if (to_fmd && argc - o.ind > 2) { // sequential merging takes O(k*N) time for k inputs, but a balanced tree takes O(N*log(k))
+		rld_t *e;
+		char **fn; // rb3_fmi_merge_tree() overwrites the array with temporary file names
+		if (fn_tmp && rb3_verbose >= 2)
+			fprintf(stderr, "[W::%s] option -S has no effect when more than two indices are merged with -d\n", __func__);
+		fn = RB3_MALLOC(char*, argc - o.ind);
+		memcpy(fn, &argv[o.ind], (argc - o.ind) * sizeof(char*));
+		e = rb3_fmi_merge_tree(prefix? prefix : argv[o.ind], argc - o.ind, fn, argc - o.ind, 0, use_mvt, n_threads);
+		free(fn);
+		if (e == 0) return 1;
+		rld_dump(e, "-");
+		rld_destroy(e);
+		return 0;
+	}
+
 	rb3_fmi_restore(&fmi, argv[o.ind], 0);
-	r = fmi.is_fmd? rb3_enc_fmd2fmr(fmi.e, 0, 0, 1) : fmi.r;
-	if (r == 0) {
+	if (fmi.e == 0 && fmi.r == 0) {
 		if (rb3_verbose >= 1)
 			fprintf(stderr, "ERROR: failed to load FMR file '%s'\n", argv[o.ind]);
 		return 1;
 	}
-	for (i = o.ind + 1; i < argc; ++i) {
-		rb3_fmi_t fb;
-		rb3_fmi_restore(&fb, argv[i], 0);
-		if (fb.e == 0 && fb.r == 0) {
-			if (rb3_verbose >= 1)
-				fprintf(stderr, "ERROR: failed to load FMR/FMD file '%s'\n", argv[i]);
-			break;
-		}
-		rb3_fmi_merge(r, &fb, n_threads, 1);
-		if (fn_tmp) {
-			FILE *fp;
-			fp = fopen(fn_tmp, "w");
-			if (fp != 0) mr_dump(r, fp);
-			fclose(fp);
-			if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] saved the current index to '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), fn_tmp);
-		}
+	memset(&p, 0, sizeof(mg_pipeline_t));
+	if (to_fmd) {
+		mg_fmr2fmd(&fmi, n_threads);
+		p.fa = fmi;
+	} else r = fmi.is_fmd? rb3_enc_fmd2fmr(fmi.e, 0, 0, n_threads, 1) : fmi.r;
+	p.n_threads = n_threads, p.use_mvt = use_mvt, p.to_fmd = to_fmd, p.fn_tmp = fn_tmp, p.r = r;
+	p.n_fn = argc - o.ind - 1, p.fn = &argv[o.ind + 1];
+	kt_pipeline(2, worker_merge, &p, 2); // load the next index while merging the current one
+	if (to_fmd) {
+		rld_dump(p.fa.e, "-");
+		rb3_fmi_free(&p.fa);
+	} else {
+		mr_dump(r, stdout);
+		mr_destroy(r);
 	}
-	mr_dump(r, stdout);
-	mr_destroy(r);
 	return 0;
 }
 
 int main_get(int argc, char *argv[])
 {
-	int32_t c, i;
+	int32_t c, i, use_mvt = 0;
 	ketopt_t o = KETOPT_INIT;
 	rb3_fmi_t fmi;
 	kstring_t s = {0,0,0};
 
-	while ((c = ketopt(&o, argc, argv, 1, "", 0)) >= 0) { }
+	while ((c = ketopt(&o, argc, argv, 1, "v", 0)) >= 0) {
+		if (c == 'v') use_mvt = 1;
+	}
 	if (argc - o.ind < 2) {
-		fprintf(stdout, "Usage: ropebwt3 get <idx.fmr> <int> [...]\n");
+		fprintf(stdout, "Usage: ropebwt3 get [options] <idx.fmr> <int> [...]\n");
+		fprintf(stdout, "Options:\n");
+		fprintf(stdout, "  -v        use the move table for LF-mapping\n");
 		return 0;
 	}
 	rb3_fmi_restore(&fmi, argv[o.ind], 0);
@@ -150,6 +239,7 @@ int main_get(int argc, char *argv[])
 			fprintf(stderr, "ERROR: failed to load index file '%s'\n", argv[o.ind]);
 		return 1;
 	}
+	if (use_mvt) rb3_fmi_to_mvt(&fmi);
 	for (i = o.ind + 1; i < argc; ++i) {
 		int64_t k, r;
 		k = atol(argv[i]);
@@ -181,22 +271,28 @@ int main_suffix(int argc, char *argv[])
 		fprintf(stderr, "  -L        one sequence per line in the input\n");
 		return 0;
 	}
-	rb3_fmi_restore(&fmi, argv[o.ind], 0);
-	if (fmi.e == 0 && fmi.r == 0) {
-		if (rb3_verbose >= 1)
-			fprintf(stderr, "ERROR: failed to load index file '%s'\n", argv[o.ind]);
-		return 1;
-	}
+	if (rb3_fmi_load_all(&fmi, argv[o.ind], RB3_LOAD_KMT, 1) < 0) return 1;
 	for (j = o.ind + 1; j < argc; ++j) {
 		const char *s, *name;
-		int64_t i, len;
+		int64_t i, i0, len;
 		rb3_seqio_t *fp;
 		fp = rb3_seq_open(argv[j], is_line);
 		while ((s = rb3_seq_read1(fp, &len, &name)) != 0) {
 			int64_t k = 0, l = fmi.acc[RB3_ASIZE], last_size = 0;
 			++rec_num;
 			out.l = 0;
-			for (i = len - 1; i >= 0; --i) {
+			i0 = len - 1;
+			if (fmi.kmt && len >= fmi.kmt->k) { // jump over the last k bases with the k-mer table
+				uint8_t km[RB3_KMT_MAX_K];
+				rb3_sai_t ik;
+				for (i = 0; i < fmi.kmt->k; ++i) {
+					int c = s[len - fmi.kmt->k + i];
+					km[i] = c < 128 && c >= 0? rb3_nt6_table[c] : 5;
+				}
+				if (rb3_kmt_get(fmi.kmt, km, &ik) == 0 && ik.size > 0)
+					k = ik.x[0], l = ik.x[0] + ik.size, last_size = ik.size, i0 = len - fmi.kmt->k - 1;
+			}
+			for (i = i0; i >= 0; --i) {
 				int c = s[i];
 				int64_t size;
 				c = c < 128 && c >= 0? rb3_nt6_table[c] : 5;
@@ -7,6 +7,9 @@
 #include <time.h>
 #include "mrope.h"
 #include "rle.h"
+#include "kthread.h"
+
+#define mr_ctx_next(mr, b, c) ((c) * ((mr)->n_r / 6) + (b) / 6) // rope of suffix $c followed by a suffix in rope $b
 
 /*******************************
  *** Single-string insertion ***
@@ -20,19 +23,30 @@ mrope_t *mr_init(int max_nodes, int block_len, int sorting_order)
 	r = (mrope_t*)calloc(1, sizeof(mrope_t));
 	r->so = sorting_order;
 	r->thr_min = 1000;
+	r->ctx = 1, r->n_r = 6;
 	for (a = 0; a != 6; ++a)
 		r->r[a] = rope_init(max_nodes, block_len);
+	mr_update_cnt(r);
 	return r;
 }
 
 void mr_destroy(mrope_t *r)
 {
 	int a;
-	for (a = 0; a != 6; ++a)
+	for (a = 0; a != r->n_r; ++a)
 		if (r->r[a]) rope_destroy(r->r[a]);
 	free(r);
 }
 
+int64_t mr_mem(const mrope_t *r)
+{
+	int a;
+	int64_t m = sizeof(mrope_t);
+	for (a = 0; a != r->n_r; ++a)
+		if (r->r[a]) m += rope_mem(r->r[a]);
+	return m;
+}
+
 int mr_thr_min(mrope_t *r, int thr_min)
 {
 	if (thr_min > 0)
@@ -40,14 +54,36 @@ int mr_thr_min(mrope_t *r, int thr_min)
 	return r->thr_min;
 }
 
+void mr_update_cnt(mrope_t *r)
+{
+	int a, c;
+	memset(r->cnt[0], 0, 48);
+	for (a = 0, r->off[0] = 0; a < r->n_r; ++a) {
+		const int64_t *ca = r->r[a]->c;
+		for (c = 0; c < 6; ++c) r->cnt[a+1][c] = r->cnt[a][c] + ca[c];
+		r->off[a+1] = r->off[a] + ca[0] + ca[1] + ca[2] + ca[3] + ca[4] + ca[5];
+	}
+}
+
+static inline int mr_locate(const mrope_t *mr, int64_t x) // the rope containing $x, or n_r if x>=mr_get_tot(mr)
+{
+	int lo = 0, hi = mr->n_r;
+	while (lo < hi) { // find the first rope $a with off[a+1]>x; this skips empty ropes
+		int mid = (lo + hi) >> 1;
+		if (mr->off[mid+1] > x) hi = mid;
+		else lo = mid + 1;
+	}
+	return lo;
+}
+
 int64_t mr_insert1(mrope_t *r, const uint8_t *str)
 {
-	int64_t tl[6], tu[6], l, u;
+	int64_t tl[6], tu[6], l, u, ret;
 	const uint8_t *p;
-	int b, is_srt = (r->so != MR_SO_IO), is_comp = (r->so == MR_SO_RCLO);
-	for (u = 0, b = 0; b != 6; ++b) u += r->r[b]->c[0];
+	int b, j, is_srt = (r->so != MR_SO_IO), is_comp = (r->so == MR_SO_RCLO);
+	for (u = 0, b = 0; b != r->n_r; ++b) u += r->r[b]->c[0];
 	l = is_srt? 0 : u;
-	for (p = str, b = 0; *p; b = *p++) {
+	for (p = str, b = 0; *p; b = mr_ctx_next(r, b, *p), ++p) {
 		int a;
 		if (l != u) {
 			int64_t cnt = 0;
@@ -57,66 +93,49 @@ int64_t mr_insert1(mrope_t *r, const uint8_t *str)
 				l += tu[0] - tl[0];
 			} else for (a = 0; a < *p; ++a) l += tu[a] - tl[a];
 			rope_insert_run(r->r[b], l, *p, 1, 0);
-			while (--b >= 0) cnt += r->r[b]->c[*p];
+			for (j = b - b % 6; j < b; ++j) cnt += r->r[j]->c[*p]; // ropes sharing the context except the last symbol
 			l = cnt + tl[*p]; u = cnt + tu[*p];
 		} else {
 			l = rope_insert_run(r->r[b], l, *p, 1, 0);
-			while (--b >= 0) l += r->r[b]->c[*p];
+			for (j = b - b % 6; j < b; ++j) l += r->r[j]->c[*p];
 			u = l;
 		}
 	}
-	return rope_insert_run(r->r[b], l, 0, 1, 0);
+	ret = rope_insert_run(r->r[b], l, 0, 1, 0);
+	mr_update_cnt(r);
+	return ret;
 }
 
 int mr_rank2a(const mrope_t *mr, int64_t x, int64_t y, int64_t *cx, int64_t *cy)
 {
-	int a, b, ret = -1;
-	int64_t z, c[6], l;
+	int a, b, ret;
 	if (cy == 0) y = -1;
-	memset(c, 0, 48);
-	for (a = 0, z = l = 0; a < 6 && z < x; ++a) {
-		const int64_t *ca = mr->r[a]->c;
-		l = ca[0] + ca[1] + ca[2] + ca[3] + ca[4] + ca[5];
-		if (z + l > x) break;
-		for (b = 0; b < 6; ++b) c[b] += ca[b];
-		z += l;
-	}
-	for (; a < 6; ++a) { // skip 0-sized ropes
-		const int64_t *ca = mr->r[a]->c;
-		l = ca[0] + ca[1] + ca[2] + ca[3] + ca[4] + ca[5];
-		if (l != 0) break;
-	}
-	if (a == 6) { // special case: x >= mr_get_tot(mr)
-		memcpy(cx, c, 48);
-		if (y >= x) memcpy(cy, c, 48);
+	a = mr_locate(mr, x);
+	if (a == mr->n_r) { // special case: x >= mr_get_tot(mr)
+		memcpy(cx, mr->cnt[a], 48);
+		if (y >= x) memcpy(cy, mr->cnt[a], 48);
 		return -1;
 	}
-	if (y >= x && z + l >= y) { // x and y are in the same rope
-		ret = rope_rank2a(mr->r[a], x - z, y - z, cx, cy);
+	if (y >= x && mr->off[a+1] >= y) { // x and y are in the same rope
+		ret = rope_rank2a(mr->r[a], x - mr->off[a], y - mr->off[a], cx, cy);
 		for (b = 0; b < 6; ++b)
-			cx[b] += c[b], cy[b] += c[b];
+			cx[b] += mr->cnt[a][b], cy[b] += mr->cnt[a][b];
 		assert(ret >= 0);
 		return ret;
 	}
-	ret = rope_rank1a(mr->r[a], x - z, cx);
-	for (b = 0; b < 6; ++b)
-		cx[b] += c[b], c[b] += mr->r[a]->c[b];
+	ret = rope_rank1a(mr->r[a], x - mr->off[a], cx);
+	for (b = 0; b < 6; ++b) cx[b] += mr->cnt[a][b];
 	assert(ret >= 0);
 	if (y < x) return ret;
-	for (++a, z += l; a < 6; ++a) {
-		const int64_t *ca = mr->r[a]->c;
-		l = ca[0] + ca[1] + ca[2] + ca[3] + ca[4] + ca[5];
-		if (z + l > y) break;
-		for (b = 0; b < 6; ++b) c[b] += ca[b];
-		z += l;
-	}
-	if (a == 6) { // special case: y >= mr_get_tot(mr)
-		memcpy(cy, c, 48);
+	a = mr_locate(mr, y);
+	if (a == mr->n_r) { // special case: y >= mr_get_tot(mr)
+		memcpy(cy, mr->cnt[a], 48);
 		return ret;
 	}
-	if (y != z + l) rope_rank1a(mr->r[a], y - z, cy);
-	else for (b = 0; b < 6; ++b) cy[b] = mr->r[a]->c[b];
-	for (b = 0; b < 6; ++b) cy[b] += c[b];
+	if (y != mr->off[a]) {
+		rope_rank1a(mr->r[a], y - mr->off[a], cy);
+		for (b = 0; b < 6; ++b) cy[b] += mr->cnt[a][b];
+	} else memcpy(cy, mr->cnt[a], 48);
 	return ret;
 }
 
@@ -133,29 +152,151 @@ void mr_itr_first(mrope_t *r, mritr_t *i, int to_free)
 const uint8_t *mr_itr_next_block(mritr_t *i)
 {
 	const uint8_t *s;
-	if (i->a >= 6) return 0;
+	if (i->a >= i->r->n_r) return 0;
 	while ((s = rope_itr_next_block(&i->i)) == 0) {
 		if (i->to_free) {
 			rope_destroy(i->r->r[i->a]);
 			i->r->r[i->a] = 0;
 		}
-		if (++i->a == 6) return 0;
+		if (++i->a == i->r->n_r) return 0;
 		rope_itr_first(i->r->r[i->a], &i->i);
 	}
-	return i->a == 6? 0 : s;
+	return i->a == i->r->n_r? 0 : s;
+}
+
+/**************************
+ *** Context partitioning ***
+ **************************/
+
+int mr_ctx4threads(int n_threads)
+{
+	int ctx, n;
+	if (n_threads <= 6) return 1;
+	for (ctx = 2, n = 36; ctx < MR_MAX_CTX && n < n_threads * 4; ++ctx, n *= 6); // more ropes than threads for load balancing
+	return ctx;
+}
+
+typedef struct {
+	rpitr_t itr;
+	const uint8_t *q, *end; // the current block
+	int c;
+	int64_t l, rest; // length of the pending run; number of symbols left for the current rope
+} mr_runs_t;
+
+static int64_t mr_next_run(void *data, int *c)
+{
+	mr_runs_t *s = (mr_runs_t*)data;
+	int64_t l;
+	if (s->rest == 0) return 0;
+	while (s->l == 0) {
+		if (s->q == s->end) {
+			const uint8_t *block = rope_itr_next_block(&s->itr);
+			assert(block);
+			s->q = block + 2, s->end = s->q + *rle_nptr(block);
+		} else rle_dec1(s->q, s->c, s->l);
+	}
+	l = s->l < s->rest? s->l : s->rest;
+	s->l -= l, s->rest -= l;
+	*c = s->c;
+	return l;
+}
+
+typedef struct {
+	mrope_t *mr;
+	rope_t **r; // new ropes
+	const int64_t *size; // size of each new rope
+} mr_split_t;
+
+static void worker_split(void *data, long i, int tid)
+{
+	mr_split_t *a = (mr_split_t*)data;
+	rope_t *r = a->mr->r[i];
+	mr_runs_t s;
+	int x;
+	memset(&s, 0, sizeof(mr_runs_t));
+	rope_itr_first(r, &s.itr);
+	for (x = 0; x < 6; ++x) {
+		s.rest = a->size[i * 6 + x];
+		a->r[i * 6 + x] = rope_build_from_runs(r->max_nodes, r->block_len, ROPE_DEF_FILL, mr_next_run, &s);
+	}
+	rope_destroy(r);
+	a->mr->r[i] = 0;
+}
+
+int mr_split(mrope_t *mr, int ctx, int n_threads)
+{
+	if (ctx > MR_MAX_CTX) ctx = MR_MAX_CTX;
+	while (mr->ctx < ctx) { // extend the context by one symbol at a time
+		int i, x, m = mr->n_r / 6;
+		int64_t *size;
+		mr_split_t a;
+		size = (int64_t*)calloc(mr->n_r * 6, 8);
+		for (i = 0; i < mr->n_r; ++i) {
+			const int64_t *ci = mr->r[i]->c;
+			int c = i / m; // the first symbol of the context
+			if (c == 0) { // a sentinel is followed by padding
+				size[i * 6] = ci[0] + ci[1] + ci[2] + ci[3] + ci[4] + ci[5];
+			} else { // #suffixes starting with c_1...c_{ctx+1} equals #c_1 in the rope of c_2...c_{ctx+1}
+				for (x = 0; x < 6; ++x)
+					size[i * 6 + x] = mr->r[i % m * 6 + x]->c[c];
+			}
+		}
+		a.mr = mr, a.size = size;
+		a.r = (rope_t**)calloc(mr->n_r * 6, sizeof(rope_t*));
+		kt_for(n_threads, worker_split, &a, mr->n_r);
+		memcpy(mr->r, a.r, mr->n_r * 6 * sizeof(rope_t*));
+		mr->n_r *= 6, ++mr->ctx;
+		free(a.r); free(size);
+	}
+	mr_update_cnt(mr);
+	return mr->ctx;
 }
 
 /***********
  *** I/O ***
  ***********/
 
+typedef struct {
+	const mrope_t *mr;
+	int a, end; // the current rope and the end of ropes to concatenate
+	rpitr_t itr;
+	const uint8_t *q, *e; // the current block
+} mr_cat_t;
+
+static int64_t mr_cat_next_run(void *data, int *c)
+{
+	mr_cat_t *s = (mr_cat_t*)data;
+	int64_t l;
+	while (s->q == s->e) {
+		const uint8_t *block;
+		while ((block = rope_itr_next_block(&s->itr)) == 0) {
+			if (++s->a == s->end) return 0;
+			rope_itr_first(s->mr->r[s->a], &s->itr);
+		}
+		s->q = block + 2, s->e = s->q + *rle_nptr(block);
+	}
+	rle_dec1(s->q, *c, l);
+	return l;
+}
+
 void mr_dump(mrope_t *mr, FILE *fp)
 {
-	int i;
+	int i, m = mr->n_r / 6;
 	fwrite("RB\2", 1, 3, fp);
 	fwrite(&mr->so, 1, 1, fp);
-	for (i = 0; i < 6; ++i)
-		rope_dump(mr->r[i], fp);
+	for (i = 0; i < 6; ++i) {
+		if (m > 1) { // concatenate ropes partitioned by a longer context such that the layout doesn't depend on mr->ctx
+			const rope_t *r0 = mr->r[i * m];
+			rope_t *r;
+			mr_cat_t s;
+			memset(&s, 0, sizeof(mr_cat_t));
+			s.mr = mr, s.a = i * m, s.end = (i + 1) * m;
+			rope_itr_first(r0, &s.itr);
+			r = rope_build_from_runs(r0->max_nodes, r0->block_len, ROPE_DEF_FILL, mr_cat_next_run, &s);
+			rope_dump(r, fp);
+			rope_destroy(r);
+		} else rope_dump(mr->r[i], fp);
+	}
 }
 
 mrope_t *mr_restore(FILE *fp)
@@ -168,8 +309,10 @@ mrope_t *mr_restore(FILE *fp)
 	if (strncmp((char*)magic, "RB\2", 3) != 0) return 0;
 	mr = (mrope_t*)calloc(1, sizeof(mrope_t));
 	mr->so = magic[3];
-	for (i = 0; i < 6; ++i)
+	mr->ctx = 1, mr->n_r = 6;
+	for (i = 0; i < mr->n_r; ++i)
 		mr->r[i] = rope_restore(fp);
+	mr_update_cnt(mr);
 	mr_get_c(mr, c);
 	fprintf(stderr, "[M::%s] ($, A, C, G, T, N) = (%ld, %ld, %ld, %ld, %ld, %ld)\n", __func__,
 			(long)c[0], (long)c[1], (long)c[2], (long)c[3], (long)c[4], (long)c[5]);
@@ -187,7 +330,7 @@ mrope_t *mr_restore_file(const char *fn)
 void mr_print_tree(const mrope_t *mr, FILE *fp)
 {
 	int a;
-	for (a = 0; a < 6; ++a)
+	for (a = 0; a < mr->n_r; ++a)
 		rope_print_node(mr->r[a]->root, fp);
 	fputc('\n', fp);
 }
@@ -214,7 +357,7 @@ void mr_print_bwt(const mrope_t *mr, FILE *fp)
  *****************************************/
 
 typedef struct {
-	uint64_t l;
+	uint64_t l:56, b:8; // $b: the rope of the current suffix
 	uint64_t u:61, c:3;
 	const uint8_t *p;
 } triple64_t;
@@ -274,14 +417,27 @@ static void mr_insert_multi_aux(rope_t *rope, int64_t m, triple64_t *a, int is_c
 	}
 }
 
+typedef struct {
+	mrope_t *mr;
+	int is_comp;
+	volatile int next; // the next rope to work on
+	int64_t *c; // number of strings to insert to each rope
+	triple64_t **q; // strings to insert to each rope
+} mr_column_t;
+
+static void mr_insert_column(mr_column_t *col)
+{
+	int b, n_r = col->mr->n_r;
+	while ((b = __sync_fetch_and_add(&col->next, 1)) < n_r)
+		if (col->c[b])
+			mr_insert_multi_aux(col->mr->r[b], col->c[b], col->q[b], col->is_comp);
+}
+
 typedef struct {
 	volatile int *n_fin_workers;
 	volatile int to_run;
 	int to_exit;
-	mrope_t *mr;
-	int b, is_comp;
-	int64_t m;
-	triple64_t *a;
+	mr_column_t *col;
 } worker_t;
 
 static void *worker(void *data)
@@ -291,20 +447,36 @@ static void *worker(void *data)
 	req.tv_sec = 0; req.tv_nsec = 1000000;
 	do {
 		while (!__sync_bool_compare_and_swap(&w->to_run, 1, 0)) nanosleep(&req, &rem); // wait for the signal from the master thread
-		if (w->m) mr_insert_multi_aux(w->mr->r[w->b], w->m, w->a, w->is_comp);
+		mr_insert_column(w->col);
 		__sync_add_and_fetch(w->n_fin_workers, 1);
 	} while (!w->to_exit);
 	return 0;
 }
 
-void mr_insert_multi(mrope_t *mr, int64_t len, const uint8_t *s, int is_thr)
+static void mr_update_intervals(mrope_t *mr, const int64_t *c, triple64_t **q)
+{ // move to the rope of the extended suffixes and account for ropes ahead
+	int a, b;
+	int64_t k, ac[6];
+	for (b = 0; b < mr->n_r; ++b) {
+		if (b % 6 == 0) memset(ac, 0, 48); // only ropes sharing all but the last symbol of the context precede
+		for (k = 0; k < c[b]; ++k) {
+			triple64_t *p = &q[b][k];
+			p->l += ac[p->c]; p->u += ac[p->c];
+			p->b = mr_ctx_next(mr, b, p->c);
+		}
+		for (a = 0; a < 6; ++a) ac[a] += mr->r[b]->c[a];
+	}
+}
+
+void mr_insert_multi(mrope_t *mr, int64_t len, const uint8_t *s, int n_threads)
 {
-	int64_t k, m, n0;
-	int b, is_srt = (mr->so != MR_SO_IO), is_comp = (mr->so == MR_SO_RCLO), stop_thr = 0;
+	int64_t k, m, n0, n_fin, c[MR_MAX_ROPES];
+	int b, is_srt = (mr->so != MR_SO_IO), is_comp = (mr->so == MR_SO_RCLO), stop_thr = 0, n_workers;
 	volatile int n_fin_workers = 0;
-	triple64_t *a[2], *curr, *prev, *swap;
-	pthread_t tid[4];
-	worker_t w[4];
+	triple64_t *a[2], *curr, *prev, *swap, *q[MR_MAX_ROPES];
+	pthread_t *tid = 0;
+	worker_t *w = 0;
+	mr_column_t col;
 
 	if (mr->thr_min < 0) mr->thr_min = 0;
 	assert(len > 0 && s[len-1] == 0);
@@ -318,68 +490,65 @@ void mr_insert_multi(mrope_t *mr, int64_t len, const uint8_t *s, int is_thr)
 			if (*p == 0) prev[k++].p = q, q = p + 1;
 	}
 
-	for (k = n0 = 0; k < 6; ++k) n0 += mr->r[k]->c[0];
+	for (k = n0 = 0; k < mr->n_r; ++k) n0 += mr->r[k]->c[0];
 	for (k = 0; k != m; ++k) {
 		if (is_srt) prev[k].l = 0, prev[k].u = n0;
 		else prev[k].l = prev[k].u = n0 + k;
-		prev[k].c = 0;
+		prev[k].c = 0, prev[k].b = 0;
 	}
 	mr_insert_multi_aux(mr->r[0], m, prev, is_comp); // insert the first (actually the last) column
+	memset(c, 0, mr->n_r * 8);
+	c[0] = m, q[0] = prev;
+	mr_update_intervals(mr, c, q);
 
-	if (is_thr) {
-		memset(w, 0, 4 * sizeof(worker_t));
-		for (b = 0; b < 4; ++b) {
-			w[b].mr = mr, w[b].b = b + 1, w[b].is_comp = is_comp;
-			w[b].n_fin_workers = &n_fin_workers;
-		}
-		for (b = 0; b < 4; ++b) pthread_create(&tid[b], 0, worker, &w[b]);
+	memset(&col, 0, sizeof(mr_column_t));
+	col.mr = mr, col.is_comp = is_comp, col.c = c, col.q = q;
+	n_workers = n_threads < mr->n_r - mr->n_r / 6? n_threads - 1 : mr->n_r - mr->n_r / 6 - 1;
+	if (n_workers > 0) {
+		tid = (pthread_t*)calloc(n_workers, sizeof(pthread_t));
+		w = (worker_t*)calloc(n_workers, sizeof(worker_t));
+		for (b = 0; b < n_workers; ++b)
+			w[b].col = &col, w[b].n_fin_workers = &n_fin_workers;
+		for (b = 0; b < n_workers; ++b) pthread_create(&tid[b], 0, worker, &w[b]);
 	}
 
 	n0 = 0; // the number of inserted strings
 	while (m) {
-		int64_t c[6], ac[6];
-		triple64_t *q[6];
-
-		memset(c, 0, 48);
-		for (k = n0; k != m; ++k) ++c[prev[k].c]; // counting
-		for (q[0] = curr + n0, b = 1; b < 6; ++b) q[b] = q[b-1] + c[b-1];
-		if (n0 + c[0] < m) {
-			for (k = n0; k != m; ++k) *q[prev[k].c]++ = prev[k]; // sort
-			for (b = 0; b < 6; ++b) q[b] -= c[b];
+		memset(c, 0, mr->n_r * 8);
+		for (k = n0; k != m; ++k) ++c[prev[k].b]; // counting
+		for (q[0] = curr + n0, b = 1; b < mr->n_r; ++b) q[b] = q[b-1] + c[b-1];
+		for (b = 0, n_fin = 0; b < mr->n_r / 6; ++b) n_fin += c[b];
+		if (n0 + n_fin < m) {
+			for (k = n0; k != m; ++k) *q[prev[k].b]++ = prev[k]; // sort
+			for (b = 0; b < mr->n_r; ++b) q[b] -= c[b];
 		}
-		n0 += c[0];
+		n0 += n_fin;
+		memset(c, 0, mr->n_r / 6 * 8); // strings in ropes of suffixes starting with a sentinel are finished
 
-		if (is_thr && !stop_thr) {
+		col.next = 0;
+		if (n_workers > 0 && !stop_thr) {
 			struct timespec req, rem;
 			req.tv_sec = 0; req.tv_nsec = 1000000;
 			stop_thr = (m - n0 <= mr->thr_min);
-			for (b = 0; b < 4; ++b) {
-				w[b].a = q[b+1], w[b].m = c[b+1];
+			for (b = 0; b < n_workers; ++b) {
 				if (stop_thr) w[b].to_exit = 1; // signal the workers to exit
 				while (!__sync_bool_compare_and_swap(&w[b].to_run, 0, 1)); // signal the workers to start
 			}
-			if (c[5]) mr_insert_multi_aux(mr->r[5], c[5], q[5], is_comp); // the master thread processes the "N" bucket
-			while (!__sync_bool_compare_and_swap(&n_fin_workers, 4, 0)) // wait until all 4 workers finish
+			mr_insert_column(&col); // the master thread works, too
+			while (!__sync_bool_compare_and_swap(&n_fin_workers, n_workers, 0)) // wait until all workers finish
 				nanosleep(&req, &rem);
 			if (stop_thr && n0 < m)
 				fprintf(stderr, "[M::%s] Turn off parallelization for this batch as too few strings are left.\n", __func__);
-		} else {
-			for (b = 1; b < 6; ++b)
-				if (c[b]) mr_insert_multi_aux(mr->r[b], c[b], q[b], is_comp);
-		}
+		} else mr_insert_column(&col);
 		if (n0 == m) break;
 
-		memset(ac, 0, 48);
-		for (b = 1; b < 6; ++b) { // update the intervals to account for buckets ahead
-			int a;
-			for (a = 0; a < 6; ++a) ac[a] += mr->r[b-1]->c[a];
-			for (k = 0; k < c[b]; ++k) {
-				triple64_t *p = &q[b][k];
-				p->l += ac[p->c]; p->u += ac[p->c];
-			}
-		}
+		mr_update_intervals(mr, c, q);
 		swap = curr, curr = prev, prev = swap;
 	}
-	if (is_thr) for (b = 0; b < 4; ++b) pthread_join(tid[b], 0);
+	if (n_workers > 0) {
+		for (b = 0; b < n_workers; ++b) pthread_join(tid[b], 0);
+		free(tid); free(w);
+	}
 	free(a[0]); free(a[1]);
+	mr_update_cnt(mr);
 }
@@ -7,10 +7,17 @@
 #define MR_SO_RLO   1
 #define MR_SO_RCLO  2
 
+#define MR_MAX_CTX   3
+#define MR_MAX_ROPES 216 // 6^MR_MAX_CTX
+
 typedef struct {
 	uint8_t so; // sorting order
+	uint8_t ctx; // ropes are partitioned by the first $ctx symbols of suffixes; 1 for one rope per symbol
+	int n_r; // number of ropes: 6^ctx
 	int thr_min; // when there are fewer sequences than this, disable multi-threading
-	rope_t *r[6];
+	rope_t *r[MR_MAX_ROPES]; // r[c_1*6^{ctx-1}+...+c_ctx] keeps suffixes starting with c_1...c_ctx; padded with 0 after a sentinel
+	int64_t off[MR_MAX_ROPES+1]; // off[a]: number of symbols in r[0..a-1]; updated by mr_update_cnt()
+	int64_t cnt[MR_MAX_ROPES+1][6]; // cnt[a][c]: occurrences of $c in r[0..a-1]
 } mrope_t; // multi-rope
 
 typedef struct {
@@ -33,9 +40,31 @@ extern "C" {
 	mrope_t *mr_init(int max_nodes, int block_len, int sorting_order);
 
 	void mr_destroy(mrope_t *r);
+	int64_t mr_mem(const mrope_t *r); // bytes allocated by all ropes
 
 	int mr_thr_min(mrope_t *r, int thr_min);
 
+	/**
+	 * Recompute mrope_t::off and mrope_t::cnt; call this after ropes are modified outside mrope.c
+	 */
+	void mr_update_cnt(mrope_t *r);
+
+	/**
+	 * Partition ropes by a longer context such that insertion can use more threads
+	 *
+	 * @param r          multi-rope
+	 * @param ctx        new context length, no larger than MR_MAX_CTX; no effect if not longer than r->ctx
+	 * @param n_threads  number of threads
+	 *
+	 * @return the context length after partitioning
+	 */
+	int mr_split(mrope_t *r, int ctx, int n_threads);
+
+	/**
+	 * Context length that gives at least $n_threads ropes to work on
+	 */
+	int mr_ctx4threads(int n_threads);
+
 	/**
 	 * Insert one string into the index
 	 *
@@ -50,9 +79,9 @@ extern "C" {
 	 * @param mr       multi-rope
 	 * @param len      total length of $s
 	 * @param s        concatenated, NULL delimited, reversed input strings
-	 * @param is_thr   true to use 5 threads
+	 * @param n_threads  number of threads; at most 6^ctx-6^(ctx-1) threads are used
 	 */
-	void mr_insert_multi(mrope_t *mr, int64_t len, const uint8_t *s, int is_thr);
+	void mr_insert_multi(mrope_t *mr, int64_t len, const uint8_t *s, int n_threads);
 
 	/**
 	 * Count occurrences and retrieve a BWT symbol
@@ -102,11 +131,10 @@ static inline int64_t mr_get_c(const mrope_t *mr, int64_t c[6])
 	int a, b;
 	int64_t tot = 0;
 	for (a = 0; a < 6; ++a) c[a] = 0;
-	for (a = 0; a < 6; ++a) {
+	for (a = 0; a < mr->n_r; ++a)
 		for (b = 0; b < 6; ++b)
 			c[b] += mr->r[a]->c[b];
-		tot += c[a];
-	}
+	for (a = 0; a < 6; ++a) tot += c[a];
 	return tot;
 }
 
@@ -123,7 +151,7 @@ static inline int64_t mr_get_tot(const mrope_t *mr)
 {
 	int a, b;
 	int64_t tot = 0;
-	for (a = 0; a < 6; ++a)
+	for (a = 0; a < mr->n_r; ++a)
 		for (b = 0; b < 6; ++b)
 			tot += mr->r[a]->c[b];
 	return tot;
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "mvt.h"
+
+/****************
+ * Construction *
+ ****************/
+
+mvt_t *mv_init(void)
+{
+	return (mvt_t*)calloc(1, sizeof(mvt_t));
+}
+
+void mv_destroy(mvt_t *m)
+{
+	if (m == 0) return;
+	free(m->p); free(m->q); free(m->dc); free(m->cnt); free(m->idx);
+	free(m);
+}
+
+void mv_push(mvt_t *m, int c, int64_t l)
+{ // during construction, p[] keeps run lengths and dc[] keeps symbols
+	if (l <= 0) return;
+	if (m->n_run > 0 && (int)m->dc[m->n_run - 1] == c) { // merge adjacent runs of the same symbol
+		m->p[m->n_run - 1] += l;
+		return;
+	}
+	if (m->n_run == m->m_run) {
+		m->m_run = m->m_run? m->m_run + (m->m_run>>1) : 1024;
+		m->p = (uint64_t*)realloc(m->p, (m->m_run + 1) * sizeof(uint64_t));
+		m->dc = (uint64_t*)realloc(m->dc, m->m_run * sizeof(uint64_t));
+	}
+	m->p[m->n_run] = l, m->dc[m->n_run++] = c;
+}
+
+static int64_t mv_upper(const mvt_t *m, uint64_t x)
+{ // the first run with p[] > x
+	int64_t lo = 0, hi = m->n_run;
+	while (lo < hi) {
+		int64_t mid = (lo + hi) >> 1;
+		if (m->p[mid] <= x) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static int64_t mv_balance1(mvt_t *m)
+{ // split runs whose LF image contains more than MV_MAX_SCAN run starts; return the number of added runs
+	int64_t j, t, t0, n_add = 0, n_run;
+	uint64_t *p, *q, *c;
+	for (j = 0; j < m->n_run; ++j) { // count
+		uint64_t end = m->q[j] + (m->p[j+1] - m->p[j]);
+		for (t = t0 = mv_upper(m, m->q[j]); t < m->n_run && m->p[t] < end; ++t) {}
+		if (t - t0 > MV_MAX_SCAN) n_add += (t - t0) / (MV_MAX_SCAN>>1);
+	}
+	if (n_add == 0) return 0;
+	n_run = m->n_run + n_add;
+	p = (uint64_t*)malloc((n_run + 1) * sizeof(uint64_t));
+	q = (uint64_t*)malloc((n_run + 1) * sizeof(uint64_t));
+	c = (uint64_t*)malloc((n_run + 1) * sizeof(uint64_t));
+	for (j = 0, n_run = 0; j < m->n_run; ++j) { // cut the image at every (MV_MAX_SCAN/2)-th run start in it
+		uint64_t end = m->q[j] + (m->p[j+1] - m->p[j]);
+		p[n_run] = m->p[j], q[n_run] = m->q[j], c[n_run++] = m->dc[j];
+		for (t = t0 = mv_upper(m, m->q[j]); t < m->n_run && m->p[t] < end; ++t) {}
+		if (t - t0 <= MV_MAX_SCAN) continue;
+		for (t = t0 + (MV_MAX_SCAN>>1) - 1; t < m->n_run && m->p[t] < end; t += MV_MAX_SCAN>>1)
+			p[n_run] = m->p[j] + (m->p[t] - m->q[j]), q[n_run] = m->p[t], c[n_run++] = m->dc[j];
+	}
+	p[n_run] = m->p[m->n_run], c[n_run] = 0;
+	free(m->p); free(m->q); free(m->dc);
+	m->p = p, m->q = q, m->dc = c;
+	m->n_run = m->m_run = n_run;
+	return n_add;
+}
+
+void mv_finish(mvt_t *m)
+{
+	int64_t j, n_smp, n_run0, ptr[MV_ASIZE];
+	uint64_t i, n = 0, c0[MV_ASIZE];
+	int c;
+
+	m->p = (uint64_t*)realloc(m->p, (m->n_run + 1) * sizeof(uint64_t));
+	m->dc = (uint64_t*)realloc(m->dc, (m->n_run + 1) * sizeof(uint64_t));
+	m->m_run = m->n_run;
+	m->q = (uint64_t*)calloc(m->n_run + 1, sizeof(uint64_t));
+
+	// run lengths to run starts
+	memset(c0, 0, MV_ASIZE * sizeof(uint64_t));
+	for (j = 0; j < m->n_run; ++j) {
+		uint64_t l = m->p[j];
+		c = m->dc[j];
+		assert(c >= 0 && c < MV_ASIZE);
+		m->p[j] = n, m->q[j] = c0[c]; // q[j] is finalized below
+		n += l, c0[c] += l;
+	}
+	m->p[m->n_run] = n, m->dc[m->n_run] = 0;
+	for (m->acc[0] = 0, c = 0; c < MV_ASIZE; ++c)
+		m->acc[c+1] = m->acc[c] + c0[c];
+	for (j = 0; j < m->n_run; ++j)
+		m->q[j] += m->acc[m->dc[j]];
+
+	// split runs such that mv_lf() scans at most MV_MAX_SCAN runs; adjacent runs may then have the same symbol
+	n_run0 = m->n_run;
+	while (mv_balance1(m) > 0) {}
+	m->n_split = m->n_run - n_run0;
+
+	// sample counts
+	n_smp = (m->n_run >> MV_SBITS) + 1;
+	m->cnt = (uint64_t*)calloc(n_smp * MV_ASIZE, sizeof(uint64_t));
+	memset(c0, 0, MV_ASIZE * sizeof(uint64_t));
+	for (j = 0; j < m->n_run; ++j) {
+		if ((j & ((1<<MV_SBITS) - 1)) == 0)
+			memcpy(&m->cnt[(j>>MV_SBITS) * MV_ASIZE], c0, MV_ASIZE * sizeof(uint64_t));
+		c0[m->dc[j]] += m->p[j+1] - m->p[j];
+	}
+
+	// buckets for locating runs; roughly one run per bucket
+	for (m->ibits = 0; m->ibits < 62 && n >> m->ibits > (uint64_t)m->n_run; ++m->ibits) {}
+	m->n_bkt = (n >> m->ibits) + 1;
+	m->idx = (uint64_t*)calloc(m->n_bkt, sizeof(uint64_t));
+	for (i = 0, j = 0; i < m->n_bkt; ++i) {
+		uint64_t pos = i << m->ibits;
+		while (j < m->n_run && m->p[j+1] <= pos) ++j;
+		m->idx[i] = j;
+	}
+
+	// the run containing q[j]; for each symbol, q[] is increasing
+	for (c = 0; c < MV_ASIZE; ++c)
+		ptr[c] = m->acc[c] < n? mv_locate(m, m->acc[c]) : m->n_run;
+	for (j = 0; j < m->n_run; ++j) {
+		int64_t *d;
+		c = m->dc[j], d = &ptr[c];
+		while (m->p[*d + 1] <= m->q[j]) ++*d;
+		m->dc[j] = (uint64_t)c << MV_CSHIFT | *d;
+	}
+}
+
+/********
+ * Rank *
+ ********/
+
+int64_t mv_locate(const mvt_t *m, uint64_t k)
+{
+	uint64_t b = k >> m->ibits;
+	int64_t lo, hi;
+	if (k >= m->acc[MV_ASIZE]) return m->n_run;
+	lo = m->idx[b], hi = b + 1 < m->n_bkt? m->idx[b+1] : m->n_run - 1;
+	while (lo < hi) { // the last run with p[] <= k
+		int64_t mid = (lo + hi + 1) >> 1;
+		if (m->p[mid] <= k) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+static inline int mv_rank_run(const mvt_t *m, int64_t j, uint64_t k, uint64_t *ok)
+{ // the same as mv_rank1a() given that k is in run j
+	int64_t t;
+	int c;
+	memcpy(ok, &m->cnt[(j>>MV_SBITS) * MV_ASIZE], MV_ASIZE * sizeof(uint64_t));
+	for (t = j>>MV_SBITS<<MV_SBITS; t < j; ++t)
+		ok[m->dc[t]>>MV_CSHIFT] += m->p[t+1] - m->p[t];
+	c = m->dc[j] >> MV_CSHIFT;
+	ok[c] += k - m->p[j];
+	return c;
+}
+
+int mv_rank1a(const mvt_t *m, uint64_t k, uint64_t *ok)
+{
+	int c;
+	if (k >= m->acc[MV_ASIZE]) {
+		for (c = 0; c < MV_ASIZE; ++c)
+			ok[c] = m->acc[c+1] - m->acc[c];
+		return -1;
+	}
+	return mv_rank_run(m, mv_locate(m, k), k, ok);
+}
+
+void mv_rank2a(const mvt_t *m, uint64_t k, uint64_t l, uint64_t *ok, uint64_t *ol)
+{
+	int64_t j;
+	int c;
+	if (k >= m->acc[MV_ASIZE] || l < k) {
+		mv_rank1a(m, k, ok);
+		mv_rank1a(m, l, ol);
+		return;
+	}
+	j = mv_locate(m, k);
+	c = mv_rank_run(m, j, k, ok);
+	if (l < m->p[j+1]) { // in the same run
+		memcpy(ol, ok, MV_ASIZE * sizeof(uint64_t));
+		ol[c] += l - k;
+	} else mv_rank1a(m, l, ol);
+}
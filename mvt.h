@@ -0,0 +1,61 @@
+#ifndef MVT_H
+#define MVT_H
+
+#include <stdint.h>
+
+#define MV_ASIZE  6
+#define MV_SBITS  4 // sample symbol counts every 1<<MV_SBITS runs
+#define MV_CSHIFT 56
+#define MV_DMASK  ((1ULL<<MV_CSHIFT) - 1)
+#define MV_MAX_SCAN 8 // mv_lf() moves forward by at most this many runs
+
+/* A move table keeps one row per BWT run. For run j starting at p[j], q[j] is
+ * LF(p[j]) and dc[j] gives the run containing q[j]. LF of any position in run j
+ * is then q[j]+(k-p[j]), followed by a short scan from that run. Space is
+ * proportional to the number of runs, not the BWT length. mv_finish() splits
+ * runs until the LF image of every run overlaps at most MV_MAX_SCAN+1 runs, so
+ * a run here may be part of a BWT run.
+ */
+typedef struct {
+	int64_t n_run, m_run; // number of runs; capacity during construction
+	int64_t n_split; // number of runs added by splitting; n_run-n_split is the number of BWT runs
+	int8_t ibits; // each bucket in idx[] covers 1<<ibits positions
+	uint64_t n_bkt; // number of buckets
+	uint64_t acc[MV_ASIZE+1]; // acc[c]: number of symbols smaller than c; acc[MV_ASIZE] is the BWT length
+	uint64_t *p; // p[j]: start of run j; p[n_run] is the BWT length
+	uint64_t *q; // q[j]: LF(p[j])
+	uint64_t *dc; // dc[j]>>MV_CSHIFT: symbol of run j; dc[j]&MV_DMASK: the run containing q[j]
+	uint64_t *cnt; // cnt[(j>>MV_SBITS)*MV_ASIZE+c]: occurrences of c before run j>>MV_SBITS<<MV_SBITS
+	uint64_t *idx; // idx[i]: the run containing position i<<ibits
+} mvt_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	mvt_t *mv_init(void);
+	void mv_destroy(mvt_t *m);
+	void mv_push(mvt_t *m, int c, int64_t l); // append a run; call mv_finish() after the last run
+	void mv_finish(mvt_t *m);
+
+	int64_t mv_locate(const mvt_t *m, uint64_t k); // the run containing position k
+	int mv_rank1a(const mvt_t *m, uint64_t k, uint64_t *ok); // same as rld_rank1a()
+	void mv_rank2a(const mvt_t *m, uint64_t k, uint64_t l, uint64_t *ok, uint64_t *ol);
+
+#ifdef __cplusplus
+}
+#endif
+
+// LF-mapping. $j is the run containing *k, or -1 if unknown. On return, *k=LF(*k) and $j is updated. Return BWT[*k]
+static inline int mv_lf(const mvt_t *m, uint64_t *k, int64_t *j)
+{
+	int64_t i = *j >= 0? *j : mv_locate(m, *k), d;
+	uint64_t x;
+	x = m->q[i] + (*k - m->p[i]);
+	d = m->dc[i] & MV_DMASK;
+	while (m->p[d+1] <= x) ++d; // fast forward; at most MV_MAX_SCAN steps as the table is balanced
+	*k = x, *j = d;
+	return m->dc[i] >> MV_CSHIFT;
+}
+
+#endif
@@ -0,0 +1,335 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include "rb3priv.h"
+#include "fm-index.h"
+#include "kalloc.h"
+#include "kthread.h"
+#include "ketopt.h"
+#include "ksort.h"
+
+/* The r-index locate structure. Text positions are global: sequences are
+ * concatenated such that LF always moves to the previous position, with each
+ * sequence followed by its sentinel. phi(SA[i]) = SA[i-1] is sampled at text
+ * positions of BWT run starts and sentinel rows; other positions are derived
+ * from the nearest sample on the left. Toeholds, SA values at the bottom of
+ * SA intervals during backward search, are sampled at LF of run ends.
+ */
+
+#define phi_key(a) ((a).x)
+KRADIX_SORT_INIT(phi, rb3_phi_pair_t, phi_key, 8)
+
+/********************
+ * phi construction *
+ ********************/
+
+typedef struct { size_t n, m; uint64_t **a; } ptr_v;
+
+typedef struct {
+	const mvt_t *mv;
+	int32_t ms;
+	void **km;
+	ptr_v *buf;
+	uint64_t *ss, *se, *sd; // SA at run starts, run ends and sentinel rows; l<<ms|sid during the traversal
+	int64_t *len, *prev;
+} phi_aux_t;
+
+static inline void phi_push(void *km, ptr_v *buf, uint64_t *p, uint64_t x)
+{
+	*p = x;
+	Kgrow(km, uint64_t*, buf->a, buf->n, buf->m);
+	buf->a[buf->n++] = p;
+}
+
+static void worker_phi(void *data, long k0, int tid)
+{ // traverse the k0-th sequence from its end
+	phi_aux_t *a = (phi_aux_t*)data;
+	const mvt_t *m = a->mv;
+	void *km = a->km[tid];
+	ptr_v *buf = &a->buf[tid];
+	uint64_t k = k0, mask = (1ULL<<a->ms) - 1;
+	int64_t j = mv_locate(m, k), l = 0;
+	size_t i;
+	buf->n = 0;
+	for (;;) {
+		uint64_t x = (uint64_t)l << a->ms | k0;
+		if (k == m->p[j]) phi_push(km, buf, &a->ss[j], x);
+		if (k == m->p[j+1] - 1) phi_push(km, buf, &a->se[j], x);
+		if (m->dc[j] >> MV_CSHIFT == 0) phi_push(km, buf, &a->sd[m->q[j] + (k - m->p[j])], x);
+		if (mv_lf(m, &k, &j) == 0) break;
+		++l;
+	}
+	a->len[k0] = l, a->prev[k0] = k;
+	for (i = 0; i < buf->n; ++i) // l steps from the end is position len-l
+		*buf->a[i] = (uint64_t)(a->len[k0] - (*buf->a[i] >> a->ms)) << a->ms | (*buf->a[i] & mask);
+}
+
+rb3_phi_t *rb3_phi_gen(const rb3_fmi_t *f, int n_threads)
+{
+	const mvt_t *m = f->mv;
+	rb3_phi_t *ph;
+	phi_aux_t a;
+	int64_t i, j, g, n_ord, *soff, *tmp;
+	uint8_t *placed;
+	uint64_t mask;
+
+	if (m == 0) return 0;
+	memset(&a, 0, sizeof(a));
+	a.mv = m;
+	for (a.ms = 1; 1LL<<a.ms < f->acc[1]; ++a.ms) {}
+	mask = (1ULL<<a.ms) - 1;
+	a.ss = RB3_CALLOC(uint64_t, m->n_run);
+	a.se = RB3_CALLOC(uint64_t, m->n_run);
+	a.sd = RB3_CALLOC(uint64_t, f->acc[1]);
+	a.len = RB3_CALLOC(int64_t, f->acc[1]);
+	a.prev = RB3_CALLOC(int64_t, f->acc[1]);
+	a.km = RB3_CALLOC(void*, n_threads);
+	a.buf = RB3_CALLOC(ptr_v, n_threads);
+	for (i = 0; i < n_threads; ++i)
+		a.km[i] = km_init();
+	kt_for(n_threads, worker_phi, &a, f->acc[1]);
+	for (i = 0; i < n_threads; ++i)
+		km_destroy(a.km[i]);
+	free(a.km); free(a.buf);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] sampled SA at run boundaries\n", __func__, rb3_realtime(), rb3_percent_cpu());
+
+	// lay out sequences; prev[] is a permutation
+	ph = RB3_CALLOC(rb3_phi_t, 1);
+	ph->m = f->acc[1];
+	ph->off = RB3_CALLOC(uint64_t, ph->m);
+	ph->o2s = RB3_CALLOC(uint64_t, ph->m);
+	soff = RB3_CALLOC(int64_t, ph->m);
+	tmp = RB3_CALLOC(int64_t, ph->m);
+	placed = RB3_CALLOC(uint8_t, ph->m);
+	for (i = 0, n_ord = 0, g = 0; i < ph->m; ++i) {
+		int64_t s = i, n = 0;
+		if (placed[i]) continue;
+		do { // going backward on the text
+			tmp[n++] = s, placed[s] = 1, s = a.prev[s];
+		} while (s != i);
+		while (n > 0) {
+			s = tmp[--n];
+			ph->o2s[n_ord] = s, ph->off[n_ord++] = g, soff[s] = g;
+			g += a.len[s] + 1;
+		}
+	}
+	free(placed); free(tmp);
+	#define phi_g(x) (soff[(x)&mask] + (int64_t)((x)>>a.ms))
+
+	// phi samples
+	ph->phi = RB3_MALLOC(rb3_phi_pair_t, m->n_run + ph->m);
+	for (j = 0; j < m->n_run; ++j) {
+		if (m->dc[j] >> MV_CSHIFT == 0) { // sentinel rows
+			uint64_t r;
+			for (r = m->p[j]; r < m->p[j+1]; ++r) {
+				uint64_t d = m->q[j] + (r - m->p[j]);
+				if (r == 0) continue;
+				ph->phi[ph->n_phi].x = phi_g(a.sd[d]);
+				ph->phi[ph->n_phi++].y = r == m->p[j]? phi_g(a.se[j-1]) : phi_g(a.sd[d-1]);
+			}
+		} else if (j > 0 && m->dc[j] >> MV_CSHIFT != m->dc[j-1] >> MV_CSHIFT) { // only at the start of a BWT run; see mv_finish()
+			ph->phi[ph->n_phi].x = phi_g(a.ss[j]);
+			ph->phi[ph->n_phi++].y = phi_g(a.se[j-1]);
+		}
+	}
+	radix_sort_phi(ph->phi, ph->phi + ph->n_phi);
+
+	// toeholds at LF of run ends
+	ph->th = RB3_MALLOC(rb3_phi_pair_t, m->n_run);
+	for (j = 0; j < m->n_run; ++j) {
+		if (m->dc[j] >> MV_CSHIFT == 0) continue; // patterns don't contain sentinels
+		if (j + 1 < m->n_run && m->dc[j+1] >> MV_CSHIFT == m->dc[j] >> MV_CSHIFT) continue; // not the end of a BWT run
+		ph->th[ph->n_th].x = m->q[j] + (m->p[j+1] - m->p[j]) - 1;
+		ph->th[ph->n_th++].y = phi_g(a.se[j]) - 1; // not at the start of a sequence, so no wrapping
+	}
+	radix_sort_phi(ph->th, ph->th + ph->n_th);
+	#undef phi_g
+
+	free(soff); free(a.ss); free(a.se); free(a.sd); free(a.len); free(a.prev);
+	return ph;
+}
+
+void rb3_phi_destroy(rb3_phi_t *ph)
+{
+	if (ph == 0) return;
+	free(ph->off); free(ph->o2s); free(ph->phi); free(ph->th); free(ph);
+}
+
+/**********
+ * Locate *
+ **********/
+
+static inline int64_t phi_pred(int64_t n, const rb3_phi_pair_t *a, uint64_t x)
+{ // the last i such that a[i].x <= x; -1 if not found
+	int64_t lo = 0, hi = n;
+	while (lo < hi) {
+		int64_t mid = lo + ((hi - lo) >> 1);
+		if (a[mid].x <= x) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo - 1;
+}
+
+static inline uint64_t phi_phi(const rb3_phi_t *ph, uint64_t x)
+{
+	int64_t i = phi_pred(ph->n_phi, ph->phi, x);
+	assert(i >= 0);
+	return ph->phi[i].y + (x - ph->phi[i].x);
+}
+
+static inline void phi_g2pos(const rb3_phi_t *ph, uint64_t x, rb3_pos_t *p)
+{
+	int64_t lo = 0, hi = ph->m;
+	while (lo < hi) {
+		int64_t mid = lo + ((hi - lo) >> 1);
+		if (ph->off[mid] <= x) lo = mid + 1;
+		else hi = mid;
+	}
+	p->sid = ph->o2s[lo - 1], p->pos = x - ph->off[lo - 1];
+}
+
+int64_t rb3_phi_toehold(const rb3_fmi_t *f, const rb3_phi_t *ph, int64_t len, const uint8_t *q, int64_t *lo, int64_t *hi)
+{ // backward search of q[0..len-1]; return SA[*hi-1] in the global coordinate, or -1 if q is absent
+	int64_t i, j, k, l, t = -1, ok[RB3_ASIZE], ol[RB3_ASIZE];
+	int c, c1;
+	*lo = *hi = 0;
+	if (len <= 0) return -1;
+	c = q[len - 1];
+	if (c < 1 || c >= RB3_ASIZE) return -1;
+	k = f->acc[c], l = f->acc[c+1];
+	for (i = len - 1; i >= 0; --i) {
+		if (i < len - 1) {
+			c = q[i];
+			if (c < 1 || c >= RB3_ASIZE) return -1;
+			rb3_fmi_rank1a(f, k, ok);
+			c1 = rb3_fmi_rank1a(f, l - 1, ol);
+			++ol[c1];
+			k = f->acc[c] + ok[c], l = f->acc[c] + ol[c];
+			if (c1 == c) { // the last row is kept
+				--t;
+				continue;
+			}
+		}
+		if (k >= l) return -1;
+		j = phi_pred(ph->n_th, ph->th, l - 1);
+		assert(j >= 0 && ph->th[j].x == l - 1);
+		t = ph->th[j].y;
+	}
+	*lo = k, *hi = l;
+	return t;
+}
+
+int64_t rb3_phi_locate(const rb3_fmi_t *f, const rb3_phi_t *ph, int64_t len, const uint8_t *q, int64_t max_sa, rb3_pos_t *sa)
+{ // SA of the bottom max_sa rows in the SA interval of q
+	int64_t lo, hi, t, n;
+	t = rb3_phi_toehold(f, ph, len, q, &lo, &hi);
+	if (t < 0) return 0;
+	for (n = 0; n < max_sa && n < hi - lo; ++n) {
+		if (n > 0) t = phi_phi(ph, t);
+		phi_g2pos(ph, t, &sa[n]);
+	}
+	return n;
+}
+
+int64_t rb3_locate(void *km, const rb3_fmi_t *f, int64_t lo, int64_t hi, int64_t len, const uint8_t *q, int64_t max_sa, rb3_pos_t *sa)
+{ // [lo,hi) is the SA interval of q[0..len-1]; use phi if available
+	if (f->phi && q) return rb3_phi_locate(f, f->phi, len, q, max_sa, sa);
+	if (f->ssa) return rb3_ssa_multi(km, f, f->ssa, lo, hi, max_sa, sa);
+	return 0;
+}
+
+/***********
+ * phi I/O *
+ ***********/
+
+int rb3_phi_dump(const rb3_phi_t *ph, const char *fn)
+{
+	FILE *fp;
+	fp = fn && strcmp(fn, "-")? fopen(fn, "wb") : fdopen(1, "wb");
+	if (fp == 0) return -1;
+	fwrite("PHI\1", 1, 4, fp);
+	fwrite(&ph->m, 8, 1, fp);
+	fwrite(&ph->n_phi, 8, 1, fp);
+	fwrite(&ph->n_th, 8, 1, fp);
+	fwrite(ph->off, 8, ph->m, fp);
+	fwrite(ph->o2s, 8, ph->m, fp);
+	fwrite(ph->phi, sizeof(rb3_phi_pair_t), ph->n_phi, fp);
+	fwrite(ph->th, sizeof(rb3_phi_pair_t), ph->n_th, fp);
+	fclose(fp);
+	return 0;
+}
+
+rb3_phi_t *rb3_phi_restore(const char *fn)
+{
+	FILE *fp;
+	char magic[4];
+	rb3_phi_t *ph;
+
+	fp = fn && strcmp(fn, "-")? fopen(fn, "rb") : fdopen(0, "rb");
+	if (fp == 0) return 0;
+	if (fread(magic, 1, 4, fp) != 4 || strncmp(magic, "PHI\1", 4) != 0) { // wrong magic
+		fclose(fp);
+		return 0;
+	}
+	ph = RB3_CALLOC(rb3_phi_t, 1);
+	if (fread(&ph->m, 8, 1, fp) != 1 || fread(&ph->n_phi, 8, 1, fp) != 1 || fread(&ph->n_th, 8, 1, fp) != 1 || ph->m < 0 || ph->n_phi < 0 || ph->n_th < 0) {
+		rb3_phi_destroy(ph);
+		fclose(fp);
+		return 0;
+	}
+	ph->off = RB3_MALLOC(uint64_t, ph->m);
+	ph->o2s = RB3_MALLOC(uint64_t, ph->m);
+	ph->phi = RB3_MALLOC(rb3_phi_pair_t, ph->n_phi);
+	ph->th = RB3_MALLOC(rb3_phi_pair_t, ph->n_th);
+	if ((ph->m > 0 && (ph->off == 0 || ph->o2s == 0)) || (ph->n_phi > 0 && ph->phi == 0) || (ph->n_th > 0 && ph->th == 0)
+		|| fread(ph->off, 8, ph->m, fp) != (size_t)ph->m || fread(ph->o2s, 8, ph->m, fp) != (size_t)ph->m
+		|| fread(ph->phi, sizeof(rb3_phi_pair_t), ph->n_phi, fp) != (size_t)ph->n_phi
+		|| fread(ph->th, sizeof(rb3_phi_pair_t), ph->n_th, fp) != (size_t)ph->n_th) { // out of memory or truncated file
+		rb3_phi_destroy(ph);
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	return ph;
+}
+
+/*******************
+ * main() function *
+ *******************/
+
+int main_phi(int argc, char *argv[])
+{
+	int c, n_threads = 4;
+	rb3_phi_t *ph;
+	rb3_fmi_t f;
+	char *fn = 0;
+	ketopt_t o = KETOPT_INIT;
+
+	while ((c = ketopt(&o, argc, argv, 1, "t:o:", 0)) >= 0) {
+		if (c == 't') n_threads = atoi(o.arg);
+		else if (c == 'o') fn = o.arg;
+	}
+	if (argc == o.ind) {
+		fprintf(stderr, "Usage: ropebwt3 phi [options] <in.fmd>\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  -t INT     number of threads [%d]\n", n_threads);
+		fprintf(stderr, "  -o FILE    output to file [stdout]\n");
+		return 1;
+	}
+	rb3_fmi_restore(&f, argv[o.ind], 0);
+	if (f.e == 0 && f.r == 0) {
+		fprintf(stderr, "[E::%s] failed to load the FM-index\n", __func__);
+		return 1;
+	}
+	rb3_fmi_to_mvt(&f);
+	ph = rb3_phi_gen(&f, n_threads);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] generated %ld phi samples and %ld toeholds\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)ph->n_phi, (long)ph->n_th);
+
+	rb3_phi_dump(ph, fn);
+	rb3_fmi_free(&f);
+	rb3_phi_destroy(ph);
+	return 0;
+}
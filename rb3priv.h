@@ -60,6 +60,7 @@ char *rb3_strdup(const char *src);
 
 // in sais-ss.c
 void rb3_build_sais(int64_t n_seq, int64_t len, char *seq, int n_threads);
+void rb3_build_sais_blk(int64_t n_seq, int64_t len, char *seq, int64_t blk_size, int n_threads);
 
 #ifdef __cplusplus
 }
@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include "rld0.h"
+#include "kthread.h"
 #ifdef RLD_HAVE_BRE
 #include "bre.h"
 #endif
@@ -79,8 +80,8 @@ void rld_destroy(rld_t *e)
 	int i = 0;
 	if (e == 0) return;
 	if (e->mem) {
-		close(e->fd);
-		munmap(e->mem, rld_file_size(e));
+		if (e->fd >= 0) close(e->fd);
+		if (e->mem_size) munmap(e->mem, e->mem_size);
 	} else {
 		for (i = 0; i < e->n; ++i) free(e->z[i]);
 		free(e->frame);
@@ -160,31 +161,55 @@ int rld_enc(rld_t *e, rlditr_t *itr, int64_t l, uint8_t c)
 	return 0;
 }
 
-void rld_rank_index(rld_t *e)
-{
-	uint64_t last, n_blks, i, k, cnt[RLD_MAX_ASIZE];
-	int j;
+static inline void rld_hdr_cnt(const rld_t *e, const uint64_t *p, uint64_t *cnt)
+{ // add symbol counts in the header of block $p, which are the counts of the previous block, to cnt[]
+	int j, type = rld_block_type(*p);
+	if (type == 0) {
+		uint16_t *q = (uint16_t*)p;
+		for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
+	} else if (type == 1) {
+		uint32_t *q = (uint32_t*)p;
+		for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j] & 0x3fffffff;
+	} else {
+		uint64_t *q = (uint64_t*)p;
+		for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
+	}
+}
 
+static void rld_rank_index_init(rld_t *e)
+{
+	uint64_t n_blks;
 	n_blks = e->n_bytes * 8 / 64 / e->ssize + 1;
-	last = rld_last_blk(e);
 	e->ibits = ilog2(e->mcnt[0] / n_blks) + RLD_IBITS_PLUS;
 	e->n_frames = ((e->mcnt[0] + (1ll<<e->ibits) - 1) >> e->ibits) + 1;
 	e->frame = RLD_CALLOC(uint64_t, e->n_frames * e->asize1);
 	e->frame[0] = 0;
+}
+
+static void rld_rank_index_fill(rld_t *e)
+{
+	uint64_t k;
+	int j;
+	for (k = 1; k < e->n_frames; ++k) { // fill zero cells
+		uint64_t x = k * e->asize1;
+		if (e->frame[x] == 0) {
+			for (j = 0; j <= e->asize; ++j)
+				e->frame[x + j] = e->frame[x - e->asize1 + j];
+		}
+	}
+}
+
+void rld_rank_index(rld_t *e)
+{
+	uint64_t last, i, k, cnt[RLD_MAX_ASIZE];
+	int j;
+
+	rld_rank_index_init(e);
+	last = rld_last_blk(e);
 	for (j = 0; j < e->asize; ++j) cnt[j] = 0;
 	for (i = e->ssize, k = 1; i <= last; i += e->ssize) {
-		uint64_t sum, *p = rld_seek_blk(e, i);
-		int type = rld_block_type(*p);
-		if (type == 0) {
-			uint16_t *q = (uint16_t*)p;
-			for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
-		} else if (type == 1) {
-			uint32_t *q = (uint32_t*)p;
-			for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j] & 0x3fffffff;
-		} else {
-			uint64_t *q = (uint64_t*)p;
-			for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
-		}
+		uint64_t sum;
+		rld_hdr_cnt(e, rld_seek_blk(e, i), cnt);
 		for (j = 0, sum = 0; j < e->asize; ++j) sum += cnt[j];
 		while (sum >= k<<e->ibits) ++k;
 		if (k < e->n_frames) {
@@ -194,16 +219,86 @@ void rld_rank_index(rld_t *e)
 		}
 	}
 	assert(k >= e->n_frames - 1);
-	for (k = 1; k < e->n_frames; ++k) { // fill zero cells
-		uint64_t x = k * e->asize1;
-		if (e->frame[x] == 0) {
-			for (j = 0; j <= e->asize; ++j)
-				e->frame[x + j] = e->frame[x - e->asize1 + j];
+	rld_rank_index_fill(e);
+}
+
+typedef struct {
+	rld_t *e;
+	int n_seg;
+	uint64_t n_blk; // blocks are indexed from 1 to n_blk
+	uint64_t *cnt; // cnt[s*asize+j]: occurrences of j before segment s
+	uint64_t *kn; // kn[s]: the first frame index written by segment s+1
+} rank_aux_t;
+
+#define rank_seg_st(a, s) (1 + (a)->n_blk * (s) / (a)->n_seg)
+
+static void worker_rank_cnt(void *data, long s, int tid)
+{
+	rank_aux_t *a = (rank_aux_t*)data;
+	uint64_t b, *cnt = &a->cnt[(s + 1) * a->e->asize];
+	for (b = rank_seg_st(a, s); b < rank_seg_st(a, s + 1); ++b)
+		rld_hdr_cnt(a->e, rld_seek_blk(a->e, b * a->e->ssize), cnt);
+}
+
+static void worker_rank_frame(void *data, long s, int tid)
+{ // the same as the loop in rld_rank_index(), except that the last block writes a frame
+	rank_aux_t *a = (rank_aux_t*)data;
+	rld_t *e = a->e;
+	uint64_t b, k, sum, cnt[RLD_MAX_ASIZE];
+	int j;
+	memcpy(cnt, &a->cnt[s * e->asize], e->asize * 8);
+	for (j = 0, sum = 0; j < e->asize; ++j) sum += cnt[j];
+	for (b = rank_seg_st(a, s), k = (sum >> e->ibits) + 1; b < rank_seg_st(a, s + 1); ++b) {
+		uint64_t i = b * e->ssize;
+		rld_hdr_cnt(e, rld_seek_blk(e, i), cnt);
+		for (j = 0, sum = 0; j < e->asize; ++j) sum += cnt[j];
+		while (sum >= k<<e->ibits) ++k;
+		if (k < e->n_frames && k != a->kn[s]) { // frame a->kn[s] is also written by the next segment, which takes precedence
+			uint64_t x = k * e->asize1;
+			e->frame[x] = i;
+			for (j = 0; j < e->asize; ++j) e->frame[x + j + 1] = cnt[j];
 		}
 	}
+	a->kn[s] = k; // for the assertion
 }
 
-uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr)
+static void rld_rank_index_mt(rld_t *e, int n_threads)
+{
+	rank_aux_t a;
+	uint64_t s, b;
+	int j;
+	a.e = e, a.n_blk = rld_last_blk(e) / e->ssize;
+	a.n_seg = n_threads * 4 < (int64_t)a.n_blk? n_threads * 4 : a.n_blk;
+	if (n_threads <= 1 || a.n_seg <= 1) {
+		rld_rank_index(e);
+		return;
+	}
+	rld_rank_index_init(e);
+	a.cnt = RLD_CALLOC(uint64_t, (a.n_seg + 1) * e->asize);
+	a.kn = RLD_CALLOC(uint64_t, a.n_seg);
+	kt_for(n_threads, worker_rank_cnt, &a, a.n_seg);
+	for (s = 1; s <= (uint64_t)a.n_seg; ++s) // prefix sum
+		for (j = 0; j < e->asize; ++j)
+			a.cnt[s * e->asize + j] += a.cnt[(s - 1) * e->asize + j];
+	for (s = 0; s < (uint64_t)a.n_seg; ++s) {
+		uint64_t cnt[RLD_MAX_ASIZE], sum;
+		if (s == (uint64_t)a.n_seg - 1) {
+			a.kn[s] = UINT64_MAX;
+			continue;
+		}
+		b = rank_seg_st(&a, s + 1);
+		memcpy(cnt, &a.cnt[(s + 1) * e->asize], e->asize * 8);
+		rld_hdr_cnt(e, rld_seek_blk(e, b * e->ssize), cnt);
+		for (j = 0, sum = 0; j < e->asize; ++j) sum += cnt[j];
+		a.kn[s] = (sum >> e->ibits) + 1;
+	}
+	kt_for(n_threads, worker_rank_frame, &a, a.n_seg);
+	assert(a.kn[a.n_seg - 1] >= e->n_frames - 1);
+	free(a.cnt); free(a.kn);
+	rld_rank_index_fill(e);
+}
+
+uint64_t rld_enc_finish_mt(rld_t *e, rlditr_t *itr, int n_threads)
 {
 	int i;
 	if (itr->l) rld_enc1(e, itr, itr->l, itr->c);
@@ -211,10 +306,103 @@ uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr)
 	e->n_bytes = (((uint64_t)(e->n - 1) * RLD_LSIZE) + (itr->p - *itr->i)) * 8;
 	// recompute e->cnt as the accumulative count; e->mcnt[] keeps the marginal counts
 	for (e->cnt[0] = 0, i = 1; i <= e->asize; ++i) e->cnt[i] += e->cnt[i - 1];
-	rld_rank_index(e);
+	rld_rank_index_mt(e, n_threads);
 	return e->n_bytes;
 }
 
+uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr)
+{
+	return rld_enc_finish_mt(e, itr, 1);
+}
+
+/* Concatenation. e1 is encoded from an empty rld_t and not finished. Block
+ * boundaries in e1 may differ from the ones we would get by encoding its runs
+ * to e, and the last block in each RLD_LSIZE array is shorter. We re-encode
+ * runs of e1 until a new block in e starts at the same run as a block in e1,
+ * and then copy whole blocks until the shorter block on either side.
+ */
+
+#define rld_blk_is_last(e, b) ((((b) + 1) * (e)->ssize & RLD_LMASK) == 0)
+#define rld_blk_ptr(e, b) rld_seek_blk((e), (uint64_t)(b) * (e)->ssize)
+#define rld_itr_blk(e, itr) ((((uint64_t)((itr)->i - (e)->z) << RLD_LBITS) + ((itr)->shead - *(itr)->i)) / (e)->ssize)
+
+static void rld_blk_cnt(const rld_t *e1, const rlditr_t *itr1, uint64_t n_blk, uint64_t b, uint64_t *x)
+{ // x[0]: number of symbols in block b; x[c+1]: occurrences of c
+	int j;
+	if (b + 1 < n_blk) {
+		memset(x, 0, (e1->asize + 1) * 8);
+		rld_hdr_cnt(e1, rld_blk_ptr(e1, b + 1), x + 1);
+		for (j = 1; j <= e1->asize; ++j) x[0] += x[j];
+	} else { // the last block
+		for (j = 0; j <= e1->asize; ++j) x[j] = e1->cnt[j] - e1->mcnt[j];
+	}
+}
+
+void rld_enc_cat(rld_t *e, rlditr_t *itr, rld_t *e1, const rlditr_t *itr1)
+{
+	uint64_t b, n_blk, s_free = 0, x[RLD_MAX_ASIZE + 1];
+	int64_t pend_b = -1; // e1 block starting with the pending run in itr, or -1
+	int j;
+
+	assert(e->asize == e1->asize && e->sbits == e1->sbits);
+	n_blk = rld_itr_blk(e1, itr1) + 1;
+	for (b = 0; b < n_blk;) {
+		rlditr_t it;
+		int c, first = 1;
+		int64_t l, start = -1;
+		for (; s_free < (b * e1->ssize) >> RLD_LBITS; ++s_free) // free arrays we have passed
+			free(e1->z[s_free]), e1->z[s_free] = 0;
+		it.shead = rld_blk_ptr(e1, b);
+		it.p = it.shead + e1->offset0[rld_block_type(*it.shead)];
+		it.stail = it.shead + e1->ssize - (rld_blk_is_last(e1, b)? 2 : 1);
+		it.r = 64;
+		while ((l = rld_dec0(e1, &it, &c)) > 0 && c <= e1->asize) { // re-encode
+			uint64_t *shead = itr->shead;
+			int64_t pb = pend_b;
+			if (itr->l == 0 || itr->c != c) pend_b = first? b : -1; // runs in e1 are maximal except the first one
+			first = 0;
+			rld_enc(e, itr, l, c);
+			if (itr->shead != shead && pb >= 0) { // the run starting e1 block pb also starts a new block in e
+				uint64_t g = rld_itr_blk(e, itr);
+				if (!rld_blk_is_last(e, g) && !rld_blk_is_last(e1, pb) && rld_block_type(*itr->shead) == rld_block_type(*rld_blk_ptr(e1, pb))) {
+					start = pb;
+					break;
+				}
+			}
+		}
+		if (start < 0) {
+			++b;
+			continue;
+		}
+		// copy the rest of the first block; the header has been written
+		j = e->offset0[rld_block_type(*itr->shead)];
+		memcpy(itr->shead + j, rld_blk_ptr(e1, start) + j, (e->ssize - j) * 8);
+		rld_blk_cnt(e1, itr1, n_blk, start, x);
+		for (j = 0; j <= e->asize; ++j) e->cnt[j] = e->mcnt[j] + x[j];
+		// copy whole blocks
+		for (b = start + 1; b < n_blk; ++b) {
+			if (rld_blk_is_last(e, rld_itr_blk(e, itr) + 1) || rld_blk_is_last(e1, b)) break;
+			itr->shead += e->ssize;
+			memcpy(itr->shead, rld_blk_ptr(e1, b), e->ssize * 8);
+			rld_blk_cnt(e1, itr1, n_blk, b, x);
+			for (j = 0; j <= e->asize; ++j)
+				e->mcnt[j] = e->cnt[j], e->cnt[j] += x[j];
+		}
+		itr->stail = rld_get_stail(e, itr);
+		if (b == n_blk) { // the last block of e1 has been copied; take its state
+			itr->p = itr->shead + (itr1->p - itr1->shead);
+			itr->q = (uint8_t*)itr->p;
+			itr->r = itr1->r, itr->c = itr1->c, itr->l = itr1->l;
+			rld_destroy(e1);
+			return;
+		}
+		itr->p = itr->stail, itr->q = (uint8_t*)itr->p, itr->r = 0; // the next run goes to a new block
+		itr->c = -1, itr->l = 0, pend_b = -1;
+	}
+	if (itr1->l) rld_enc(e, itr, itr1->l, itr1->c);
+	rld_destroy(e1);
+}
+
 /*****************
  * Save and load *
  *****************/
@@ -319,11 +507,41 @@ rld_t *rld_restore(const char *fn)
 	return e;
 }
 
-rld_t *rld_restore_mmap(const char *fn)
+static uint64_t *rld_mmap_anon(int fd, uint64_t size, int flag, uint64_t *mem_size)
+{ // copy the file to anonymous memory, which can be backed by huge pages
+	uint8_t *mem = (uint8_t*)MAP_FAILED;
+	uint64_t off = 0;
+#ifdef MAP_HUGETLB
+	if (flag & RLD_MMAP_HUGETLB) { // hugetlbfs; requires preallocated pages (vm.nr_hugepages)
+		*mem_size = (size + (1ULL<<21) - 1) >> 21 << 21;
+		mem = (uint8_t*)mmap(0, *mem_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	}
+#endif
+	if (mem == MAP_FAILED) { // transparent huge pages
+		*mem_size = size;
+		mem = (uint8_t*)mmap(0, *mem_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) return 0;
+#ifdef MADV_HUGEPAGE
+		madvise(mem, *mem_size, MADV_HUGEPAGE);
+#endif
+	}
+	while (off < size) {
+		ssize_t l = pread(fd, mem + off, size - off < 1<<30? size - off : 1<<30, off);
+		if (l <= 0) {
+			munmap(mem, *mem_size);
+			return 0;
+		}
+		off += l;
+	}
+	mprotect(mem, *mem_size, PROT_READ);
+	return (uint64_t*)mem;
+}
+
+rld_t *rld_restore_mmap2(const char *fn, int flag)
 {
 	FILE *fp;
 	rld_t *e;
-	int i, from_bre;
+	int i, from_bre, mflag = MAP_PRIVATE;
 	int64_t n_blks;
 
 	e = rld_restore_header(fn, &fp, &from_bre);
@@ -332,7 +550,47 @@ rld_t *rld_restore_mmap(const char *fn)
 	e->n = (e->n_bytes / 8 + RLD_LSIZE - 1) / RLD_LSIZE;
 	e->z = RLD_CALLOC(uint64_t*, e->n);
 	e->fd = open(fn, O_RDONLY);
-	e->mem = (uint64_t*)mmap(0, rld_file_size(e), PROT_READ, MAP_PRIVATE, e->fd, 0);
+	e->mem_size = rld_file_size(e);
+	if (flag & (RLD_MMAP_HUGE|RLD_MMAP_HUGETLB)) {
+		e->mem = rld_mmap_anon(e->fd, rld_file_size(e), flag, &e->mem_size);
+		if (e->mem) close(e->fd), e->fd = -1;
+		else e->mem_size = rld_file_size(e); // fall back to a file-backed mapping
+	}
+	if (e->mem == 0) {
+#ifdef MAP_POPULATE
+		if (flag & RLD_MMAP_POPULATE) mflag |= MAP_POPULATE;
+#endif
+		e->mem = (uint64_t*)mmap(0, e->mem_size, PROT_READ, mflag, e->fd, 0);
+	}
+	for (i = 0; i < e->n; ++i) e->z[i] = e->mem + (4 + e->asize) + (size_t)i * RLD_LSIZE;
+	e->frame = e->mem + (4 + e->asize) + e->n_bytes/8;
+	n_blks = e->n_bytes * 8 / 64 / e->ssize + 1;
+	e->ibits = ilog2(e->mcnt[0] / n_blks) + RLD_IBITS_PLUS;
+	return e;
+}
+
+rld_t *rld_restore_mmap(const char *fn)
+{
+	return rld_restore_mmap2(fn, 0);
+}
+
+rld_t *rld_restore_mem(const uint64_t *mem)
+{ // $mem keeps the content of an RLD\3 file and is not owned by the returned object
+	rld_t *e;
+	int i, x;
+	int64_t n_blks;
+	if (strncmp((const char*)mem, "RLD\3", 4)) return 0;
+	x = ((const int32_t*)mem)[1];
+	e = rld_init(x>>16, x&0xffff);
+	e->n_bytes = mem[2], e->n_frames = mem[3];
+	memcpy(e->mcnt + 1, mem + 4, 8 * e->asize);
+	for (i = 0; i <= e->asize; ++i) e->cnt[i] = e->mcnt[i];
+	for (i = 1; i <= e->asize; ++i) e->cnt[i] += e->cnt[i - 1];
+	e->mcnt[0] = e->cnt[e->asize];
+	free(e->z[0]); free(e->z);
+	e->n = (e->n_bytes / 8 + RLD_LSIZE - 1) / RLD_LSIZE;
+	e->z = RLD_CALLOC(uint64_t*, e->n);
+	e->fd = -1, e->mem = (uint64_t*)mem, e->mem_size = 0;
 	for (i = 0; i < e->n; ++i) e->z[i] = e->mem + (4 + e->asize) + (size_t)i * RLD_LSIZE;
 	e->frame = e->mem + (4 + e->asize) + e->n_bytes/8;
 	n_blks = e->n_bytes * 8 / 64 / e->ssize + 1;
@@ -340,6 +598,11 @@ rld_t *rld_restore_mmap(const char *fn)
 	return e;
 }
 
+uint64_t rld_mem_size(const rld_t *e)
+{
+	return rld_file_size(e);
+}
+
 /******************
  * Computing rank *
  ******************/
@@ -407,6 +670,21 @@ static inline uint64_t rld_locate_blk(const rld_t *e, rlditr_t *itr, uint64_t k,
 	return c + *sum;
 }
 
+int64_t rld_itr_seek(const rld_t *e, rlditr_t *itr, uint64_t k, int *c)
+{ // put $itr in the run containing symbol $k; return the number of symbols from $k to the end of the run; call rld_dec() for the following runs
+	uint64_t z, ok[RLD_MAX_ASIZE];
+	int64_t l;
+	if (k >= e->cnt[e->asize]) return -1;
+	rld_locate_blk(e, itr, k, ok, &z);
+	while (1) {
+		l = rld_dec0(e, itr, c);
+		if (z + l > k) break;
+		z += l;
+	}
+	itr->c = -1, itr->l = 0;
+	return z + l - k;
+}
+
 void rld_rank21(const rld_t *e, uint64_t k, uint64_t l, int c, uint64_t *ok, uint64_t *ol) // FIXME: can be faster
 {
 	*ok = rld_rank11(e, k, c);
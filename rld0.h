@@ -8,6 +8,10 @@
 #include <assert.h>
 #include <stdio.h>
 
+#define RLD_MMAP_POPULATE 0x1 // prefault the file-backed mapping with MAP_POPULATE
+#define RLD_MMAP_HUGE     0x2 // copy to anonymous memory advised with MADV_HUGEPAGE
+#define RLD_MMAP_HUGETLB  0x4 // copy to anonymous hugetlbfs memory; fall back to RLD_MMAP_HUGE
+
 #define RLD_LBITS 23
 #define RLD_LSIZE (1<<RLD_LBITS)
 #define RLD_LMASK (RLD_LSIZE - 1)
@@ -42,8 +46,9 @@ typedef struct __rld_t {
 	uint64_t n_frames;
 	uint64_t *frame;
 	//
-	int fd;
+	int fd; // -1 if mem is anonymous
 	uint64_t *mem; // only used for memory mapped file
+	uint64_t mem_size; // size of mem; 0 if mem is not owned
 } rld_t;
 
 typedef struct {
@@ -60,10 +65,16 @@ extern "C" {
 	int rld_dump(const rld_t *e, const char *fn);
 	rld_t *rld_restore(const char *fn);
 	rld_t *rld_restore_mmap(const char *fn);
+	rld_t *rld_restore_mmap2(const char *fn, int flag); // flag: RLD_MMAP_* above
+	rld_t *rld_restore_mem(const uint64_t *mem); // mem: content of a dumped file; not copied
+	uint64_t rld_mem_size(const rld_t *e); // size of the dumped file
 
 	void rld_itr_init(const rld_t *e, rlditr_t *itr, uint64_t k);
+	int64_t rld_itr_seek(const rld_t *e, rlditr_t *itr, uint64_t k, int *c);
 	int rld_enc(rld_t *e, rlditr_t *itr, int64_t l, uint8_t c);
 	uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr);
+	uint64_t rld_enc_finish_mt(rld_t *e, rlditr_t *itr, int n_threads);
+	void rld_enc_cat(rld_t *e, rlditr_t *itr, rld_t *e1, const rlditr_t *itr1); // append unfinished e1 to e and destroy e1
 
 	uint64_t rld_rank11(const rld_t *e, uint64_t k, int c);
 	int rld_rank1a(const rld_t *e, uint64_t k, uint64_t *ok); // on return, ok[c]=|i<k:B[i]=c|; return B[k]
@@ -82,6 +93,27 @@ extern "C" {
 
 #define rld_block_type(x) ((uint64_t)(x)>>62)
 
+#ifdef __GNUC__
+#define RLD_PREFETCH(p) __builtin_prefetch((p), 0, 1)
+#else
+#define RLD_PREFETCH(p)
+#endif
+
+// prefetch the rank frame covering position $k; call this well before rld_rank*()
+static inline void rld_prefetch_frame(const rld_t *e, uint64_t k)
+{
+	RLD_PREFETCH(e->frame + (k>>e->ibits) * e->asize1);
+}
+
+// prefetch the first small blocks after the frame; the frame should be in cache by now
+static inline void rld_prefetch_blk(const rld_t *e, uint64_t k)
+{
+	const uint64_t *z = e->frame + (k>>e->ibits) * e->asize1, *q;
+	q = e->z[*z>>RLD_LBITS] + (*z&RLD_LMASK);
+	RLD_PREFETCH(q + e->ssize);
+	RLD_PREFETCH(q + 2 * e->ssize);
+}
+
 static inline int64_t rld_dec0(const rld_t *e, rlditr_t *itr, int *c)
 {
 	int w;
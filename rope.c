@@ -52,7 +52,7 @@ static inline void *mp_alloc(mempool_t *mp)
  *** B+ rope ***
  ***************/
 
-rope_t *rope_init(int max_nodes, int block_len)
+static rope_t *rope_init0(int max_nodes, int block_len)
 {
 	rope_t *rope;
 	rope = (rope_t*)calloc(1, sizeof(rope_t));
@@ -61,6 +61,13 @@ rope_t *rope_init(int max_nodes, int block_len)
 	rope->block_len = (block_len + 7) >> 3 << 3;
 	rope->node = mp_init(sizeof(rpnode_t) * rope->max_nodes);
 	rope->leaf = mp_init(rope->block_len);
+	return rope;
+}
+
+rope_t *rope_init(int max_nodes, int block_len)
+{
+	rope_t *rope;
+	rope = rope_init0(max_nodes, block_len);
 	rope->root = (rpnode_t*)mp_alloc((mempool_t*)rope->node);
 	rope->root->n = 1;
 	rope->root->is_bottom = 1;
@@ -75,6 +82,12 @@ void rope_destroy(rope_t *rope)
 	free(rope);
 }
 
+int64_t rope_mem(const rope_t *rope)
+{
+	const mempool_t *n = (const mempool_t*)rope->node, *l = (const mempool_t*)rope->leaf;
+	return (n->top + 1) * n->n_elems * n->size + (l->top + 1) * l->n_elems * l->size;
+}
+
 static inline rpnode_t *split_node(rope_t *rope, rpnode_t *u, rpnode_t *v)
 { // split $v's child. $u is the first node in the bucket. $v and $u are in the same bucket. IMPORTANT: there is always enough room in $u
 	int j, i = v - u;
@@ -147,6 +160,133 @@ int64_t rope_insert_run(rope_t *rope, int64_t x, int a, int64_t rl, rpcache_t *c
 	return z;
 }
 
+void rope_insert_run_cur(rope_t *rope, int64_t x, int a, int64_t rl, rpcur_t *cur)
+{ // like rope_insert_run() but resume the search from the path of the previous insertion
+	int k, n_runs, d;
+	int64_t cnt[6];
+	if (cur->n > 0) { // go up until the parent covers $x
+		for (k = cur->n - 1; k > 0 && x > cur->y[k-1] + cur->v[k-1]->l; --k);
+	} else {
+		k = 0;
+		cur->u[0] = cur->v[0] = rope->root, cur->y[0] = 0;
+		if (rope->root->n == rope->max_nodes) goto fallback;
+	}
+	for (;;) {
+		rpnode_t *p = cur->v[k];
+		int64_t y = cur->y[k];
+		for (; y + p->l < x; ++p) y += p->l; // search forwardly
+		assert(p - cur->u[k] < cur->u[k]->n);
+		cur->v[k] = p, cur->y[k] = y;
+		if (cur->u[k]->is_bottom) break;
+		++k; // descend
+		assert(k < ROPE_MAX_DEPTH);
+		cur->u[k] = cur->v[k] = p->p, cur->y[k] = y;
+		if (p->p->n == rope->max_nodes) goto fallback; // a split is needed
+	}
+	cur->n = d = k + 1;
+	for (k = 0; k < d - 1; ++k)
+		cur->v[k]->c[a] += rl, cur->v[k]->l += rl;
+	rope->c[a] += rl;
+	if (cur->cache.p != (uint8_t*)cur->v[d-1]->p) memset(&cur->cache, 0, sizeof(rpcache_t));
+	n_runs = rle_insert_cached((uint8_t*)cur->v[d-1]->p, x - cur->y[d-1], a, rl, cnt, cur->v[d-1]->c, &cur->cache.beg, cur->cache.bc);
+	cur->cache.p = (uint8_t*)cur->v[d-1]->p;
+	cur->v[d-1]->c[a] += rl, cur->v[d-1]->l += rl;
+	if (n_runs + RLE_MIN_SPACE > rope->block_len) {
+		split_node(rope, cur->u[d-1], cur->v[d-1]);
+		memset(cur, 0, sizeof(rpcur_t));
+	}
+	return;
+fallback: // splitting changes the path; descend from the root
+	cur->n = 0;
+	rope_insert_run(rope, x, a, rl, &cur->cache);
+}
+
+/*********************
+ *** Bulk building ***
+ *********************/
+
+static inline rpnode_t *rope_bulk_new(rope_t *rope, int is_bottom)
+{
+	rpnode_t *u;
+	u = (rpnode_t*)mp_alloc((mempool_t*)rope->node);
+	u->is_bottom = is_bottom, u->n = 0;
+	return u;
+}
+
+static void rope_bulk_add(rope_t *rope, rpnode_t **bkt, int *n_lv, int lv, void *p, const int64_t c[6], int max_n)
+{ // add $p to the bucket at level $lv, where level 0 is the bottom
+	rpnode_t *u;
+	int a, i;
+	assert(lv < ROPE_MAX_DEPTH);
+	if (lv == *n_lv) bkt[(*n_lv)++] = rope_bulk_new(rope, lv == 0);
+	u = bkt[lv];
+	if (u->n == max_n) { // the bucket is full; add it to the upper level
+		int64_t uc[6];
+		memset(uc, 0, 48);
+		for (i = 0; i < u->n; ++i)
+			for (a = 0; a < 6; ++a) uc[a] += u[i].c[a];
+		rope_bulk_add(rope, bkt, n_lv, lv + 1, u, uc, max_n);
+		u = bkt[lv] = rope_bulk_new(rope, lv == 0);
+	}
+	u[u->n].p = (rpnode_t*)p;
+	memcpy(u[u->n].c, c, 48);
+	for (a = 0, u[u->n].l = 0; a < 6; ++a) u[u->n].l += c[a];
+	++u->n;
+}
+
+rope_t *rope_build_from_runs(int max_nodes, int block_len, double fill, rope_run_f next, void *data)
+{
+	rope_t *rope;
+	rpnode_t *bkt[ROPE_MAX_DEPTH];
+	int a, i, c = -1, c1, n_lv = 0, max_n, max_leaf, n_bytes = 0;
+	int64_t l = 0, l1, cnt[6];
+	uint8_t *leaf;
+
+	rope = rope_init0(max_nodes, block_len);
+	if (fill <= 0.0 || fill > 1.0) fill = ROPE_DEF_FILL;
+	max_n = (int)(rope->max_nodes * fill + .499);
+	max_n = max_n < 2? 2 : max_n > rope->max_nodes? rope->max_nodes : max_n;
+	max_leaf = (int)((rope->block_len - RLE_MIN_SPACE) * fill + .499);
+	if (max_leaf < 8) max_leaf = 8;
+	leaf = (uint8_t*)mp_alloc((mempool_t*)rope->leaf);
+	memset(cnt, 0, 48);
+	do { // merge adjacent runs of the same symbol and write them to leaves
+		l1 = next(data, &c1);
+		if (l1 > 0 && c1 == c) {
+			l += l1;
+			continue;
+		}
+		if (l > 0) {
+			uint8_t tmp[8];
+			int k;
+			k = rle_enc1(tmp, c, l);
+			if (n_bytes + k > max_leaf) { // start a new leaf
+				*rle_nptr(leaf) = n_bytes;
+				rope_bulk_add(rope, bkt, &n_lv, 0, leaf, cnt, max_n);
+				leaf = (uint8_t*)mp_alloc((mempool_t*)rope->leaf);
+				memset(cnt, 0, 48);
+				n_bytes = 0;
+			}
+			memcpy(leaf + 2 + n_bytes, tmp, k);
+			n_bytes += k, cnt[c] += l, rope->c[c] += l;
+		}
+		c = c1, l = l1;
+	} while (l1 > 0);
+	*rle_nptr(leaf) = n_bytes;
+	rope_bulk_add(rope, bkt, &n_lv, 0, leaf, cnt, max_n);
+	for (i = 0; i < n_lv - 1; ++i) { // add partial buckets to upper levels; n_lv may increase
+		int64_t uc[6];
+		rpnode_t *u = bkt[i];
+		int j;
+		memset(uc, 0, 48);
+		for (j = 0; j < u->n; ++j)
+			for (a = 0; a < 6; ++a) uc[a] += u[j].c[a];
+		rope_bulk_add(rope, bkt, &n_lv, i + 1, u, uc, max_n);
+	}
+	rope->root = bkt[n_lv - 1];
+	return rope;
+}
+
 static rpnode_t *rope_count_to_leaf(const rope_t *rope, int64_t x, int64_t cx[6], int64_t *rest)
 {
 	rpnode_t *u, *v = 0, *p = rope->root;
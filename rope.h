@@ -7,6 +7,7 @@
 #define ROPE_MAX_DEPTH 80
 #define ROPE_DEF_MAX_NODES 64
 #define ROPE_DEF_BLOCK_LEN 512
+#define ROPE_DEF_FILL      0.75 // fill factor of leaves and internal nodes in rope_build_from_runs()
 
 typedef struct rpnode_s {
 	struct rpnode_s *p; // child; at the bottom level, $p points to a string with the first 2 bytes giving the number of runs (#runs)
@@ -28,19 +29,31 @@ typedef struct {
 	int d; // the current depth in the B+-tree
 } rpitr_t;
 
+typedef int64_t (*rope_run_f)(void *data, int *c); // return the length of the next run and set *c; return 0 at the end
+
 typedef struct {
 	int beg;
 	int64_t bc[6];
 	uint8_t *p;
 } rpcache_t;
 
+typedef struct { // finger for inserting at non-decreasing positions
+	int n; // number of levels on the path; 0 if the path is invalid
+	rpnode_t *u[ROPE_MAX_DEPTH], *v[ROPE_MAX_DEPTH]; // first node in the bucket and the node on the path at each level
+	int64_t y[ROPE_MAX_DEPTH]; // number of symbols before $v[] in the rope
+	rpcache_t cache;
+} rpcur_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 	rope_t *rope_init(int max_nodes, int block_len);
 	void rope_destroy(rope_t *rope);
+	int64_t rope_mem(const rope_t *rope); // bytes allocated in memory pools
 	int64_t rope_insert_run(rope_t *rope, int64_t x, int a, int64_t rl, rpcache_t *cache);
+	void rope_insert_run_cur(rope_t *rope, int64_t x, int a, int64_t rl, rpcur_t *cur); // $x must not decrease between calls; zero $cur before the first call
+	rope_t *rope_build_from_runs(int max_nodes, int block_len, double fill, rope_run_f next, void *data); // build bottom-up; fill: fraction of leaves/nodes to fill
 	int rope_rank2a(const rope_t *rope, int64_t x, int64_t y, int64_t *cx, int64_t *cy);
 	#define rope_rank1a(rope, x, cx) rope_rank2a(rope, x, -1, cx, 0)
 
@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "rb3priv.h"
+#include "fm-index.h"
 #include "libsais.h"
 #include "libsais64.h"
 
@@ -54,3 +56,48 @@ void rb3_build_sais(int64_t n_seq, int64_t len, char *seq, int n_threads)
 	else
 		rb3_build_sais32(n_seq, len, seq, n_threads);
 }
+
+typedef struct {
+	int32_t lv; // merged from 1<<lv blocks
+	rld_t *e;
+} saisblk_t;
+
+void rb3_build_sais_blk(int64_t n_seq, int64_t len, char *seq, int64_t blk_size, int n_threads)
+{ // construct BWT for blocks of complete sequences and merge them, so that SA is only allocated for one block
+	int64_t beg, end, i, k, n = 0, m = 0;
+	saisblk_t *a = 0;
+	rlditr_t itr;
+	rld_t *e;
+	int c;
+
+	if (blk_size <= 0 || len <= blk_size) {
+		rb3_build_sais(n_seq, len, seq, n_threads);
+		return;
+	}
+	for (beg = 0; beg < len; beg = end) {
+		rb3_fmi_t fa, fb;
+		int64_t ns = 0;
+		for (end = beg; end < len; ++end) // find the end of the block
+			if (seq[end] == 0 && (++ns, end + 1 - beg >= blk_size))
+				break;
+		end = end < len? end + 1 : len;
+		rb3_build_sais(ns, end - beg, seq + beg, n_threads);
+		RB3_GROW(saisblk_t, a, n, m);
+		a[n].lv = 0, a[n++].e = rb3_enc_plain2rld(end - beg, (uint8_t*)seq + beg, 3);
+		while (n >= 2 && (end == len || a[n-2].lv == a[n-1].lv)) { // merge blocks like a binary counter; merge all at the end
+			rb3_fmi_init(&fa, a[n-2].e, 0);
+			rb3_fmi_init(&fb, a[n-1].e, 0);
+			a[n-2].e = rb3_fmi_merge_fmd(&fa, &fb, n_threads, 1);
+			rb3_fmi_free(&fa);
+			++a[n-2].lv, --n;
+		}
+		if (rb3_verbose >= 3) fprintf(stderr, "[M::%s::%.3f*%.2f] processed %ld symbols in blocks\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)end);
+	}
+	e = a[0].e;
+	free(a);
+	rld_itr_init(e, &itr, 0);
+	for (k = 0; (i = rld_dec(e, &itr, &c, 1)) > 0; k += i) // write the merged BWT back to $seq
+		memset(seq + k, c, i);
+	assert(k == len);
+	rld_destroy(e);
+}
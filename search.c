@@ -5,6 +5,7 @@
 #include "ketopt.h"
 #include "kthread.h"
 #include "kalloc.h"
+#include <pthread.h>
 
 typedef enum { RB3_SA_MEM_TG, RB3_SA_MEM_ORI, RB3_SA_SW, RB3_SA_HAPDIV } rb3_search_algo_t;
 
@@ -14,6 +15,9 @@ typedef enum { RB3_SA_MEM_TG, RB3_SA_MEM_ORI, RB3_SA_SW, RB3_SA_HAPDIV } rb3_sea
 #define RB3_MF_WRITE_ALL   0x8
 #define RB3_MF_BOTH_DIR    0x10
 
+#define RB3_MEM_BATCH 16 // number of queries interleaved by one thread with the TG algorithm
+#define RB3_OUT_CHUNK 0x400000 // write output in chunks of this size
+
 typedef struct {
 	uint32_t flag;
 	int32_t n_threads, min_gap_len, hapdiv_k, hapdiv_w;
@@ -21,6 +25,7 @@ typedef struct {
 	rb3_search_algo_t algo;
 	int64_t min_occ, min_len, max_all_out;
 	int64_t batch_size;
+	int64_t km_trim; // max kalloc capacity kept between batches; 0 for no limit
 	rb3_swopt_t swo;
 } rb3_mopt_t;
 
@@ -38,10 +43,13 @@ void rb3_mopt_init(rb3_mopt_t *opt)
 }
 
 typedef struct mp_tbuf_s {
-	void *km;
+	void *km; // scratch; reset after each batch
+	void *km_out; // MEMs, gaps and positions kept until output; owned by the current batch
 	int32_t n_gap, m_gap;
 	uint64_t *gap;
+	kstring_t str; // for formatting
 	rb3_sai_v mem; // this is allocated from km
+	rb3_sai_v *mems; // of size RB3_MEM_BATCH; for the interleaved TG algorithm
 } m_tbuf_t;
 
 typedef struct {
@@ -57,13 +65,22 @@ typedef struct {
 	int32_t len, n_mem, n_gap;
 	uint64_t *gap;
 	m_sai_pos_t *mem;
+	int64_t l_out;
+	char *out; // formatted output
 } m_seq_t;
 
 typedef struct {
 	const rb3_mopt_t *opt;
 	int64_t id;
+	int32_t is_mmap; // names and sequences point into the mapped input
 	rb3_fmi_t fmi;
 	rb3_seqio_t *fp;
+	m_tbuf_t *buf; // per-thread buffers; persistent across batches and input files
+	int32_t n_pool, m_pool;
+	void **pool; // reset arenas for batch outputs
+	size_t km_peak; // high-water mark of a single arena
+	kstring_t out; // output buffer; only used by step 2
+	pthread_mutex_t lock; // for pool and km_peak
 } pipeline_t;
 
 typedef struct {
@@ -73,19 +90,79 @@ typedef struct {
 
 typedef struct {
 	const pipeline_t *p;
+	void *km; // names and sequences of the batch
 	int32_t n_seq, n_hapdiv;
 	m_seq_t *seq;
 	rb3_swrst_t *rst, *rst_rev;
 	m_hapdiv_t *hapdiv;
-	m_tbuf_t *buf;
+	void **km_out; // one output arena per thread
 } step_t;
 
+static void mem_post(const pipeline_t *p, m_seq_t *s, m_tbuf_t *b, const rb3_sai_v *mem)
+{ // copy MEMs to s and find gaps or positions
+	int32_t i;
+	s->n_mem = mem->n;
+	s->mem = Kcalloc(b->km_out, m_sai_pos_t, s->n_mem);
+	for (i = 0; i < s->n_mem; ++i)
+		s->mem[i].mem = mem->a[i];
+	if (p->opt->min_gap_len > 0) { // find gaps not covered by MEMs
+		int32_t last = 0;
+		b->n_gap = 0;
+		Kgrow(b->km, uint64_t, b->gap, mem->n + 1, b->m_gap);
+		for (i = 0; i < mem->n; ++i) {
+			int32_t st = mem->a[i].info>>32, en = (int32_t)mem->a[i].info;
+			if (st > last) {
+				if (st - last >= p->opt->min_gap_len)
+					b->gap[b->n_gap++] = (uint64_t)last<<32 | st;
+				last = en;
+			} else last = last > en? last : en;
+		}
+		if (s->len - last >= p->opt->min_gap_len)
+			b->gap[b->n_gap++] = (uint64_t)last<<32 | s->len;
+		s->n_gap = b->n_gap;
+		s->gap = Kmalloc(b->km_out, uint64_t, s->n_gap);
+		memcpy(s->gap, b->gap, s->n_gap * 8);
+	} else if (p->opt->max_pos > 0) {
+		#if 1 // faster algorithm
+		rb3_pos_t *pos;
+		pos = Kmalloc(b->km, rb3_pos_t, p->opt->max_pos);
+		for (i = 0; i < s->n_mem; ++i) {
+			m_sai_pos_t *q = &s->mem[i];
+			int32_t st = q->mem.info>>32, en = (int32_t)q->mem.info;
+			q->n_pos = rb3_locate(b->km, &p->fmi, q->mem.x[0], q->mem.x[0] + q->mem.size, en - st, &s->seq[st], p->opt->max_pos, pos);
+			q->pos = Kmalloc(b->km_out, rb3_pos_t, q->n_pos);
+			memcpy(q->pos, pos, sizeof(rb3_pos_t) * q->n_pos);
+		}
+		kfree(b->km, pos);
+		#else // naive algorithm
+		for (i = 0; i < s->n_mem; ++i) {
+			m_sai_pos_t *q = &s->mem[i];
+			int32_t j;
+			q->n_pos = q->mem.size < p->opt->max_pos? q->mem.size : p->opt->max_pos;
+			q->pos = Kmalloc(b->km_out, rb3_pos_t, q->n_pos);
+			for (j = 0; j < q->n_pos; ++j)
+				q->pos[j].pos = rb3_ssa(&p->fmi, p->fmi.ssa, q->mem.x[0] + j, &q->pos[j].sid);
+		}
+		#endif
+	}
+}
+
+static inline char *km_strndup(void *km, const char *s, int64_t l)
+{
+	char *t = Kmalloc(km, char, l + 1);
+	memcpy(t, s, l);
+	t[l] = 0;
+	return t;
+}
+
+static void format_per_seq(const pipeline_t *p, step_t *t, int32_t j, m_tbuf_t *b);
+
 static void worker_for_seq(void *data, long i, int tid)
 {
 	step_t *t = (step_t*)data;
 	const pipeline_t *p = t->p;
 	m_seq_t *s = &t->seq[i];
-	m_tbuf_t *b = &t->buf[tid];
+	m_tbuf_t *b = &p->buf[tid];
 	if (rb3_dbg_flag & RB3_DBG_QNAME)
 		fprintf(stderr, "Q\t%s\t%d\n", s->name, tid);
 	rb3_char2nt6(s->len, s->seq);
@@ -97,55 +174,36 @@ static void worker_for_seq(void *data, long i, int tid)
 			rb3_revcomp6(s->len, s->seq);
 		}
 	} else { // MEM algorithms
-		int32_t i;
 		b->mem.n = 0;
 		if (p->opt->algo == RB3_SA_MEM_TG)
 			rb3_fmd_smem_TG(b->km, &p->fmi, s->len, s->seq, &b->mem, p->opt->min_occ, p->opt->min_len);
 		else if (p->opt->algo == RB3_SA_MEM_ORI)
 			rb3_fmd_smem(b->km, &p->fmi, s->len, s->seq, &b->mem, p->opt->min_occ, p->opt->min_len);
-		s->n_mem = b->mem.n;
-		s->mem = RB3_CALLOC(m_sai_pos_t, s->n_mem);
-		for (i = 0; i < s->n_mem; ++i)
-			s->mem[i].mem = b->mem.a[i];
-		if (p->opt->min_gap_len > 0) { // find gaps not covered by MEMs
-			int32_t last = 0;
-			b->n_gap = 0;
-			Kgrow(b->km, uint64_t, b->gap, b->mem.n + 1, b->m_gap);
-			for (i = 0; i < b->mem.n; ++i) {
-				int32_t st = b->mem.a[i].info>>32, en = (int32_t)b->mem.a[i].info;
-				if (st > last) {
-					if (st - last >= p->opt->min_gap_len)
-						b->gap[b->n_gap++] = (uint64_t)last<<32 | st;
-					last = en;
-				} else last = last > en? last : en;
-			}
-			if (s->len - last >= p->opt->min_gap_len)
-				b->gap[b->n_gap++] = (uint64_t)last<<32 | s->len;
-			s->n_gap = b->n_gap;
-			s->gap = RB3_MALLOC(uint64_t, s->n_gap);
-			memcpy(s->gap, b->gap, s->n_gap * 8);
-		} else if (p->opt->max_pos > 0) {
-			#if 1 // faster algorithm
-			rb3_pos_t *pos;
-			pos = Kmalloc(b->km, rb3_pos_t, p->opt->max_pos);
-			for (i = 0; i < s->n_mem; ++i) {
-				m_sai_pos_t *q = &s->mem[i];
-				q->n_pos = rb3_ssa_multi(b->km, &p->fmi, p->fmi.ssa, q->mem.x[0], q->mem.x[0] + q->mem.size, p->opt->max_pos, pos);
-				q->pos = RB3_MALLOC(rb3_pos_t, q->n_pos);
-				memcpy(q->pos, pos, sizeof(rb3_pos_t) * q->n_pos);
-			}
-			kfree(b->km, pos);
-			#else // naive algorithm
-			for (i = 0; i < s->n_mem; ++i) {
-				m_sai_pos_t *q = &s->mem[i];
-				int32_t j;
-				q->n_pos = q->mem.size < p->opt->max_pos? q->mem.size : p->opt->max_pos;
-				q->pos = RB3_MALLOC(rb3_pos_t, q->n_pos);
-				for (j = 0; j < q->n_pos; ++j)
-					q->pos[j].pos = rb3_ssa(&p->fmi, p->fmi.ssa, q->mem.x[0] + j, &q->pos[j].sid);
-			}
-			#endif
-		}
+		mem_post(p, s, b, &b->mem);
+	}
+	format_per_seq(p, t, i, b);
+}
+
+static void worker_for_mem_batch(void *data, long i, int tid) // interleave RB3_MEM_BATCH queries with the TG algorithm
+{
+	step_t *t = (step_t*)data;
+	const pipeline_t *p = t->p;
+	m_tbuf_t *b = &p->buf[tid];
+	int32_t j, st = i * RB3_MEM_BATCH, n = t->n_seq - st < RB3_MEM_BATCH? t->n_seq - st : RB3_MEM_BATCH;
+	int64_t len[RB3_MEM_BATCH];
+	const uint8_t *q[RB3_MEM_BATCH];
+	if (b->mems == 0) b->mems = Kcalloc(b->km, rb3_sai_v, RB3_MEM_BATCH);
+	for (j = 0; j < n; ++j) {
+		m_seq_t *s = &t->seq[st + j];
+		if (rb3_dbg_flag & RB3_DBG_QNAME)
+			fprintf(stderr, "Q\t%s\t%d\n", s->name, tid);
+		rb3_char2nt6(s->len, s->seq);
+		len[j] = s->len, q[j] = s->seq;
+	}
+	rb3_fmd_smem_TG_multi(b->km, &p->fmi, n, len, q, b->mems, p->opt->min_occ, p->opt->min_len, RB3_MEM_BATCH);
+	for (j = 0; j < n; ++j) {
+		mem_post(p, &t->seq[st + j], b, &b->mems[j]);
+		format_per_seq(p, t, st + j, b);
 	}
 }
 
@@ -154,7 +212,7 @@ static void worker_for_hapdiv(void *data, long i, int tid)
 	step_t *t = (step_t*)data;
 	const pipeline_t *p = t->p;
 	m_hapdiv_t *a = &t->hapdiv[i];
-	rb3_hapdiv(t->buf[tid].km, &p->opt->swo, &p->fmi, p->opt->hapdiv_k, &t->seq[a->id].seq[a->offset], &a->r);
+	rb3_hapdiv(p->buf[tid].km, &p->opt->swo, &p->fmi, p->opt->hapdiv_k, &t->seq[a->id].seq[a->offset], &a->r);
 }
 
 static inline void write_name(kstring_t *out, const m_seq_t *s)
@@ -237,89 +295,101 @@ static void write_all_hits(kstring_t *out, const m_seq_t *s, const rb3_swrst_t *
 	rb3_sprintf_lite(out, "//\n");
 }
 
-static void write_per_seq(step_t *t)
-{
-	const pipeline_t *p = t->p;
-	int32_t i, j;
-	kstring_t out = {0,0,0};
-	for (j = 0; j < t->n_seq; ++j) {
-		m_seq_t *s = &t->seq[j];
-		free(s->seq);
-		out.l = 0;
-		if (p->opt->algo == RB3_SA_SW && (p->opt->flag & RB3_MF_WRITE_ALL)) { // write all hits in a compact format
-			write_all_hits(&out, s, &t->rst[j], '+', p->opt->max_all_out);
-			rb3_swrst_free(&t->rst[j]);
-			if (t->rst_rev) {
-				write_all_hits(&out, s, &t->rst_rev[j], '-', p->opt->max_all_out);
-				rb3_swrst_free(&t->rst_rev[j]);
-			}
-			fputs(out.s, stdout);
-		} else if (p->opt->algo == RB3_SA_SW) { // write PAF
-			rb3_swrst_t *r = &t->rst[j];
-			if (r->n > 0) { // mapped
-				for (i = 0; i < r->n; ++i) {
-					out.l = 0;
-					write_paf(&out, &p->fmi, &r->a[i], s);
-					fputs(out.s, stdout);
+static void format_per_seq(const pipeline_t *p, step_t *t, int32_t j, m_tbuf_t *b)
+{ // called by workers; the formatted text is kept in the output arena until step 2
+	int32_t i, no_km = !!(p->opt->flag & RB3_MF_NO_KALLOC); // with arenas, query records are released with the batch
+	kstring_t *out = &b->str;
+	m_seq_t *s = &t->seq[j];
+	out->l = 0;
+	if (p->opt->algo == RB3_SA_SW && (p->opt->flag & RB3_MF_WRITE_ALL)) { // write all hits in a compact format
+		write_all_hits(out, s, &t->rst[j], '+', p->opt->max_all_out);
+		rb3_swrst_free(&t->rst[j]);
+		if (t->rst_rev) {
+			write_all_hits(out, s, &t->rst_rev[j], '-', p->opt->max_all_out);
+			rb3_swrst_free(&t->rst_rev[j]);
+		}
+	} else if (p->opt->algo == RB3_SA_SW) { // write PAF
+		rb3_swrst_t *r = &t->rst[j];
+		if (r->n > 0) { // mapped
+			for (i = 0; i < r->n; ++i)
+				write_paf(out, &p->fmi, &r->a[i], s);
+		} else if (p->opt->flag & RB3_MF_WRITE_UNMAP) { // unmapped
+			write_name(out, s);
+			rb3_sprintf_lite(out, "\t%d\t*\t*\t*\t*\t*\t*\t*\t0\t0\t0\n", s->len);
+		}
+		rb3_swrst_free(r);
+		if (t->rst_rev) rb3_swrst_free(&t->rst_rev[j]); // not written in PAF
+	} else if (p->opt->min_gap_len > 0) { // output regions not covered by long MEMs
+		for (i = 0; i < s->n_gap; ++i) {
+			int32_t st = s->gap[i]>>32, en = (int32_t)s->gap[i];
+			write_name(out, s);
+			rb3_sprintf_lite(out, "\t%d\t%d\t%d\n", st, en, s->len);
+		}
+	} else if (p->opt->flag & RB3_MF_WRITE_COV) { // output breadth of coverage
+		int32_t st0 = 0, en0 = 0, cov = 0;
+		for (i = 0; i < s->n_mem; ++i) {
+			rb3_sai_t *q = &s->mem[i].mem;
+			int32_t st = q->info>>32, en = (int32_t)q->info;
+			if (st > en0) {
+				cov += en0 - st0;
+				st0 = st, en0 = en;
+			} else en0 = en0 > en? en0 : en;
+		}
+		cov += en0 - st0;
+		if (cov > 0) {
+			write_name(out, s);
+			rb3_sprintf_lite(out, "\t%d\t%d\n", s->len, cov);
+		}
+	} else { // output long MEMs
+		const rb3_fmi_t *f = &p->fmi;
+		for (i = 0; i < s->n_mem; ++i) {
+			m_sai_pos_t *r = &s->mem[i];
+			rb3_sai_t *q = &r->mem;
+			int32_t st = q->info>>32, en = (int32_t)q->info;
+			write_name(out, s);
+			rb3_sprintf_lite(out, "\t%d\t%d\t%ld", st, en, (long)q->size);
+			if (r->n_pos > 0) {
+				int32_t j;
+				rb3_sprintf_lite(out, "\t%ld", r->n_pos);
+				for (j = 0; j < r->n_pos; ++j) {
+					rb3_pos_t *t = &r->pos[j];
+					int64_t rlen = f->sid->len[t->sid>>1], pos;
+					pos = t->sid&1? rlen - (t->pos + (en - st)) : t->pos;
+					rb3_sprintf_lite(out, "\t%s:%c:%ld", f->sid->name[t->sid>>1], "+-"[t->sid&1], pos);
 				}
-			} else if (p->opt->flag & RB3_MF_WRITE_UNMAP) { // unmapped
-				write_name(&out, s);
-				rb3_sprintf_lite(&out, "\t%d\t*\t*\t*\t*\t*\t*\t*\t0\t0\t0\n", s->len);
-				fputs(out.s, stdout);
-			}
-			rb3_swrst_free(r);
-		} else if (p->opt->min_gap_len > 0) { // output regions not covered by long MEMs
-			for (i = 0; i < s->n_gap; ++i) {
-				int32_t st = s->gap[i]>>32, en = (int32_t)s->gap[i];
-				out.l = 0;
-				write_name(&out, s);
-				rb3_sprintf_lite(&out, "\t%d\t%d\t%d\n", st, en, s->len);
-				fputs(out.s, stdout);
+				if (no_km) free(r->pos);
 			}
-		} else if (p->opt->flag & RB3_MF_WRITE_COV) { // output breadth of coverage
-			int32_t st0 = 0, en0 = 0, cov = 0;
-			for (i = 0; i < s->n_mem; ++i) {
-				rb3_sai_t *q = &s->mem[i].mem;
-				int32_t st = q->info>>32, en = (int32_t)q->info;
-				if (st > en0) {
-					cov += en0 - st0;
-					st0 = st, en0 = en;
-				} else en0 = en0 > en? en0 : en;
-			}
-			cov += en0 - st0;
-			if (cov > 0) {
-				out.l = 0;
-				write_name(&out, s);
-				rb3_sprintf_lite(&out, "\t%d\t%d\n", s->len, cov);
-				fputs(out.s, stdout);
-			}
-		} else { // output long MEMs
-			const rb3_fmi_t *f = &p->fmi;
-			for (i = 0; i < s->n_mem; ++i) {
-				m_sai_pos_t *r = &s->mem[i];
-				rb3_sai_t *q = &r->mem;
-				int32_t st = q->info>>32, en = (int32_t)q->info;
-				out.l = 0;
-				write_name(&out, s);
-				rb3_sprintf_lite(&out, "\t%d\t%d\t%ld", st, en, (long)q->size);
-				if (r->n_pos > 0) {
-					int32_t j;
-					rb3_sprintf_lite(&out, "\t%ld", r->n_pos);
-					for (j = 0; j < r->n_pos; ++j) {
-						rb3_pos_t *t = &r->pos[j];
-						int64_t rlen = f->sid->len[t->sid>>1], pos;
-						pos = t->sid&1? rlen - (t->pos + (en - st)) : t->pos;
-						rb3_sprintf_lite(&out, "\t%s:%c:%ld", f->sid->name[t->sid>>1], "+-"[t->sid&1], pos);
-					}
-					free(r->pos);
-				}
-				rb3_sprintf_lite(&out, "\n");
-				fputs(out.s, stdout);
+			rb3_sprintf_lite(out, "\n");
+		}
+	}
+	if (no_km) {
+		free(s->mem); free(s->gap);
+	}
+	s->l_out = out->l;
+	s->out = out->l > 0? km_strndup(b->km_out, out->s, out->l) : 0;
+}
+
+static void write_per_seq(pipeline_t *p, step_t *t)
+{ // concatenate formatted outputs and write them in large chunks
+	int32_t j, no_km = !!(p->opt->flag & RB3_MF_NO_KALLOC);
+	for (j = 0; j < t->n_seq; ++j) {
+		m_seq_t *s = &t->seq[j];
+		if (s->l_out > 0) {
+			RB3_GROW(char, p->out.s, p->out.l + s->l_out, p->out.m);
+			memcpy(p->out.s + p->out.l, s->out, s->l_out);
+			p->out.l += s->l_out;
+			if (p->out.l >= RB3_OUT_CHUNK) {
+				fwrite(p->out.s, 1, p->out.l, stdout);
+				p->out.l = 0;
 			}
 		}
-		free(s->name); free(s->mem); free(s->gap);
+		if (no_km) {
+			if (!p->is_mmap) free(s->name), free(s->seq);
+			free(s->out);
+		}
 	}
-	free(out.s);
+	if (p->out.l > 0) fwrite(p->out.s, 1, p->out.l, stdout);
+	p->out.l = 0;
 	free(t->rst);
 	free(t->rst_rev);
 }
@@ -329,8 +399,9 @@ static void write_hapdiv(step_t *t)
 	int32_t j, ed;
 	const m_hapdiv_t *p;
 	kstring_t out = {0,0,0};
-	for (j = 0; j < t->n_seq; ++j)
-		free(t->seq[j].seq);
+	if (t->km == 0 && !t->p->is_mmap)
+		for (j = 0; j < t->n_seq; ++j)
+			free(t->seq[j].seq);
 	if (t->n_hapdiv == 0) return;
 	p = &t->hapdiv[0];
 	for (j = 1; j <= t->n_hapdiv; ++j) {
@@ -346,12 +417,66 @@ static void write_hapdiv(step_t *t)
 			p = q;
 		}
 	}
-	for (j = 0; j < t->n_seq; ++j)
-		free(t->seq[j].name);
+	if (t->km == 0 && !t->p->is_mmap)
+		for (j = 0; j < t->n_seq; ++j)
+			free(t->seq[j].name);
 	free(out.s);
 	free(t->hapdiv);
 }
 
+static void *m_km_get(pipeline_t *p)
+{ // take a reset arena from the pool
+	void *km;
+	if (p->opt->flag & RB3_MF_NO_KALLOC) return 0;
+	pthread_mutex_lock(&p->lock);
+	km = p->n_pool > 0? p->pool[--p->n_pool] : 0;
+	pthread_mutex_unlock(&p->lock);
+	return km? km : km_init();
+}
+
+static void m_km_peak(pipeline_t *p, const void *km)
+{
+	km_stat_t st;
+	km_stat(km, &st);
+	pthread_mutex_lock(&p->lock);
+	if (st.capacity > p->km_peak) p->km_peak = st.capacity;
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void m_km_put(pipeline_t *p, void *km)
+{ // reset an arena and return it to the pool
+	if (km == 0) return;
+	m_km_peak(p, km);
+	km_reset(km, p->opt->km_trim);
+	pthread_mutex_lock(&p->lock);
+	RB3_GROW(void*, p->pool, p->n_pool, p->m_pool);
+	p->pool[p->n_pool++] = km;
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void m_tbuf_reset(pipeline_t *p, m_tbuf_t *b)
+{ // scratch buffers live in b->km and go away with km_reset(); without kalloc, they are kept
+	if (b->km == 0) return;
+	m_km_peak(p, b->km);
+	km_reset(b->km, p->opt->km_trim);
+	memset(&b->mem, 0, sizeof(b->mem));
+	b->mems = 0, b->gap = 0, b->n_gap = b->m_gap = 0;
+}
+
+static void m_tbuf_destroy(m_tbuf_t *b)
+{
+	kfree(b->km, b->mem.a);
+	kfree(b->km, b->gap);
+	if (b->mems) {
+		int32_t j;
+		for (j = 0; j < RB3_MEM_BATCH; ++j)
+			kfree(b->km, b->mems[j].a);
+		kfree(b->km, b->mems);
+	}
+	km_destroy(b->km);
+	free(b->str.s);
+}
+
 static void *worker_pipeline(void *shared, int step, void *in)
 {
 	pipeline_t *p = (pipeline_t*)shared;
@@ -363,15 +488,17 @@ static void *worker_pipeline(void *shared, int step, void *in)
 		int64_t len, tot = 0;
 		int32_t n_seq = 0, m_seq = 0;
 		m_seq_t *seq = 0;
+		void *km = p->is_mmap? 0 : m_km_get(p);
 		while ((ss = rb3_seq_read1(p->fp, &len, &name)) != 0) { // read sequences
 			m_seq_t *s;
 			RB3_GROW0(m_seq_t, seq, n_seq, m_seq);
 			s = &seq[n_seq++];
-			s->name = name? rb3_strdup(name) : 0;
-			s->seq = (uint8_t*)rb3_strdup(ss);
+			if (p->is_mmap) s->name = (char*)name, s->seq = (uint8_t*)ss; // spans stay valid until rb3_seq_close()
+			else s->name = name? km_strndup(km, name, strlen(name)) : 0, s->seq = (uint8_t*)km_strndup(km, ss, len);
 			s->len = len;
 			s->id = p->id++;
 			s->mem = 0, s->n_mem = 0;
+			s->out = 0, s->l_out = 0;
 			tot += len;
 			if (tot >= p->opt->batch_size)
 				break;
@@ -379,6 +506,7 @@ static void *worker_pipeline(void *shared, int step, void *in)
 		if (n_seq > 0) { // construct a step_t object
 			t = RB3_CALLOC(step_t, 1);
 			t->p = p;
+			t->km = km;
 			t->seq = seq;
 			t->n_seq = n_seq;
 			if (p->opt->algo == RB3_SA_HAPDIV) { // the hapdiv mode
@@ -396,27 +524,35 @@ static void *worker_pipeline(void *shared, int step, void *in)
 				if (p->opt->flag & RB3_MF_BOTH_DIR)
 					t->rst_rev = RB3_CALLOC(rb3_swrst_t, n_seq);
 			}
-			t->buf = RB3_CALLOC(m_tbuf_t, p->opt->n_threads);
+			t->km_out = RB3_CALLOC(void*, p->opt->n_threads);
 			for (i = 0; i < p->opt->n_threads; ++i)
-				t->buf[i].km = p->opt->flag & RB3_MF_NO_KALLOC? 0 : km_init();
+				t->km_out[i] = m_km_get(p);
 			return t;
 		}
-	} else if (step == 1) {
+		m_km_put(p, km);
+	} else if (step == 1) { // step 1 is not run concurrently, so p->buf can be shared by batches
+		for (i = 0; i < p->opt->n_threads; ++i)
+			p->buf[i].km_out = t->km_out[i];
 		if (p->opt->algo == RB3_SA_HAPDIV)
 			kt_for(p->opt->n_threads, worker_for_hapdiv, in, t->n_hapdiv);
+		else if (p->opt->algo == RB3_SA_MEM_TG)
+			kt_for(p->opt->n_threads, worker_for_mem_batch, in, (t->n_seq + RB3_MEM_BATCH - 1) / RB3_MEM_BATCH);
 		else
 			kt_for(p->opt->n_threads, worker_for_seq, in, t->n_seq);
+		for (i = 0; i < p->opt->n_threads; ++i)
+			m_tbuf_reset(p, &p->buf[i]);
 		return in;
 	} else if (step == 2) {
-		for (i = 0; i < p->opt->n_threads; ++i) {
-			kfree(t->buf[i].km, t->buf[i].mem.a);
-			km_destroy(t->buf[i].km);
-		}
-		free(t->buf);
 		if (p->opt->algo == RB3_SA_HAPDIV)
 			write_hapdiv(t);
 		else
-			write_per_seq(t);
+			write_per_seq(p, t);
+		if (p->is_mmap) // the batch has been written; drop its pages
+			rb3_seq_release(p->fp, (char*)t->seq[t->n_seq - 1].seq + t->seq[t->n_seq - 1].len);
+		for (i = 0; i < p->opt->n_threads; ++i)
+			m_km_put(p, t->km_out[i]);
+		free(t->km_out);
+		m_km_put(p, t->km);
 		free(t->seq);
 		if (rb3_verbose >= 3)
 			fprintf(stderr, "[M::%s::%.3f*%.2f] processed %d sequences\n", __func__, rb3_realtime(), rb3_percent_cpu(), t->n_seq);
@@ -432,6 +568,14 @@ static ko_longopt_t long_options[] = {
 	{ "cov",             ko_no_argument,       304 },
 	{ "old-mem",         ko_no_argument,       305 },
 	{ "all-e2e",         ko_no_argument,       306 },
+	{ "no-kmt",          ko_no_argument,       307 },
+	{ "mvt",             ko_no_argument,       308 },
+	{ "populate",        ko_no_argument,       309 },
+	{ "huge",            ko_no_argument,       310 },
+	{ "hugetlb",         ko_no_argument,       311 },
+	{ "prefault",        ko_no_argument,       312 },
+	{ "shm",             ko_no_argument,       313 },
+	{ "km-trim",         ko_required_argument, 314 },
 	{ "no-kalloc",       ko_no_argument,       501 },
 	{ "dbg-dawg",        ko_no_argument,       502 },
 	{ "dbg-sw",          ko_no_argument,       503 },
@@ -442,13 +586,14 @@ static ko_longopt_t long_options[] = {
 
 int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
 {
-	int32_t c, j, is_line = 0, ret, load_flag = 0, no_ssa = 0;
+	int32_t c, j, is_line = 0, ret, load_flag = 0, no_ssa = 0, no_kmt = 0, n_err = 0;
 	rb3_mopt_t opt;
 	pipeline_t p;
 	ketopt_t o = KETOPT_INIT;
 
 	rb3_mopt_init(&opt);
-	p.opt = &opt, p.id = 0;
+	memset(&p, 0, sizeof(pipeline_t));
+	p.opt = &opt;
 	while ((c = ketopt(&o, argc, argv, 1, "Ll:c:t:K:MdN:A:B:O:E:C:m:k:uj:ey:a:w:p:bg:", long_options)) >= 0) {
 		if (c == 'L') is_line = 1;
 		else if (c == 'a') opt.algo = RB3_SA_HAPDIV, opt.hapdiv_k = atoi(o.arg);
@@ -480,6 +625,14 @@ int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
 		else if (c == 304) opt.flag |= RB3_MF_WRITE_COV;
 		else if (c == 305) opt.algo = RB3_SA_MEM_ORI;
 		else if (c == 306) opt.flag |= RB3_MF_WRITE_ALL, opt.swo.flag |= RB3_SWF_E2E, opt.swo.end_len = 1, no_ssa = 1;
+		else if (c == 307) no_kmt = 1;
+		else if (c == 308) load_flag |= RB3_LOAD_MVT;
+		else if (c == 309) load_flag |= RB3_LOAD_MMAP | RB3_LOAD_POPULATE;
+		else if (c == 310) load_flag |= RB3_LOAD_MMAP | RB3_LOAD_HUGE;
+		else if (c == 311) load_flag |= RB3_LOAD_MMAP | RB3_LOAD_HUGETLB;
+		else if (c == 312) load_flag |= RB3_LOAD_MMAP | RB3_LOAD_PREFAULT;
+		else if (c == 313) load_flag |= RB3_LOAD_SHM;
+		else if (c == 314) opt.km_trim = rb3_parse_num(o.arg);
 		else if (c == 501) opt.flag |= RB3_MF_NO_KALLOC;
 		else if (c == 502) rb3_dbg_flag |= RB3_DBG_DAWG;
 		else if (c == 503) rb3_dbg_flag |= RB3_DBG_SW;
@@ -503,6 +656,7 @@ int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
 	}
 	if (opt.algo == RB3_SA_HAPDIV)
 		opt.swo.flag |= RB3_SWF_E2E | RB3_SWF_HAPDIV;
+	else if (!no_kmt) load_flag |= RB3_LOAD_KMT;
 
 	if (argc - o.ind < 2) {
 		fprintf(stdout, "Usage: ropebwt3 %s [options] <idx.fmr> <seq.fa> [...]\n", argv[0]);
@@ -546,13 +700,22 @@ int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
 		fprintf(stderr, "  -p INT      output up to INT positions [%d]\n", opt.max_pos);
 		fprintf(stderr, "  -L          one sequence per line in the input\n");
 		fprintf(stderr, "  -K NUM      query batch size [100m]\n");
+		fprintf(stderr, "  --km-trim=NUM  max memory kept by each thread buffer between batches (0 for no limit) [%ld]\n", (long)opt.km_trim);
 		fprintf(stderr, "  -M          use mmap to load FMD\n");
+		fprintf(stderr, "  --populate  prefault the FMD mapping with MAP_POPULATE (implies -M)\n");
+		fprintf(stderr, "  --prefault  prefault the FMD mapping with multiple threads (implies -M)\n");
+		fprintf(stderr, "  --huge      load FMD to transparent huge pages (implies -M)\n");
+		fprintf(stderr, "  --hugetlb   load FMD to hugetlbfs pages; fall back to --huge (implies -M)\n");
+		fprintf(stderr, "  --shm       attach to the index put by \"ropebwt3 shm\" if available\n");
+		fprintf(stderr, "  --mvt       convert FMD to the move table after loading\n");
+		if (strcmp(argv[0], "hapdiv") != 0)
+			fprintf(stderr, "  --no-kmt    ignore the k-mer interval table\n");
 		return 0;
 	}
 
-	ret = rb3_fmi_load_all(&p.fmi, argv[o.ind], load_flag);
+	ret = rb3_fmi_load_all(&p.fmi, argv[o.ind], load_flag, opt.n_threads);
 	if (ret < 0) return 1;
-	if (opt.max_pos > 0 && (p.fmi.ssa == 0 || p.fmi.sid == 0)) {
+	if (opt.max_pos > 0 && ((p.fmi.ssa == 0 && p.fmi.phi == 0) || p.fmi.sid == 0)) {
 		if (rb3_verbose >= 1)
 			fprintf(stderr, "ERROR: failed to load suffix array samples or sequence names/lengths\n");
 		return 1;
@@ -567,16 +730,33 @@ int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
 		puts("CC\tQH  refCount   score     editDist   cs   strand   nOut   totAln");
 		puts("CC");
 	}
+	pthread_mutex_init(&p.lock, 0);
+	p.buf = RB3_CALLOC(m_tbuf_t, opt.n_threads);
+	for (j = 0; j < opt.n_threads; ++j)
+		p.buf[j].km = opt.flag & RB3_MF_NO_KALLOC? 0 : km_init();
 	for (j = o.ind + 1; j < argc; ++j) {
-		p.fp = rb3_seq_open(argv[j], is_line);
+		p.fp = rb3_seq_open_mmap(argv[j], is_line, opt.n_threads);
 		if (p.fp == 0) {
 			if (rb3_verbose >= 1)
 				fprintf(stderr, "ERROR: failed to load the sequence file '%s'\n", argv[j]);
 			break;
 		}
+		p.is_mmap = rb3_seq_is_mmap(p.fp);
 		kt_pipeline(2, worker_pipeline, &p, 3);
+		if (rb3_seq_error(p.fp)) ++n_err;
 		rb3_seq_close(p.fp);
 	}
+	for (j = 0; j < opt.n_threads; ++j) {
+		if (p.buf[j].km) m_km_peak(&p, p.buf[j].km);
+		m_tbuf_destroy(&p.buf[j]);
+	}
+	for (j = 0; j < p.n_pool; ++j)
+		km_destroy(p.pool[j]);
+	free(p.pool); free(p.buf); free(p.out.s);
+	pthread_mutex_destroy(&p.lock);
+	if (rb3_verbose >= 3 && !(opt.flag & RB3_MF_NO_KALLOC))
+		fprintf(stderr, "[M::%s::%.3f*%.2f] peak kalloc capacity per buffer: %.1f MB; %d buffers in the pool\n", __func__,
+				rb3_realtime(), rb3_percent_cpu(), p.km_peak / 1048576.0, p.n_pool);
 	rb3_fmi_free(&p.fmi);
-	return 0;
+	return n_err > 0? 1 : 0;
 }
@@ -0,0 +1,376 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "rb3priv.h"
+#include "fm-index.h"
+#include "ketopt.h"
+
+/* An index in POSIX shared memory consists of a header followed by the
+ * sections below, each aligned to 8 bytes:
+ *
+ *   FMD: the content of the .fmd file, which rld_restore_mem() points into
+ *   SSA: ss, ms, m, n_ssa, r2i[m], ssa[n_ssa]
+ *   SID: n_seq, len[n_seq] (int32_t), NULL-terminated names
+ *   KMT: k, n_kmer, tot, a[2*n_kmer]
+ *   PHI: m, n_phi, n_th, off[m], o2s[m], phi[n_phi], th[n_th]
+ *
+ * An absent section has zero length. As with rb3_fmi_load_all(), .phi takes
+ * priority over .ssa, so at most one of PHI and SSA is present.
+ */
+
+#define RB3_SHM_FMD 0
+#define RB3_SHM_SSA 1
+#define RB3_SHM_SID 2
+#define RB3_SHM_KMT 3
+#define RB3_SHM_PHI 4
+#define RB3_SHM_N   5
+
+typedef struct {
+	char magic[8];
+	uint64_t size; // total size of the segment
+	uint64_t dev, ino, fsize; // identity of the .fmd file put to the segment
+	int64_t mtime;
+	uint64_t off[RB3_SHM_N], len[RB3_SHM_N];
+} rb3_shm_hdr_t;
+
+#define shm_align8(x) (((x) + 7) >> 3 << 3)
+
+int rb3_shm_name(const char *fn, char *name, int max)
+{ // shared memory name: the base name of the index followed by the hash of its canonical path
+	char path[PATH_MAX];
+	const char *p, *q;
+	uint64_t h = 0xcbf29ce484222325ULL; // 64-bit FNV-1a
+	q = realpath(fn, path)? path : fn; // the file may have been deleted before dropping
+	for (p = q; *p; ++p)
+		h = (h ^ (uint8_t)*p) * 0x100000001b3ULL;
+	p = strrchr(fn, '/');
+	p = p? p + 1 : fn;
+	if ((int)strlen(p) + 23 > max || *p == 0) return -1;
+	snprintf(name, max, "/rb3-%s-%.16llx", p, (unsigned long long)h);
+	return 0;
+}
+
+/**********
+ * Attach *
+ **********/
+
+int rb3_fmi_shm_attach(rb3_fmi_t *f, const char *fn, int32_t load_flag)
+{
+	char name[256];
+	int fd;
+	struct stat st, fst;
+	uint8_t *mem;
+	const rb3_shm_hdr_t *h;
+
+	memset(f, 0, sizeof(*f));
+	if (rb3_shm_name(fn, name, 256) < 0 || stat(fn, &st) < 0) return -1;
+	fst = st;
+	if ((fd = shm_open(name, O_RDONLY, 0)) < 0) return -1;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(rb3_shm_hdr_t)) {
+		close(fd);
+		return -1;
+	}
+	mem = (uint8_t*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) return -1;
+	h = (const rb3_shm_hdr_t*)mem;
+	if (strncmp(h->magic, "RB3SHM\3", 8) != 0 || h->size != (uint64_t)st.st_size || h->len[RB3_SHM_FMD] == 0) {
+		munmap(mem, st.st_size);
+		return -1;
+	}
+	if (h->dev != (uint64_t)fst.st_dev || h->ino != (uint64_t)fst.st_ino || h->fsize != (uint64_t)fst.st_size || h->mtime != (int64_t)fst.st_mtime) {
+		if (rb3_verbose >= 2)
+			fprintf(stderr, "[W::%s] shared memory \"%s\" was put from a different or modified \"%s\"\n", __func__, name, fn);
+		munmap(mem, st.st_size);
+		return -1;
+	}
+	f->shm = mem, f->shm_size = st.st_size;
+	f->e = rld_restore_mem((const uint64_t*)(mem + h->off[RB3_SHM_FMD]));
+	if (f->e == 0) {
+		rb3_fmi_free(f);
+		return -1;
+	}
+	f->is_fmd = 1;
+	rb3_fmi_get_acc(f, f->acc);
+	if ((load_flag & RB3_LOAD_SSA) && h->len[RB3_SHM_SSA]) {
+		const uint64_t *p = (const uint64_t*)(mem + h->off[RB3_SHM_SSA]);
+		rb3_ssa_t *sa;
+		sa = RB3_CALLOC(rb3_ssa_t, 1);
+		sa->ss = p[0], sa->ms = p[1], sa->m = p[2], sa->n_ssa = p[3];
+		sa->r2i = (uint64_t*)p + 4;
+		sa->ssa = sa->r2i + sa->m;
+		f->ssa = sa;
+	}
+	if ((load_flag & RB3_LOAD_SSA) && h->len[RB3_SHM_PHI]) {
+		const uint64_t *p = (const uint64_t*)(mem + h->off[RB3_SHM_PHI]);
+		rb3_phi_t *ph;
+		ph = RB3_CALLOC(rb3_phi_t, 1);
+		ph->m = p[0], ph->n_phi = p[1], ph->n_th = p[2];
+		ph->off = (uint64_t*)p + 3;
+		ph->o2s = ph->off + ph->m;
+		ph->phi = (rb3_phi_pair_t*)(ph->o2s + ph->m);
+		ph->th = ph->phi + ph->n_phi;
+		f->phi = ph;
+	}
+	if ((load_flag & RB3_LOAD_SSA) && (load_flag & RB3_LOAD_SID) && h->len[RB3_SHM_SID]) {
+		const uint8_t *p = mem + h->off[RB3_SHM_SID];
+		char *q;
+		int64_t i;
+		rb3_sid_t *sid;
+		sid = RB3_CALLOC(rb3_sid_t, 1);
+		sid->n_seq = *(const int64_t*)p;
+		sid->len = (int32_t*)(p + 8);
+		sid->name = RB3_MALLOC(char*, sid->n_seq);
+		for (i = 0, q = (char*)(p + 8 + shm_align8(sid->n_seq * 4)); i < sid->n_seq; ++i) {
+			sid->name[i] = q;
+			q += strlen(q) + 1;
+		}
+		f->sid = sid;
+	}
+	if ((load_flag & RB3_LOAD_KMT) && h->len[RB3_SHM_KMT]) {
+		const uint64_t *p = (const uint64_t*)(mem + h->off[RB3_SHM_KMT]);
+		rb3_kmt_t *t;
+		t = RB3_CALLOC(rb3_kmt_t, 1);
+		t->k = p[0], t->n_kmer = p[1], t->tot = p[2];
+		t->a = (uint64_t*)p + 3;
+		f->kmt = t;
+	}
+	return 0;
+}
+
+void rb3_fmi_shm_detach(rb3_fmi_t *f)
+{ // free the objects pointing into shared memory; the rld_t object doesn't own its data and is freed as usual
+	if (f->shm == 0) return;
+	free(f->ssa);
+	if (f->sid) {
+		free(f->sid->name);
+		free(f->sid);
+	}
+	free(f->kmt);
+	free(f->phi);
+	f->ssa = 0, f->sid = 0, f->kmt = 0, f->phi = 0;
+	munmap(f->shm, f->shm_size);
+	f->shm = 0, f->shm_size = 0;
+}
+
+/****************
+ * Put and drop *
+ ****************/
+
+static uint8_t *shm_read_file(const char *fn, uint64_t *len, struct stat *st0)
+{
+	FILE *fp;
+	struct stat st;
+	uint8_t *buf;
+	*len = 0;
+	if ((fp = fopen(fn, "rb")) == 0) return 0;
+	if (fstat(fileno(fp), &st) < 0) {
+		fclose(fp);
+		return 0;
+	}
+	buf = RB3_MALLOC(uint8_t, st.st_size + 1);
+	if (buf == 0 || fread(buf, 1, st.st_size, fp) != (size_t)st.st_size) {
+		free(buf);
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	*len = st.st_size, *st0 = st;
+	return buf;
+}
+
+int rb3_shm_put(const char *fn)
+{
+	char name[256], *buf;
+	int fd, ret = -1;
+	uint8_t *fmd, *mem;
+	uint64_t len_fmd, size, len[RB3_SHM_N];
+	rld_t *e;
+	rb3_ssa_t *sa = 0;
+	rb3_sid_t *sid = 0;
+	rb3_kmt_t *kmt = 0;
+	rb3_phi_t *ph = 0;
+	rb3_shm_hdr_t *h;
+	FILE *fp;
+	int64_t i;
+	struct stat st;
+
+	if (rb3_shm_name(fn, name, 256) < 0) {
+		fprintf(stderr, "[E::%s] invalid index name \"%s\"\n", __func__, fn);
+		return -1;
+	}
+	if ((fmd = shm_read_file(fn, &len_fmd, &st)) == 0) {
+		fprintf(stderr, "[E::%s] failed to read file \"%s\"\n", __func__, fn);
+		return -1;
+	}
+	e = len_fmd >= 32? rld_restore_mem((const uint64_t*)fmd) : 0;
+	if (e == 0 || rld_mem_size(e) != len_fmd) {
+		fprintf(stderr, "[E::%s] \"%s\" is not in the FMD format\n", __func__, fn);
+		rld_destroy(e); free(fmd);
+		return -1;
+	}
+	buf = RB3_CALLOC(char, strlen(fn) + 8);
+	strcat(strcpy(buf, fn), ".phi");
+	if ((fp = fopen(buf, "r")) != 0) {
+		fclose(fp);
+		if ((ph = rb3_phi_restore(buf)) != 0 && (uint64_t)ph->m != e->mcnt[1]) {
+			rb3_phi_destroy(ph);
+			ph = 0;
+		}
+		if (ph == 0 && rb3_verbose >= 1)
+			fprintf(stderr, "[W::%s] failed to load the phi samples or they don't match the BWT\n", __func__);
+	}
+	strcat(strcpy(buf, fn), ".ssa");
+	if (ph == 0 && (fp = fopen(buf, "r")) != 0) { // prefer the phi samples as rb3_fmi_load_all() does
+		fclose(fp);
+		if ((sa = rb3_ssa_restore(buf)) != 0 && (uint64_t)sa->m != e->mcnt[1]) {
+			rb3_ssa_destroy(sa);
+			sa = 0;
+		}
+		if (sa == 0 && rb3_verbose >= 1)
+			fprintf(stderr, "[W::%s] failed to load the sampled suffix array or it doesn't match the BWT\n", __func__);
+	}
+	strcat(strcpy(buf, fn), ".len.gz");
+	if ((fp = fopen(buf, "r")) != 0) {
+		fclose(fp);
+		if ((sid = rb3_sid_read(buf)) != 0 && (uint64_t)sid->n_seq * 2 != e->mcnt[1]) {
+			rb3_sid_destroy(sid);
+			sid = 0;
+		}
+		if (sid == 0 && rb3_verbose >= 1)
+			fprintf(stderr, "[W::%s] failed to load the sequence list or it doesn't match the BWT\n", __func__);
+	}
+	strcat(strcpy(buf, fn), ".kmt");
+	if ((fp = fopen(buf, "r")) != 0) {
+		fclose(fp);
+		if ((kmt = rb3_kmt_restore(buf)) != 0 && (uint64_t)kmt->tot != e->mcnt[0]) {
+			rb3_kmt_destroy(kmt);
+			kmt = 0;
+		}
+		if (kmt == 0 && rb3_verbose >= 1)
+			fprintf(stderr, "[W::%s] failed to load the k-mer table or it doesn't match the BWT\n", __func__);
+	}
+	free(buf);
+
+	// compute the layout
+	len[RB3_SHM_FMD] = len_fmd;
+	len[RB3_SHM_SSA] = sa? (4 + sa->m + sa->n_ssa) * 8 : 0;
+	len[RB3_SHM_SID] = 0;
+	if (sid) {
+		len[RB3_SHM_SID] = 8 + shm_align8(sid->n_seq * 4);
+		for (i = 0; i < sid->n_seq; ++i)
+			len[RB3_SHM_SID] += strlen(sid->name[i]) + 1;
+	}
+	len[RB3_SHM_KMT] = kmt? (3 + 2 * kmt->n_kmer) * 8 : 0;
+	len[RB3_SHM_PHI] = ph? (3 + 2 * ph->m + 2 * ph->n_phi + 2 * ph->n_th) * 8 : 0;
+	size = shm_align8(sizeof(rb3_shm_hdr_t));
+	for (i = 0; i < RB3_SHM_N; ++i) size += shm_align8(len[i]);
+
+	// create and fill the segment
+	fd = shm_open(name, O_CREAT|O_EXCL|O_RDWR, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "[E::%s] failed to create shared memory \"%s\"; drop it first if it exists\n", __func__, name);
+		goto end_put;
+	}
+	if (ftruncate(fd, size) < 0 || (mem = (uint8_t*)mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "[E::%s] failed to allocate %ld bytes of shared memory\n", __func__, (long)size);
+		close(fd);
+		shm_unlink(name);
+		goto end_put;
+	}
+	close(fd);
+	h = (rb3_shm_hdr_t*)mem;
+	memcpy(h->magic, "RB3SHM\3", 8);
+	h->size = size;
+	h->dev = st.st_dev, h->ino = st.st_ino, h->fsize = st.st_size, h->mtime = st.st_mtime;
+	h->off[0] = shm_align8(sizeof(rb3_shm_hdr_t));
+	for (i = 0; i < RB3_SHM_N; ++i) {
+		if (i > 0) h->off[i] = h->off[i-1] + shm_align8(len[i-1]);
+		h->len[i] = len[i];
+	}
+	memcpy(mem + h->off[RB3_SHM_FMD], fmd, len_fmd);
+	if (sa) {
+		uint64_t *p = (uint64_t*)(mem + h->off[RB3_SHM_SSA]);
+		p[0] = sa->ss, p[1] = sa->ms, p[2] = sa->m, p[3] = sa->n_ssa;
+		memcpy(p + 4, sa->r2i, sa->m * 8);
+		memcpy(p + 4 + sa->m, sa->ssa, sa->n_ssa * 8);
+	}
+	if (sid) {
+		uint8_t *p = mem + h->off[RB3_SHM_SID];
+		char *q;
+		*(int64_t*)p = sid->n_seq;
+		memcpy(p + 8, sid->len, sid->n_seq * 4);
+		for (i = 0, q = (char*)(p + 8 + shm_align8(sid->n_seq * 4)); i < sid->n_seq; ++i) {
+			strcpy(q, sid->name[i]);
+			q += strlen(q) + 1;
+		}
+	}
+	if (kmt) {
+		uint64_t *p = (uint64_t*)(mem + h->off[RB3_SHM_KMT]);
+		p[0] = kmt->k, p[1] = kmt->n_kmer, p[2] = kmt->tot;
+		memcpy(p + 3, kmt->a, kmt->n_kmer * 16);
+	}
+	if (ph) {
+		uint64_t *p = (uint64_t*)(mem + h->off[RB3_SHM_PHI]);
+		p[0] = ph->m, p[1] = ph->n_phi, p[2] = ph->n_th;
+		memcpy(p + 3, ph->off, ph->m * 8);
+		memcpy(p + 3 + ph->m, ph->o2s, ph->m * 8);
+		memcpy(p + 3 + 2 * ph->m, ph->phi, ph->n_phi * 16);
+		memcpy(p + 3 + 2 * ph->m + 2 * ph->n_phi, ph->th, ph->n_th * 16);
+	}
+	munmap(mem, size);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] put %.1f MB to shared memory \"%s\" (SSA: %s; phi: %s; names: %s; k-mer table: %s)\n", __func__,
+				rb3_realtime(), rb3_percent_cpu(), size / 1048576.0, name, sa? "yes" : "no", ph? "yes" : "no", sid? "yes" : "no", kmt? "yes" : "no");
+	ret = 0;
+
+end_put:
+	rld_destroy(e); free(fmd);
+	rb3_ssa_destroy(sa);
+	rb3_sid_destroy(sid);
+	rb3_kmt_destroy(kmt);
+	rb3_phi_destroy(ph);
+	return ret;
+}
+
+int rb3_shm_drop(const char *fn)
+{
+	char name[256];
+	if (rb3_shm_name(fn, name, 256) < 0) return -1;
+	return shm_unlink(name);
+}
+
+/*******************
+ * main() function *
+ *******************/
+
+int main_shm(int argc, char *argv[])
+{
+	int c, to_drop = 0, ret = 0;
+	ketopt_t o = KETOPT_INIT;
+
+	while ((c = ketopt(&o, argc, argv, 1, "d", 0)) >= 0) {
+		if (c == 'd') to_drop = 1;
+	}
+	if (argc == o.ind) {
+		fprintf(stderr, "Usage: ropebwt3 shm [options] <idx.fmd>\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  -d         drop the index from shared memory\n");
+		fprintf(stderr, "Notes: the index, with .phi (preferred) or .ssa, .len.gz and .kmt if present, is put to /dev/shm/rb3-<idx.fmd>-<hash>,\n");
+		fprintf(stderr, "  where <hash> is computed from the canonical path of <idx.fmd>.\n");
+		fprintf(stderr, "  Use option --shm with mem/sw to attach.\n");
+		return 1;
+	}
+	if (to_drop) {
+		if (rb3_shm_drop(argv[o.ind]) < 0) {
+			fprintf(stderr, "[E::%s] failed to drop \"%s\" from shared memory\n", __func__, argv[o.ind]);
+			ret = 1;
+		}
+	} else if (rb3_shm_put(argv[o.ind]) < 0) ret = 1;
+	return ret;
+}
@@ -17,13 +17,12 @@ typedef struct { size_t n, m; uint64_t *a; } uint64_v;
 static void ssa_gen1(void *km, const rb3_fmi_t *f, rb3_ssa_t *sa, int64_t k, uint64_v *buf)
 {
 	int32_t c, mask = (1<<sa->ss) - 1;
-	int64_t ok[RB3_ASIZE], k0 = k, l = 0;
+	int64_t k0 = k, l = 0, j = -1;
 	size_t i;
 	buf->n = 0;
 	do {
 		++l;
-		c = rb3_fmi_rank1a(f, k, ok);
-		k = f->acc[c] + ok[c];
+		c = rb3_fmi_lf(f, &k, &j);
 		if (c) {
 			if (((k - f->acc[1]) & mask) == 0) {
 				int64_t x = (k - f->acc[1]) >> sa->ss;
@@ -93,14 +92,12 @@ void rb3_ssa_destroy(rb3_ssa_t *sa)
 int64_t rb3_ssa(const rb3_fmi_t *f, const rb3_ssa_t *sa, int64_t k, int64_t *si)
 {
 	int32_t c, mask = (1<<sa->ss) - 1;
-	int64_t x = 0;
-	int64_t ok[RB3_ASIZE];
+	int64_t x = 0, j = -1;
 	*si = -1;
 	if (k >= f->acc[6]) return -1;
 	while (k < f->acc[1] || ((k - f->acc[1]) & mask)) {
 		++x;
-		c = rb3_fmi_rank1a(f, k, ok);
-		k = f->acc[c] + ok[c];
+		c = rb3_fmi_lf(f, &k, &j);
 		if (c == 0) {
 			*si = sa->r2i[k];
 			return x - 1;
@@ -246,14 +243,15 @@ rb3_ssa_t *rb3_ssa_restore(const char *fn)
 
 int main_ssa(int argc, char *argv[])
 {
-	int c, n_threads = 4, ssa_shift = 8;
+	int c, n_threads = 4, ssa_shift = 8, use_mvt = 0;
 	rb3_ssa_t *sa;
 	rb3_fmi_t f;
 	char *fn = 0;
 	ketopt_t o = KETOPT_INIT;
 
-	while ((c = ketopt(&o, argc, argv, 1, "t:s:o:", 0)) >= 0) {
+	while ((c = ketopt(&o, argc, argv, 1, "t:s:o:v", 0)) >= 0) {
 		if (c == 't') n_threads = atoi(o.arg);
+		else if (c == 'v') use_mvt = 1;
 		else if (c == 's') ssa_shift = atoi(o.arg);
 		else if (c == 'o') fn = o.arg;
 	}
@@ -263,6 +261,7 @@ int main_ssa(int argc, char *argv[])
 		fprintf(stderr, "  -t INT     number of threads [%d]\n", n_threads);
 		fprintf(stderr, "  -s INT     sample rate one SA per 2**INT bases [%d]\n", ssa_shift);
 		fprintf(stderr, "  -o FILE    output to file [stdout]\n");
+		fprintf(stderr, "  -v         use the move table for LF-mapping (more memory)\n");
 		return 1;
 	}
 	rb3_fmi_restore(&f, argv[o.ind], 0);
@@ -270,6 +269,7 @@ int main_ssa(int argc, char *argv[])
 		fprintf(stderr, "[E::%s] failed to load the FM-index\n", __func__);
 		return 1;
 	}
+	if (use_mvt) rb3_fmi_to_mvt(&f);
 	sa = rb3_ssa_gen(&f, ssa_shift, n_threads);
 
 	rb3_ssa_dump(sa, fn);